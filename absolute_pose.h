@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "linalg.h"
+#include "polynomial.h"
+#include "relative_pose.h"
+
+// Pose of a camera from 3D points and their normalized image coordinates.
+// The pose maps points into the camera, X_camera = R * X + t, the same
+// convention as the relative pose.
+
+constexpr int max_p3p_solutions = 4;
+
+// Rotation taking the frame spanned by a triangle (a, b, c) to axes.
+Mat3 get_triangle_frame(const Vec3& a, const Vec3& b, const Vec3& c) {
+  const Vec3 e0 = normalized(b - a);
+  const Vec3 e2 = normalized(cross(b - a, c - a));
+  const Vec3 e1 = cross(e2, e0);
+  Mat3 frame;
+  set_column(&frame, 0, e0);
+  set_column(&frame, 1, e1);
+  set_column(&frame, 2, e2);
+  return frame;
+}
+
+// Grunert's P3P solution as presented by Haralick et al. Bearings need not be
+// unit length. Writes up to four poses and returns how many were found.
+int solve_p3p(Mat3* rotations_ptr, Vec3* translations_ptr, const Vec3 points[3], const Vec3 bearings[3]) {
+  const Vec3 j1 = normalized(bearings[0]);
+  const Vec3 j2 = normalized(bearings[1]);
+  const Vec3 j3 = normalized(bearings[2]);
+
+  const double a2 = dot(points[1] - points[2], points[1] - points[2]);
+  const double b2 = dot(points[0] - points[2], points[0] - points[2]);
+  const double c2 = dot(points[0] - points[1], points[0] - points[1]);
+  if (a2 < 1e-12 || b2 < 1e-12 || c2 < 1e-12) {
+    return 0;
+  }
+
+  const double cos_alpha = dot(j2, j3);
+  const double cos_beta = dot(j1, j3);
+  const double cos_gamma = dot(j1, j2);
+
+  const double p = (a2 - c2) / b2;
+  const double q = (a2 + c2) / b2;
+  const double r = (b2 - c2) / b2;
+  const double s = (b2 - a2) / b2;
+  const double cos_alpha2 = cos_alpha * cos_alpha;
+  const double cos_beta2 = cos_beta * cos_beta;
+  const double cos_gamma2 = cos_gamma * cos_gamma;
+
+  // Quartic in v = s3 / s1.
+  double quartic[5];
+  quartic[4] = (p - 1.0) * (p - 1.0) - 4.0 * c2 / b2 * cos_alpha2;
+  quartic[3] = 4.0 * (p * (1.0 - p) * cos_beta - (1.0 - q) * cos_alpha * cos_gamma + 2.0 * c2 / b2 * cos_alpha2 * cos_beta);
+  quartic[2] = 2.0 * (p * p - 1.0 + 2.0 * p * p * cos_beta2 + 2.0 * r * cos_alpha2 -
+                      4.0 * q * cos_alpha * cos_beta * cos_gamma + 2.0 * s * cos_gamma2);
+  quartic[1] = 4.0 * (-p * (1.0 + p) * cos_beta + 2.0 * a2 / b2 * cos_gamma2 * cos_beta - (1.0 - q) * cos_alpha * cos_gamma);
+  quartic[0] = (1.0 + p) * (1.0 + p) - 4.0 * a2 / b2 * cos_gamma2;
+
+  std::vector<double> roots;
+  roots.reserve(4);
+  find_real_roots(&roots, quartic, 4);
+
+  const Mat3 world_frame = get_triangle_frame(points[0], points[1], points[2]);
+
+  int solution_count = 0;
+  for (const double v : roots) {
+    if (v <= 0.0) {
+      continue;
+    }
+    const double denominator = 2.0 * (cos_gamma - v * cos_alpha);
+    if (std::fabs(denominator) < 1e-12) {
+      continue;
+    }
+    const double u = ((p - 1.0) * v * v - 2.0 * p * cos_beta * v + 1.0 + p) / denominator;
+    if (u <= 0.0) {
+      continue;
+    }
+
+    const double s1_squared = b2 / (1.0 + v * v - 2.0 * v * cos_beta);
+    if (!(s1_squared > 0.0)) {
+      continue;
+    }
+    const double s1 = std::sqrt(s1_squared);
+
+    const Vec3 camera_points[3] = { s1 * j1, (u * s1) * j2, (v * s1) * j3 };
+
+    // The triangle is known in both frames, align them directly.
+    const Mat3 camera_frame = get_triangle_frame(camera_points[0], camera_points[1], camera_points[2]);
+    const Mat3 rotation = camera_frame * transpose(world_frame);
+    rotations_ptr[solution_count] = rotation;
+    translations_ptr[solution_count] = camera_points[0] - rotation * points[0];
+    if (++solution_count == max_p3p_solutions) {
+      break;
+    }
+  }
+  return solution_count;
+}
+
+struct AbsolutePoseParameters {
+  // Reprojection error in normalized image coordinates, a couple of pixels
+  // divided by the focal length.
+  float threshold = 0.004f;
+  double confidence = 0.99;
+  int max_iterations = 500;
+  uint64_t seed = 0;
+  // Optional pose prior, e.g. from the motion model. It is scored before the
+  // first sample, so a good prior lowers the iterations needed to reach the
+  // confidence from the start.
+  bool use_prior = false;
+  Mat3 prior_rotation = identity3();
+  Vec3 prior_translation = {};
+};
+
+struct AbsolutePose {
+  Mat3 rotation;
+  Vec3 translation;
+  int inlier_count;
+  int iteration_count;
+  std::vector<unsigned char> inlier_mask;
+};
+
+// Truncated squared reprojection error of a pose, in units of the squared
+// threshold. Points behind the camera cost the maximum of one.
+float score_absolute_pose(int* inlier_count_ptr,
+                          const Mat3& rotation,
+                          const Vec3& translation,
+                          const float* point_x_ptr,
+                          const float* point_y_ptr,
+                          const float* point_z_ptr,
+                          const float* x_ptr,
+                          const float* y_ptr,
+                          int count,
+                          float threshold,
+                          float max_cost) {
+  float r[9];
+  for (int k = 0; k < 9; ++k) {
+    r[k] = float(rotation.m[k / 3][k % 3]);
+  }
+  const float t[3] = { float(translation.x), float(translation.y), float(translation.z) };
+  const float inverse_threshold_squared = 1.0f / (threshold * threshold);
+
+  float cost = 0.0f;
+  int inlier_count = 0;
+  int index = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  const __m256 r00 = _mm256_set1_ps(r[0]), r01 = _mm256_set1_ps(r[1]), r02 = _mm256_set1_ps(r[2]);
+  const __m256 r10 = _mm256_set1_ps(r[3]), r11 = _mm256_set1_ps(r[4]), r12 = _mm256_set1_ps(r[5]);
+  const __m256 r20 = _mm256_set1_ps(r[6]), r21 = _mm256_set1_ps(r[7]), r22 = _mm256_set1_ps(r[8]);
+  const __m256 t0 = _mm256_set1_ps(t[0]), t1 = _mm256_set1_ps(t[1]), t2 = _mm256_set1_ps(t[2]);
+  const __m256 scale = _mm256_set1_ps(inverse_threshold_squared);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 zero = _mm256_setzero_ps();
+
+  constexpr int block_size = 256;
+  while (index + 8 <= count) {
+    __m256 block_cost = _mm256_setzero_ps();
+    const int block_end = std::min(count, index + block_size) - 7;
+    for (; index < block_end; index += 8) {
+      const __m256 px = _mm256_loadu_ps(point_x_ptr + index);
+      const __m256 py = _mm256_loadu_ps(point_y_ptr + index);
+      const __m256 pz = _mm256_loadu_ps(point_z_ptr + index);
+
+      const __m256 cx = _mm256_fmadd_ps(r00, px, _mm256_fmadd_ps(r01, py, _mm256_fmadd_ps(r02, pz, t0)));
+      const __m256 cy = _mm256_fmadd_ps(r10, px, _mm256_fmadd_ps(r11, py, _mm256_fmadd_ps(r12, pz, t1)));
+      const __m256 cz = _mm256_fmadd_ps(r20, px, _mm256_fmadd_ps(r21, py, _mm256_fmadd_ps(r22, pz, t2)));
+
+      const __m256 inverse_z = _mm256_div_ps(one, cz);
+      const __m256 dx = _mm256_fmsub_ps(cx, inverse_z, _mm256_loadu_ps(x_ptr + index));
+      const __m256 dy = _mm256_fmsub_ps(cy, inverse_z, _mm256_loadu_ps(y_ptr + index));
+      __m256 error = _mm256_mul_ps(_mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy)), scale);
+      error = _mm256_blendv_ps(one, error, _mm256_cmp_ps(cz, zero, _CMP_GT_OQ));
+      error = _mm256_min_ps(error, one);
+
+      inlier_count += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(error, one, _CMP_LT_OQ)));
+      block_cost = _mm256_add_ps(block_cost, error);
+    }
+
+    const __m128 half = _mm_add_ps(_mm256_castps256_ps128(block_cost), _mm256_extractf128_ps(block_cost, 1));
+    const __m128 quarter = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    cost += _mm_cvtss_f32(_mm_add_ss(quarter, _mm_movehdup_ps(quarter)));
+    if (cost > max_cost) {
+      *inlier_count_ptr = inlier_count;
+      return cost;
+    }
+  }
+#endif
+
+  for (; index < count; ++index) {
+    const float px = point_x_ptr[index];
+    const float py = point_y_ptr[index];
+    const float pz = point_z_ptr[index];
+    const float cx = r[0] * px + r[1] * py + r[2] * pz + t[0];
+    const float cy = r[3] * px + r[4] * py + r[5] * pz + t[1];
+    const float cz = r[6] * px + r[7] * py + r[8] * pz + t[2];
+    float error = 1.0f;
+    if (cz > 0.0f) {
+      const float dx = cx / cz - x_ptr[index];
+      const float dy = cy / cz - y_ptr[index];
+      error = std::min(1.0f, (dx * dx + dy * dy) * inverse_threshold_squared);
+    }
+    inlier_count += error < 1.0f;
+    cost += error;
+    if ((index & 255) == 255 && cost > max_cost) {
+      break;
+    }
+  }
+
+  *inlier_count_ptr = inlier_count;
+  return cost;
+}
+
+// P3P RANSAC. Like estimate_relative_pose the correspondences should be sorted
+// best first, samples follow the PROSAC schedule and only depend on the seed.
+// Returns false when fewer than three points are given or no pose was found.
+bool estimate_absolute_pose(AbsolutePose* pose_ptr,
+                            const float* point_x_ptr,
+                            const float* point_y_ptr,
+                            const float* point_z_ptr,
+                            const float* x_ptr,
+                            const float* y_ptr,
+                            int count,
+                            const AbsolutePoseParameters& parameters = {}) {
+  pose_ptr->inlier_count = 0;
+  pose_ptr->iteration_count = 0;
+  pose_ptr->inlier_mask.assign(count, 0);
+  if (count < 3) {
+    return false;
+  }
+
+  constexpr int sample_size = 3;
+  std::vector<int> schedule;
+  build_prosac_schedule(&schedule, count, sample_size);
+
+  float best_cost = count + 1.0f;
+  int required_iterations = parameters.max_iterations;
+
+  if (parameters.use_prior) {
+    int inlier_count;
+    best_cost = score_absolute_pose(&inlier_count, parameters.prior_rotation, parameters.prior_translation,
+                                    point_x_ptr, point_y_ptr, point_z_ptr, x_ptr, y_ptr, count,
+                                    parameters.threshold, best_cost);
+    pose_ptr->rotation = parameters.prior_rotation;
+    pose_ptr->translation = parameters.prior_translation;
+    pose_ptr->inlier_count = inlier_count;
+    required_iterations = get_required_iterations(inlier_count, count, sample_size,
+                                                  parameters.confidence, parameters.max_iterations);
+  }
+
+  int iteration = 0;
+  for (; iteration < required_iterations; ++iteration) {
+    int sample[sample_size];
+    draw_prosac_sample(sample, sample_size, &schedule, count, iteration, parameters.seed);
+
+    Vec3 points[3];
+    Vec3 bearings[3];
+    for (int i = 0; i < 3; ++i) {
+      points[i] = { point_x_ptr[sample[i]], point_y_ptr[sample[i]], point_z_ptr[sample[i]] };
+      bearings[i] = { x_ptr[sample[i]], y_ptr[sample[i]], 1.0 };
+    }
+
+    Mat3 rotations[max_p3p_solutions];
+    Vec3 translations[max_p3p_solutions];
+    const int solution_count = solve_p3p(rotations, translations, points, bearings);
+
+    for (int solution = 0; solution < solution_count; ++solution) {
+      int inlier_count;
+      const float cost = score_absolute_pose(&inlier_count, rotations[solution], translations[solution],
+                                             point_x_ptr, point_y_ptr, point_z_ptr, x_ptr, y_ptr, count,
+                                             parameters.threshold, best_cost);
+      if (cost < best_cost) {
+        best_cost = cost;
+        pose_ptr->rotation = rotations[solution];
+        pose_ptr->translation = translations[solution];
+        pose_ptr->inlier_count = inlier_count;
+        required_iterations = get_required_iterations(inlier_count, count, sample_size,
+                                                      parameters.confidence, parameters.max_iterations);
+      }
+    }
+  }
+  pose_ptr->iteration_count = iteration;
+
+  if (pose_ptr->inlier_count == 0) {
+    return false;
+  }
+
+  // Final inlier set with the same test as the scoring.
+  const float threshold_squared = parameters.threshold * parameters.threshold;
+  const Mat3& rotation = pose_ptr->rotation;
+  const Vec3& translation = pose_ptr->translation;
+  int inlier_count = 0;
+  for (int index = 0; index < count; ++index) {
+    const Vec3 camera_point = rotation * Vec3{ point_x_ptr[index], point_y_ptr[index], point_z_ptr[index] } + translation;
+    bool inlier = false;
+    if (camera_point.z > 0.0) {
+      const double dx = camera_point.x / camera_point.z - x_ptr[index];
+      const double dy = camera_point.y / camera_point.z - y_ptr[index];
+      inlier = dx * dx + dy * dy < threshold_squared;
+    }
+    pose_ptr->inlier_mask[index] = inlier;
+    inlier_count += inlier;
+  }
+  pose_ptr->inlier_count = inlier_count;
+  return true;
+}
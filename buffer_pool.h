@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+
+// Recycles 32 byte aligned buffers. Frames are all the same resolution, so
+// after the first few frames every acquire is served from the free list.
+struct BufferPool {
+  std::vector<size_t> free_sizes;
+  std::vector<void*> free_buffers;
+};
+
+void* acquire_buffer(BufferPool* pool_ptr, size_t size) {
+  for (size_t index = 0; index < pool_ptr->free_buffers.size(); ++index) {
+    if (pool_ptr->free_sizes[index] == size) {
+      void* buffer_ptr = pool_ptr->free_buffers[index];
+      pool_ptr->free_buffers[index] = pool_ptr->free_buffers.back();
+      pool_ptr->free_sizes[index] = pool_ptr->free_sizes.back();
+      pool_ptr->free_buffers.pop_back();
+      pool_ptr->free_sizes.pop_back();
+      return buffer_ptr;
+    }
+  }
+
+  return std::aligned_alloc(32, (size + 31) & ~size_t(31));
+}
+
+void release_buffer(BufferPool* pool_ptr, void* buffer_ptr, size_t size) {
+  if (buffer_ptr == nullptr) {
+    return;
+  }
+  pool_ptr->free_buffers.push_back(buffer_ptr);
+  pool_ptr->free_sizes.push_back(size);
+}
+
+void free_buffer_pool(BufferPool* pool_ptr) {
+  for (void* buffer_ptr : pool_ptr->free_buffers) {
+    std::free(buffer_ptr);
+  }
+  pool_ptr->free_buffers.clear();
+  pool_ptr->free_sizes.clear();
+}
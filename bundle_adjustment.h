@@ -0,0 +1,422 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "linalg.h"
+
+// A window of keyframes and the points they observe. Poses map world to
+// camera, observations are on the normalized image plane.
+struct BundleAdjustmentProblem {
+  std::vector<Mat3> rotations;
+  std::vector<Vec3> translations;
+  // Keyframes held constant. At least one must be fixed to pin the gauge,
+  // usually the oldest of the window plus keyframes outside it that see
+  // the same points.
+  std::vector<unsigned char> fixed;
+  std::vector<Vec3> points;
+  std::vector<int> observation_keyframes;
+  std::vector<int> observation_points;
+  std::vector<float> observation_x;
+  std::vector<float> observation_y;
+};
+
+struct BundleAdjustmentParameters {
+  int max_iterations = 10;
+  // Residual norm where the Huber loss turns from quadratic to linear.
+  double huber_threshold = 0.004;
+  double initial_lambda = 1e-4;
+};
+
+struct BundleAdjustmentResult {
+  int iteration_count;
+  double initial_cost;
+  double final_cost;
+};
+
+int add_keyframe(BundleAdjustmentProblem* problem_ptr, const Mat3& rotation, const Vec3& translation, bool fixed) {
+  problem_ptr->rotations.push_back(rotation);
+  problem_ptr->translations.push_back(translation);
+  problem_ptr->fixed.push_back(fixed);
+  return int(problem_ptr->rotations.size()) - 1;
+}
+
+int add_point(BundleAdjustmentProblem* problem_ptr, const Vec3& point) {
+  problem_ptr->points.push_back(point);
+  return int(problem_ptr->points.size()) - 1;
+}
+
+void add_observation(BundleAdjustmentProblem* problem_ptr, int keyframe_index, int point_index, float x, float y) {
+  problem_ptr->observation_keyframes.push_back(keyframe_index);
+  problem_ptr->observation_points.push_back(point_index);
+  problem_ptr->observation_x.push_back(x);
+  problem_ptr->observation_y.push_back(y);
+}
+
+// Solves a * x = b in place for a symmetric positive definite n x n matrix,
+// only the lower triangle of a is read. Returns false if a is not positive
+// definite.
+bool solve_cholesky(double* a_ptr, double* b_ptr, int n) {
+  for (int j = 0; j < n; ++j) {
+    double diagonal = a_ptr[j * n + j];
+    for (int k = 0; k < j; ++k) {
+      diagonal -= a_ptr[j * n + k] * a_ptr[j * n + k];
+    }
+    if (diagonal <= 0.0) {
+      return false;
+    }
+    diagonal = std::sqrt(diagonal);
+    a_ptr[j * n + j] = diagonal;
+
+    for (int i = j + 1; i < n; ++i) {
+      double value = a_ptr[i * n + j];
+      for (int k = 0; k < j; ++k) {
+        value -= a_ptr[i * n + k] * a_ptr[j * n + k];
+      }
+      a_ptr[i * n + j] = value / diagonal;
+    }
+  }
+
+  for (int i = 0; i < n; ++i) {
+    double value = b_ptr[i];
+    for (int k = 0; k < i; ++k) {
+      value -= a_ptr[i * n + k] * b_ptr[k];
+    }
+    b_ptr[i] = value / a_ptr[i * n + i];
+  }
+  for (int i = n - 1; i >= 0; --i) {
+    double value = b_ptr[i];
+    for (int k = i + 1; k < n; ++k) {
+      value -= a_ptr[k * n + i] * b_ptr[k];
+    }
+    b_ptr[i] = value / a_ptr[i * n + i];
+  }
+  return true;
+}
+
+constexpr double bundle_adjustment_min_depth = 1e-6;
+
+double get_huber_cost(double squared_norm, double threshold) {
+  if (squared_norm <= threshold * threshold) {
+    return 0.5 * squared_norm;
+  }
+  return threshold * (std::sqrt(squared_norm) - 0.5 * threshold);
+}
+
+// Robust cost of the whole window. A point behind a camera costs as much as
+// a unit residual, so steps that flip points are rejected.
+double compute_bundle_adjustment_cost(const std::vector<Mat3>& rotations,
+                                      const std::vector<Vec3>& translations,
+                                      const std::vector<Vec3>& points,
+                                      const BundleAdjustmentProblem* problem_ptr,
+                                      double threshold) {
+  double cost = 0.0;
+  const int observation_count = int(problem_ptr->observation_keyframes.size());
+  for (int index = 0; index < observation_count; ++index) {
+    const int keyframe_index = problem_ptr->observation_keyframes[index];
+    const Vec3 camera_point = rotations[keyframe_index] * points[problem_ptr->observation_points[index]] +
+                              translations[keyframe_index];
+    if (camera_point.z <= bundle_adjustment_min_depth) {
+      cost += get_huber_cost(1.0, threshold);
+      continue;
+    }
+    const double dx = camera_point.x / camera_point.z - problem_ptr->observation_x[index];
+    const double dy = camera_point.y / camera_point.z - problem_ptr->observation_y[index];
+    cost += get_huber_cost(dx * dx + dy * dy, threshold);
+  }
+  return cost;
+}
+
+// Weighted Jacobians of one observation. The pose is perturbed on the left,
+// R <- exp(w) R and t <- exp(w) t + v with the update ordered (w, v).
+struct ObservationLinearization {
+  double pose_jacobian[2][6];
+  double point_jacobian[2][3];
+  double residual[2];
+  double weight;
+};
+
+void linearize_observation(ObservationLinearization* linearization_ptr,
+                           const Mat3& rotation,
+                           const Vec3& translation,
+                           const Vec3& point,
+                           float x,
+                           float y,
+                           double threshold) {
+  const Vec3 camera_point = rotation * point + translation;
+  if (camera_point.z <= bundle_adjustment_min_depth) {
+    *linearization_ptr = {};
+    return;
+  }
+
+  const double inverse_z = 1.0 / camera_point.z;
+  const double u = camera_point.x * inverse_z;
+  const double v = camera_point.y * inverse_z;
+  const double projection[2][3] = {
+    { inverse_z, 0.0, -u * inverse_z },
+    { 0.0, inverse_z, -v * inverse_z },
+  };
+
+  // d(camera_point)/dw = -[camera_point]x, d(camera_point)/dv = I.
+  const Mat3 rotation_derivative = skew(-camera_point);
+  for (int row = 0; row < 2; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      double rotation_term = 0.0;
+      double point_term = 0.0;
+      for (int k = 0; k < 3; ++k) {
+        rotation_term += projection[row][k] * rotation_derivative.m[k][column];
+        point_term += projection[row][k] * rotation.m[k][column];
+      }
+      linearization_ptr->pose_jacobian[row][column] = rotation_term;
+      linearization_ptr->pose_jacobian[row][column + 3] = projection[row][column];
+      linearization_ptr->point_jacobian[row][column] = point_term;
+    }
+  }
+
+  linearization_ptr->residual[0] = u - x;
+  linearization_ptr->residual[1] = v - y;
+
+  // Huber as iteratively reweighted least squares.
+  const double residual_norm = std::sqrt(linearization_ptr->residual[0] * linearization_ptr->residual[0] +
+                                         linearization_ptr->residual[1] * linearization_ptr->residual[1]);
+  linearization_ptr->weight = residual_norm <= threshold ? 1.0 : threshold / residual_norm;
+}
+
+// Levenberg-Marquardt over the free keyframe poses and all points. Points
+// are eliminated with the Schur complement, each point block is 3x3 and
+// only couples the keyframes that observe it, so the reduced camera system
+// is 6 * free_keyframes wide and solved densely. Poses and points are
+// updated in place.
+void run_bundle_adjustment(BundleAdjustmentResult* result_ptr,
+                           BundleAdjustmentProblem* problem_ptr,
+                           const BundleAdjustmentParameters& parameters = {}) {
+  const int keyframe_count = int(problem_ptr->rotations.size());
+  const int point_count = int(problem_ptr->points.size());
+  const int observation_count = int(problem_ptr->observation_keyframes.size());
+  const double threshold = parameters.huber_threshold;
+
+  std::vector<int> free_indices(keyframe_count, -1);
+  int free_count = 0;
+  for (int keyframe_index = 0; keyframe_index < keyframe_count; ++keyframe_index) {
+    if (!problem_ptr->fixed[keyframe_index]) {
+      free_indices[keyframe_index] = free_count++;
+    }
+  }
+
+  // Observations grouped by point for the elimination.
+  std::vector<int> point_offsets(point_count + 1, 0);
+  for (int index = 0; index < observation_count; ++index) {
+    ++point_offsets[problem_ptr->observation_points[index] + 1];
+  }
+  for (int point_index = 0; point_index < point_count; ++point_index) {
+    point_offsets[point_index + 1] += point_offsets[point_index];
+  }
+  std::vector<int> point_observations(observation_count);
+  {
+    std::vector<int> cursors(point_offsets.begin(), point_offsets.end() - 1);
+    for (int index = 0; index < observation_count; ++index) {
+      point_observations[cursors[problem_ptr->observation_points[index]]++] = index;
+    }
+  }
+
+  const int system_size = 6 * free_count;
+  std::vector<double> pose_hessians(36 * free_count);
+  std::vector<double> pose_gradients(6 * free_count);
+  std::vector<Mat3> point_hessians(point_count);
+  std::vector<Vec3> point_gradients(point_count);
+  // Pose-point coupling J_pose^T W J_point of every observation, 6x3.
+  std::vector<double> couplings(18 * observation_count);
+  std::vector<double> reduced_matrix(system_size * system_size);
+  std::vector<double> reduced_vector(system_size);
+  std::vector<Mat3> point_inverses(point_count);
+  std::vector<unsigned char> point_solvable(point_count);
+
+  std::vector<Mat3> candidate_rotations;
+  std::vector<Vec3> candidate_translations;
+  std::vector<Vec3> candidate_points;
+
+  double cost = compute_bundle_adjustment_cost(problem_ptr->rotations, problem_ptr->translations, problem_ptr->points,
+                                               problem_ptr, threshold);
+  *result_ptr = {};
+  result_ptr->initial_cost = cost;
+
+  double lambda = parameters.initial_lambda;
+  bool converged = false;
+  while (!converged && result_ptr->iteration_count < parameters.max_iterations) {
+    ++result_ptr->iteration_count;
+    std::fill(pose_hessians.begin(), pose_hessians.end(), 0.0);
+    std::fill(pose_gradients.begin(), pose_gradients.end(), 0.0);
+    std::fill(point_hessians.begin(), point_hessians.end(), Mat3{});
+    std::fill(point_gradients.begin(), point_gradients.end(), Vec3{});
+
+    for (int index = 0; index < observation_count; ++index) {
+      const int keyframe_index = problem_ptr->observation_keyframes[index];
+      const int point_index = problem_ptr->observation_points[index];
+      ObservationLinearization linearization;
+      linearize_observation(&linearization, problem_ptr->rotations[keyframe_index],
+                            problem_ptr->translations[keyframe_index], problem_ptr->points[point_index],
+                            problem_ptr->observation_x[index], problem_ptr->observation_y[index], threshold);
+      const double weight = linearization.weight;
+      const auto& jp = linearization.pose_jacobian;
+      const auto& jx = linearization.point_jacobian;
+      const double* r = linearization.residual;
+
+      Mat3* v_ptr = &point_hessians[point_index];
+      for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 3; ++column) {
+          v_ptr->m[row][column] += weight * (jx[0][row] * jx[0][column] + jx[1][row] * jx[1][column]);
+        }
+      }
+      point_gradients[point_index] = point_gradients[point_index] +
+        Vec3{ weight * (jx[0][0] * r[0] + jx[1][0] * r[1]),
+              weight * (jx[0][1] * r[0] + jx[1][1] * r[1]),
+              weight * (jx[0][2] * r[0] + jx[1][2] * r[1]) };
+
+      const int free_index = free_indices[keyframe_index];
+      if (free_index < 0) {
+        continue;
+      }
+      double* u_ptr = pose_hessians.data() + 36 * free_index;
+      double* g_ptr = pose_gradients.data() + 6 * free_index;
+      double* w_ptr = couplings.data() + 18 * index;
+      for (int row = 0; row < 6; ++row) {
+        for (int column = 0; column < 6; ++column) {
+          u_ptr[6 * row + column] += weight * (jp[0][row] * jp[0][column] + jp[1][row] * jp[1][column]);
+        }
+        for (int column = 0; column < 3; ++column) {
+          w_ptr[3 * row + column] = weight * (jp[0][row] * jx[0][column] + jp[1][row] * jx[1][column]);
+        }
+        g_ptr[row] += weight * (jp[0][row] * r[0] + jp[1][row] * r[1]);
+      }
+    }
+
+    bool accepted = false;
+    while (!accepted && lambda < 1e8) {
+      // Reduced camera system S = U - W V^-1 W^T, rhs = -(g_c - W V^-1 g_p).
+      std::fill(reduced_matrix.begin(), reduced_matrix.end(), 0.0);
+      for (int free_index = 0; free_index < free_count; ++free_index) {
+        const double* u_ptr = pose_hessians.data() + 36 * free_index;
+        for (int row = 0; row < 6; ++row) {
+          for (int column = 0; column < 6; ++column) {
+            double value = u_ptr[6 * row + column];
+            if (row == column) {
+              value += lambda * value + 1e-12;
+            }
+            reduced_matrix[(6 * free_index + row) * system_size + 6 * free_index + column] = value;
+          }
+          reduced_vector[6 * free_index + row] = -pose_gradients[6 * free_index + row];
+        }
+      }
+
+      for (int point_index = 0; point_index < point_count; ++point_index) {
+        Mat3 damped = point_hessians[point_index];
+        for (int k = 0; k < 3; ++k) {
+          damped.m[k][k] += lambda * damped.m[k][k] + 1e-12;
+        }
+        const double scale = damped.m[0][0] + damped.m[1][1] + damped.m[2][2];
+        point_solvable[point_index] = std::fabs(determinant(damped)) > 1e-15 * scale * scale * scale;
+        if (!point_solvable[point_index]) {
+          continue;
+        }
+        const Mat3 v_inverse = inverse(damped);
+        point_inverses[point_index] = v_inverse;
+        const Vec3 g = v_inverse * point_gradients[point_index];
+
+        for (int i = point_offsets[point_index]; i < point_offsets[point_index + 1]; ++i) {
+          const int observation_i = point_observations[i];
+          const int free_i = free_indices[problem_ptr->observation_keyframes[observation_i]];
+          if (free_i < 0) {
+            continue;
+          }
+          // T = W_i V^-1.
+          const double* wi_ptr = couplings.data() + 18 * observation_i;
+          double t[6][3];
+          for (int row = 0; row < 6; ++row) {
+            for (int column = 0; column < 3; ++column) {
+              t[row][column] = wi_ptr[3 * row] * v_inverse.m[0][column] + wi_ptr[3 * row + 1] * v_inverse.m[1][column] +
+                               wi_ptr[3 * row + 2] * v_inverse.m[2][column];
+            }
+            reduced_vector[6 * free_i + row] += wi_ptr[3 * row] * g.x + wi_ptr[3 * row + 1] * g.y + wi_ptr[3 * row + 2] * g.z;
+          }
+
+          for (int j = point_offsets[point_index]; j < point_offsets[point_index + 1]; ++j) {
+            const int observation_j = point_observations[j];
+            const int free_j = free_indices[problem_ptr->observation_keyframes[observation_j]];
+            if (free_j < 0 || free_j > free_i) {
+              continue;
+            }
+            const double* wj_ptr = couplings.data() + 18 * observation_j;
+            for (int row = 0; row < 6; ++row) {
+              double* s_ptr = reduced_matrix.data() + (6 * free_i + row) * system_size + 6 * free_j;
+              for (int column = 0; column < 6; ++column) {
+                s_ptr[column] -= t[row][0] * wj_ptr[3 * column] + t[row][1] * wj_ptr[3 * column + 1] +
+                                 t[row][2] * wj_ptr[3 * column + 2];
+              }
+            }
+          }
+        }
+      }
+
+      if (!solve_cholesky(reduced_matrix.data(), reduced_vector.data(), system_size)) {
+        lambda *= 10.0;
+        continue;
+      }
+
+      candidate_rotations = problem_ptr->rotations;
+      candidate_translations = problem_ptr->translations;
+      candidate_points = problem_ptr->points;
+      for (int keyframe_index = 0; keyframe_index < keyframe_count; ++keyframe_index) {
+        const int free_index = free_indices[keyframe_index];
+        if (free_index < 0) {
+          continue;
+        }
+        const double* delta_ptr = reduced_vector.data() + 6 * free_index;
+        const Mat3 rotation_update = exp_so3({ delta_ptr[0], delta_ptr[1], delta_ptr[2] });
+        candidate_rotations[keyframe_index] = rotation_update * candidate_rotations[keyframe_index];
+        candidate_translations[keyframe_index] = rotation_update * candidate_translations[keyframe_index] +
+                                                 Vec3{ delta_ptr[3], delta_ptr[4], delta_ptr[5] };
+      }
+
+      // Back substitution, delta_p = V^-1 (-g_p - sum W_i^T delta_c).
+      for (int point_index = 0; point_index < point_count; ++point_index) {
+        if (!point_solvable[point_index]) {
+          continue;
+        }
+        Vec3 right = -point_gradients[point_index];
+        for (int i = point_offsets[point_index]; i < point_offsets[point_index + 1]; ++i) {
+          const int observation_index = point_observations[i];
+          const int free_index = free_indices[problem_ptr->observation_keyframes[observation_index]];
+          if (free_index < 0) {
+            continue;
+          }
+          const double* w_ptr = couplings.data() + 18 * observation_index;
+          const double* delta_ptr = reduced_vector.data() + 6 * free_index;
+          for (int row = 0; row < 6; ++row) {
+            right = right - delta_ptr[row] * Vec3{ w_ptr[3 * row], w_ptr[3 * row + 1], w_ptr[3 * row + 2] };
+          }
+        }
+        candidate_points[point_index] = candidate_points[point_index] + point_inverses[point_index] * right;
+      }
+
+      const double candidate_cost =
+        compute_bundle_adjustment_cost(candidate_rotations, candidate_translations, candidate_points, problem_ptr, threshold);
+      if (candidate_cost < cost) {
+        accepted = true;
+        const double decrease = cost - candidate_cost;
+        cost = candidate_cost;
+        problem_ptr->rotations.swap(candidate_rotations);
+        problem_ptr->translations.swap(candidate_translations);
+        problem_ptr->points.swap(candidate_points);
+        lambda = std::max(lambda * 0.1, 1e-12);
+        converged = decrease < 1e-9 * cost;
+      } else {
+        lambda *= 10.0;
+      }
+    }
+
+    converged |= !accepted;
+  }
+
+  result_ptr->final_cost = cost;
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+// Pinhole camera with radial-tangential (Brown-Conrady) distortion.
+struct Camera {
+  int width;
+  int height;
+  float fx;
+  float fy;
+  float cx;
+  float cy;
+  float k1;
+  float k2;
+  float p1;
+  float p2;
+  float k3;
+  // Raw depth units per metre, for RGB-D sensors.
+  float depth_scale;
+};
+
+// Reads "key value" lines, lines starting with # are comments.
+bool load_camera(Camera* camera_ptr, const std::string& config_path) {
+  FILE* fp = fopen(config_path.data(), "r");
+
+  if (fp == nullptr) {
+    fprintf(stderr, "ERROR! Unable to load camera config: %s\n", config_path.data());
+    return false;
+  }
+
+  *camera_ptr = {};
+
+  char line[256];
+  while (fgets(line, sizeof(line), fp) != nullptr) {
+    char key[64];
+    float value = 0.0f;
+    if (line[0] == '#' || sscanf(line, "%63s %f", key, &value) != 2) {
+      continue;
+    }
+
+    if (std::strcmp(key, "width") == 0) camera_ptr->width = int(value);
+    else if (std::strcmp(key, "height") == 0) camera_ptr->height = int(value);
+    else if (std::strcmp(key, "fx") == 0) camera_ptr->fx = value;
+    else if (std::strcmp(key, "fy") == 0) camera_ptr->fy = value;
+    else if (std::strcmp(key, "cx") == 0) camera_ptr->cx = value;
+    else if (std::strcmp(key, "cy") == 0) camera_ptr->cy = value;
+    else if (std::strcmp(key, "k1") == 0) camera_ptr->k1 = value;
+    else if (std::strcmp(key, "k2") == 0) camera_ptr->k2 = value;
+    else if (std::strcmp(key, "p1") == 0) camera_ptr->p1 = value;
+    else if (std::strcmp(key, "p2") == 0) camera_ptr->p2 = value;
+    else if (std::strcmp(key, "k3") == 0) camera_ptr->k3 = value;
+    else if (std::strcmp(key, "depth_scale") == 0) camera_ptr->depth_scale = value;
+    else fprintf(stderr, "ERROR! Unknown camera config key: %s\n", key);
+  }
+
+  fclose(fp);
+
+  if (camera_ptr->width <= 0 || camera_ptr->height <= 0 || camera_ptr->fx <= 0.0f || camera_ptr->fy <= 0.0f) {
+    fprintf(stderr, "ERROR! Incomplete camera config: %s\n", config_path.data());
+    return false;
+  }
+
+  return true;
+}
+
+// Applies the distortion model to a point on the normalized image plane.
+void distort_normalized(const Camera* camera_ptr, float x, float y, float* distorted_x_ptr, float* distorted_y_ptr) {
+  const float r2 = x * x + y * y;
+  const float radial = 1.0f + r2 * (camera_ptr->k1 + r2 * (camera_ptr->k2 + r2 * camera_ptr->k3));
+  *distorted_x_ptr = x * radial + 2.0f * camera_ptr->p1 * x * y + camera_ptr->p2 * (r2 + 2.0f * x * x);
+  *distorted_y_ptr = y * radial + camera_ptr->p1 * (r2 + 2.0f * y * y) + 2.0f * camera_ptr->p2 * x * y;
+}
+
+// Projects a point in camera coordinates to pixels. Returns false for points
+// behind the camera.
+bool project_point(const Camera* camera_ptr, float x, float y, float z, float* u_ptr, float* v_ptr) {
+  if (z <= 0.0f) {
+    return false;
+  }
+  float distorted_x;
+  float distorted_y;
+  distort_normalized(camera_ptr, x / z, y / z, &distorted_x, &distorted_y);
+  *u_ptr = camera_ptr->fx * distorted_x + camera_ptr->cx;
+  *v_ptr = camera_ptr->fy * distorted_y + camera_ptr->cy;
+  return true;
+}
+
+// Iterative inverse of the distortion, only used to build the lookup grid.
+void undistort_pixel(const Camera* camera_ptr, float u, float v, float* x_ptr, float* y_ptr) {
+  const float distorted_x = (u - camera_ptr->cx) / camera_ptr->fx;
+  const float distorted_y = (v - camera_ptr->cy) / camera_ptr->fy;
+  float x = distorted_x;
+  float y = distorted_y;
+
+  for (int iteration = 0; iteration < 20; ++iteration) {
+    const float r2 = x * x + y * y;
+    const float radial = 1.0f + r2 * (camera_ptr->k1 + r2 * (camera_ptr->k2 + r2 * camera_ptr->k3));
+    const float tangential_x = 2.0f * camera_ptr->p1 * x * y + camera_ptr->p2 * (r2 + 2.0f * x * x);
+    const float tangential_y = camera_ptr->p1 * (r2 + 2.0f * y * y) + 2.0f * camera_ptr->p2 * x * y;
+    x = (distorted_x - tangential_x) / radial;
+    y = (distorted_y - tangential_y) / radial;
+  }
+
+  *x_ptr = x;
+  *y_ptr = y;
+}
+
+// Undistorted normalized coordinates sampled every step pixels over the
+// image, the last row and column lie on or past the image border.
+struct UndistortionMap {
+  int step;
+  int columns;
+  int rows;
+  std::vector<float> x;
+  std::vector<float> y;
+};
+
+void build_undistortion_map(UndistortionMap* map_ptr, const Camera* camera_ptr, int step = 8) {
+  map_ptr->step = step;
+  map_ptr->columns = camera_ptr->width / step + 2;
+  map_ptr->rows = camera_ptr->height / step + 2;
+  map_ptr->x.resize(map_ptr->columns * map_ptr->rows);
+  map_ptr->y.resize(map_ptr->columns * map_ptr->rows);
+
+  for (int row = 0; row < map_ptr->rows; ++row) {
+    for (int column = 0; column < map_ptr->columns; ++column) {
+      const int index = row * map_ptr->columns + column;
+      undistort_pixel(camera_ptr, float(column * step), float(row * step), &map_ptr->x[index], &map_ptr->y[index]);
+    }
+  }
+}
+
+// Converts pixel coordinates to unit bearing vectors, written as separate
+// x, y and z arrays. Each point is a bilinear lookup in the undistortion map.
+void compute_bearings(float* bearing_x_ptr,
+                      float* bearing_y_ptr,
+                      float* bearing_z_ptr,
+                      const float* u_ptr,
+                      const float* v_ptr,
+                      int count,
+                      const UndistortionMap* map_ptr) {
+  const float inverse_step = 1.0f / map_ptr->step;
+  const int columns = map_ptr->columns;
+  const float* map_x_ptr = map_ptr->x.data();
+  const float* map_y_ptr = map_ptr->y.data();
+
+  int index = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  const __m256 inverse_step_x8 = _mm256_set1_ps(inverse_step);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 max_column = _mm256_set1_ps(float(columns - 2));
+  const __m256 max_row = _mm256_set1_ps(float(map_ptr->rows - 2));
+  const __m256i columns_x8 = _mm256_set1_epi32(columns);
+  const __m256i one_x8 = _mm256_set1_epi32(1);
+
+  for (; index + 8 <= count; index += 8) {
+    const __m256 grid_u = _mm256_mul_ps(_mm256_loadu_ps(u_ptr + index), inverse_step_x8);
+    const __m256 grid_v = _mm256_mul_ps(_mm256_loadu_ps(v_ptr + index), inverse_step_x8);
+    const __m256 cell_u = _mm256_min_ps(_mm256_max_ps(_mm256_floor_ps(grid_u), zero), max_column);
+    const __m256 cell_v = _mm256_min_ps(_mm256_max_ps(_mm256_floor_ps(grid_v), zero), max_row);
+    const __m256 a = _mm256_sub_ps(grid_u, cell_u);
+    const __m256 b = _mm256_sub_ps(grid_v, cell_v);
+
+    const __m256i i00 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvtps_epi32(cell_v), columns_x8), _mm256_cvtps_epi32(cell_u));
+    const __m256i i01 = _mm256_add_epi32(i00, one_x8);
+    const __m256i i10 = _mm256_add_epi32(i00, columns_x8);
+    const __m256i i11 = _mm256_add_epi32(i10, one_x8);
+
+    auto interpolate = [&](const float* table_ptr) {
+      const __m256 top = _mm256_fmadd_ps(a, _mm256_sub_ps(_mm256_i32gather_ps(table_ptr, i01, 4), _mm256_i32gather_ps(table_ptr, i00, 4)),
+                                         _mm256_i32gather_ps(table_ptr, i00, 4));
+      const __m256 bottom = _mm256_fmadd_ps(a, _mm256_sub_ps(_mm256_i32gather_ps(table_ptr, i11, 4), _mm256_i32gather_ps(table_ptr, i10, 4)),
+                                            _mm256_i32gather_ps(table_ptr, i10, 4));
+      return _mm256_fmadd_ps(b, _mm256_sub_ps(bottom, top), top);
+    };
+
+    const __m256 x = interpolate(map_x_ptr);
+    const __m256 y = interpolate(map_y_ptr);
+    const __m256 inverse_norm = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_fmadd_ps(x, x, _mm256_fmadd_ps(y, y, one))));
+
+    _mm256_storeu_ps(bearing_x_ptr + index, _mm256_mul_ps(x, inverse_norm));
+    _mm256_storeu_ps(bearing_y_ptr + index, _mm256_mul_ps(y, inverse_norm));
+    _mm256_storeu_ps(bearing_z_ptr + index, inverse_norm);
+  }
+#endif
+
+  for (; index < count; ++index) {
+    const float grid_u = u_ptr[index] * inverse_step;
+    const float grid_v = v_ptr[index] * inverse_step;
+    const float cell_u = std::fmin(std::fmax(std::floor(grid_u), 0.0f), float(columns - 2));
+    const float cell_v = std::fmin(std::fmax(std::floor(grid_v), 0.0f), float(map_ptr->rows - 2));
+    const float a = grid_u - cell_u;
+    const float b = grid_v - cell_v;
+    const int i00 = int(cell_v) * columns + int(cell_u);
+
+    auto interpolate = [&](const float* table_ptr) {
+      const float top = table_ptr[i00] + a * (table_ptr[i00 + 1] - table_ptr[i00]);
+      const float bottom = table_ptr[i00 + columns] + a * (table_ptr[i00 + columns + 1] - table_ptr[i00 + columns]);
+      return top + b * (bottom - top);
+    };
+
+    const float x = interpolate(map_x_ptr);
+    const float y = interpolate(map_y_ptr);
+    const float inverse_norm = 1.0f / std::sqrt(x * x + y * y + 1.0f);
+
+    bearing_x_ptr[index] = x * inverse_norm;
+    bearing_y_ptr[index] = y * inverse_norm;
+    bearing_z_ptr[index] = inverse_norm;
+  }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "fast.h"
+#include "gradients.h"
+
+enum class CornerScore {
+  fast,
+  harris,
+  min_eigenvalue,
+};
+
+constexpr int corner_window_half_size = 3;
+constexpr float harris_k = 0.04f;
+
+struct StructureTensor {
+  int xx;
+  int xy;
+  int yy;
+};
+
+// Integer sums of dx*dx, dx*dy and dy*dy over the 7x7 window around (u, v).
+// Needs corner_window_half_size + 1 columns of margin on the right.
+StructureTensor sum_structure_tensor(const GradientImage* gradient_image_ptr, int u, int v) {
+  const int width = gradient_image_ptr->width;
+  const int offset = (v - corner_window_half_size) * width + u - corner_window_half_size;
+  const short* dx_ptr = gradient_image_ptr->dx_ptr + offset;
+  const short* dy_ptr = gradient_image_ptr->dy_ptr + offset;
+
+  StructureTensor tensor;
+
+#if defined(__AVX2__)
+  // Two rows per register, 8 samples per row with the eighth masked out.
+  const __m256i mask = _mm256_setr_epi16(-1, -1, -1, -1, -1, -1, -1, 0, -1, -1, -1, -1, -1, -1, -1, 0);
+  __m256i xx = _mm256_setzero_si256();
+  __m256i xy = _mm256_setzero_si256();
+  __m256i yy = _mm256_setzero_si256();
+
+  auto accumulate = [&](__m256i dx, __m256i dy) {
+    dx = _mm256_and_si256(dx, mask);
+    dy = _mm256_and_si256(dy, mask);
+    xx = _mm256_add_epi32(xx, _mm256_madd_epi16(dx, dx));
+    xy = _mm256_add_epi32(xy, _mm256_madd_epi16(dx, dy));
+    yy = _mm256_add_epi32(yy, _mm256_madd_epi16(dy, dy));
+  };
+
+  auto load_rows = [width](const short* ptr, int row) {
+    const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + row * width));
+    const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + (row + 1) * width));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+  };
+
+  for (int row = 0; row < 6; row += 2) {
+    accumulate(load_rows(dx_ptr, row), load_rows(dy_ptr, row));
+  }
+  const __m128i last_dx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dx_ptr + 6 * width));
+  const __m128i last_dy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dy_ptr + 6 * width));
+  accumulate(_mm256_set_m128i(_mm_setzero_si128(), last_dx), _mm256_set_m128i(_mm_setzero_si128(), last_dy));
+
+  auto horizontal_sum = [](__m256i x) {
+    const __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    const __m128i pairs = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtsi128_si32(_mm_add_epi32(pairs, _mm_shuffle_epi32(pairs, _MM_SHUFFLE(2, 3, 0, 1))));
+  };
+  tensor.xx = horizontal_sum(xx);
+  tensor.xy = horizontal_sum(xy);
+  tensor.yy = horizontal_sum(yy);
+#else
+  tensor = {};
+  for (int row = 0; row < 2 * corner_window_half_size + 1; ++row) {
+    for (int column = 0; column < 2 * corner_window_half_size + 1; ++column) {
+      const int dx = dx_ptr[row * width + column];
+      const int dy = dy_ptr[row * width + column];
+      tensor.xx += dx * dx;
+      tensor.xy += dx * dy;
+      tensor.yy += dy * dy;
+    }
+  }
+#endif
+
+  return tensor;
+}
+
+// Replaces the FAST score of every keypoint with the Harris response or the
+// minimum eigenvalue of the structure tensor, evaluated only at the keypoints.
+// Scores are in squared intensity gradient units per window pixel.
+void score_keypoints(Keypoints* keypoints_ptr, const GradientImage* gradient_image_ptr, CornerScore corner_score) {
+  if (corner_score == CornerScore::fast) {
+    return;
+  }
+
+  // Scharr gradients are 32 times the intensity gradient.
+  constexpr int window_size = 2 * corner_window_half_size + 1;
+  constexpr float normalization = 1.0f / (32.0f * 32.0f * window_size * window_size);
+
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    const int u = int(keypoints_ptr->u[keypoint_index]);
+    const int v = int(keypoints_ptr->v[keypoint_index]);
+
+    if (u < corner_window_half_size || v < corner_window_half_size ||
+        u + corner_window_half_size + 1 >= gradient_image_ptr->width ||
+        v + corner_window_half_size >= gradient_image_ptr->height) {
+      keypoints_ptr->score[keypoint_index] = 0.0f;
+      continue;
+    }
+
+    const StructureTensor tensor = sum_structure_tensor(gradient_image_ptr, u, v);
+    const float xx = tensor.xx * normalization;
+    const float xy = tensor.xy * normalization;
+    const float yy = tensor.yy * normalization;
+
+    if (corner_score == CornerScore::harris) {
+      const float trace = xx + yy;
+      keypoints_ptr->score[keypoint_index] = xx * yy - xy * xy - harris_k * trace * trace;
+    } else {
+      const float half_difference = 0.5f * (xx - yy);
+      keypoints_ptr->score[keypoint_index] = 0.5f * (xx + yy) - std::sqrt(half_difference * half_difference + xy * xy);
+    }
+  }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "buffer_pool.h"
+#include "fast.h"
+
+// stb_image.h is included once by main.cc together with its implementation.
+
+// Dense mode converts the whole image to metres once, for consumers that read
+// most pixels. Sparse mode keeps the raw 16-bit image and converts only the
+// pixels that are looked up, which is all keypoint depth needs.
+enum class DepthMode {
+  sparse,
+  dense,
+};
+
+// Raw depth units as stored in the dataset PNGs, zero marks missing depth.
+// In dense mode metres_ptr holds the converted image and raw_ptr is null.
+struct DepthImage {
+  int width;
+  int height;
+  float inverse_scale;
+  const unsigned short* raw_ptr;
+  float* metres_ptr;
+};
+
+size_t get_depth_buffer_size(int width, int height) {
+  return sizeof(float) * width * height;
+}
+
+// Converts raw depth to metres, 16 pixels per step. Zero stays zero.
+void convert_depth_to_metres(float* metres_ptr, const unsigned short* raw_ptr, int count, float inverse_scale) {
+  int index = 0;
+
+#if defined(__AVX2__)
+  const __m256 scale = _mm256_set1_ps(inverse_scale);
+  for (; index + 16 <= count; index += 16) {
+    const __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(raw_ptr + index));
+    const __m256i low = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw));
+    const __m256i high = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1));
+    _mm256_storeu_ps(metres_ptr + index, _mm256_mul_ps(_mm256_cvtepi32_ps(low), scale));
+    _mm256_storeu_ps(metres_ptr + index + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(high), scale));
+  }
+#endif
+
+  for (; index < count; ++index) {
+    metres_ptr[index] = raw_ptr[index] * inverse_scale;
+  }
+}
+
+// Decodes a 16-bit depth PNG. In dense mode the metric image comes from the
+// pool and the decoded buffer is dropped right after conversion.
+bool load_depth_image(DepthImage* depth_image_ptr,
+                      const std::string& path,
+                      float depth_scale,
+                      DepthMode mode,
+                      BufferPool* pool_ptr) {
+  *depth_image_ptr = {};
+  depth_image_ptr->inverse_scale = 1.0f / depth_scale;
+
+  int channels = 0;
+  unsigned short* raw_ptr = stbi_load_16(path.data(), &depth_image_ptr->width, &depth_image_ptr->height, &channels, 1);
+
+  if (raw_ptr == nullptr) {
+    fprintf(stderr, "ERROR! Unable to load depth image: %s\n", path.data());
+    return false;
+  }
+
+  if (mode == DepthMode::sparse) {
+    depth_image_ptr->raw_ptr = raw_ptr;
+    return true;
+  }
+
+  const int width = depth_image_ptr->width;
+  const int height = depth_image_ptr->height;
+  depth_image_ptr->metres_ptr = (float*)acquire_buffer(pool_ptr, get_depth_buffer_size(width, height));
+  convert_depth_to_metres(depth_image_ptr->metres_ptr, raw_ptr, width * height, depth_image_ptr->inverse_scale);
+  std::free(raw_ptr);
+  return true;
+}
+
+void release_depth_image(DepthImage* depth_image_ptr, BufferPool* pool_ptr) {
+  std::free(const_cast<unsigned short*>(depth_image_ptr->raw_ptr));
+  if (depth_image_ptr->metres_ptr != nullptr) {
+    release_buffer(pool_ptr, depth_image_ptr->metres_ptr,
+                   get_depth_buffer_size(depth_image_ptr->width, depth_image_ptr->height));
+  }
+  *depth_image_ptr = {};
+}
+
+// Depth in metres at every keypoint, 0 where the sensor has no reading.
+void lookup_keypoint_depths(float* depths_ptr, const Keypoints* keypoints_ptr, const DepthImage* depth_image_ptr) {
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+  const int width = depth_image_ptr->width;
+
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    const int u = int(keypoints_ptr->u[keypoint_index] + 0.5f);
+    const int v = int(keypoints_ptr->v[keypoint_index] + 0.5f);
+    if (u < 0 || v < 0 || u >= width || v >= depth_image_ptr->height) {
+      depths_ptr[keypoint_index] = 0.0f;
+    } else if (depth_image_ptr->metres_ptr != nullptr) {
+      depths_ptr[keypoint_index] = depth_image_ptr->metres_ptr[v * width + u];
+    } else {
+      depths_ptr[keypoint_index] = depth_image_ptr->raw_ptr[v * width + u] * depth_image_ptr->inverse_scale;
+    }
+  }
+}
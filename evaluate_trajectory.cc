@@ -0,0 +1,55 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "trajectory.h"
+
+// Offline evaluator of a TUM format trajectory against the ground truth of
+// a sequence. Prints ATE after alignment and RPE over a fixed time step.
+//
+//   evaluate_trajectory <groundtruth file> <trajectory file> [--scale] [--delta seconds]
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <groundtruth file> <trajectory file> [--scale] [--delta seconds]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  TrajectoryEvaluationParameters parameters = {};
+  for (int arg_index = 3; arg_index < argc; ++arg_index) {
+    if (std::strcmp(argv[arg_index], "--scale") == 0) {
+      parameters.align_scale = true;
+    } else if (std::strcmp(argv[arg_index], "--delta") == 0 && arg_index + 1 < argc) {
+      parameters.rpe_delta = std::atof(argv[++arg_index]);
+    } else {
+      fprintf(stderr, "ERROR! Unknown argument: %s\n", argv[arg_index]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  Trajectory reference = {};
+  Trajectory estimate = {};
+  if (!read_trajectory(&reference, argv[1]) || !read_trajectory(&estimate, argv[2])) {
+    return EXIT_FAILURE;
+  }
+
+  const auto start_time = std::chrono::steady_clock::now();
+  TrajectoryErrors errors;
+  const bool evaluated = evaluate_trajectory(&errors, &estimate, &reference, parameters);
+  const double elapsed_ms =
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+  if (!evaluated) {
+    fprintf(stderr, "ERROR! Only %d of %zu poses have ground truth\n", errors.pose_count, estimate.poses.size());
+    return EXIT_FAILURE;
+  }
+
+  printf("Poses: %d of %zu associated, scale %.6g\n", errors.pose_count, estimate.poses.size(),
+         errors.alignment.scale);
+  printf("ATE: rmse %.6f m, mean %.6f m, median %.6f m, max %.6f m\n", errors.ate_rmse, errors.ate_mean,
+         errors.ate_median, errors.ate_max);
+  printf("RPE over %g s: %d pairs, translation rmse %.6f m, rotation rmse %.6f deg\n", parameters.rpe_delta,
+         errors.rpe_count, errors.rpe_translation_rmse, errors.rpe_rotation_rmse_degrees);
+  printf("Evaluated in %.3f ms\n", elapsed_ms);
+  return EXIT_SUCCESS;
+}
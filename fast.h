@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "image.h"
+
+// Keypoints are stored as a struct of arrays, index i of every array (and of
+// any descriptor buffer computed for them) refers to the same keypoint.
+struct Keypoints {
+  std::vector<float> u;
+  std::vector<float> v;
+  std::vector<float> score;
+  std::vector<float> angle;
+};
+
+void clear_keypoints(Keypoints* keypoints_ptr) {
+  keypoints_ptr->u.clear();
+  keypoints_ptr->v.clear();
+  keypoints_ptr->score.clear();
+  keypoints_ptr->angle.clear();
+}
+
+void add_keypoint(Keypoints* keypoints_ptr, float u, float v, float score) {
+  keypoints_ptr->u.push_back(u);
+  keypoints_ptr->v.push_back(v);
+  keypoints_ptr->score.push_back(score);
+  keypoints_ptr->angle.push_back(0.0f);
+}
+
+int get_keypoint_count(const Keypoints* keypoints_ptr) {
+  return static_cast<int>(keypoints_ptr->u.size());
+}
+
+// TODO(Matias): Reorder these for better cache performance
+const int fast_pixel_offsets[] = {
+//u   v
+  0, -3, // 1
+  1, -3, // 2
+  2, -2, // 3
+  3, -1, // 4
+  3,  0, // 5
+  3,  1, // 6
+  2,  2, // 7
+  1,  3, // 8
+  0,  3, // 9
+ -1,  3, // 10
+ -2,  2, // 11
+ -3,  1, // 12
+ -3,  0, // 13
+ -3, -1, // 14
+ -2, -2, // 15
+ -1, -3, // 16
+};
+constexpr int number_of_fast_points = 16;
+constexpr int fast_arc_length = 9;
+constexpr int fast_half_size = 3;
+
+// True if the 16 bit circular mask has fast_arc_length consecutive bits set.
+bool has_fast_arc(uint32_t mask) {
+  uint32_t run = mask | (mask << number_of_fast_points);
+  for (int i = 1; i < fast_arc_length; ++i) {
+    run &= run >> 1;
+  }
+  return (run & 0xffff) != 0;
+}
+
+// FAST-9 segment test with 3x3 non-maximum suppression on the summed
+// absolute difference score.
+void detect_fast_points(Keypoints* keypoints_ptr, const Image* grey_image_ptr, int threshold = 20) {
+
+  const auto width = grey_image_ptr->width;
+  const auto height = grey_image_ptr->height;
+
+  clear_keypoints(keypoints_ptr);
+
+  int circle_offsets[number_of_fast_points];
+  for (int fast_pixel_index = 0; fast_pixel_index < number_of_fast_points; ++fast_pixel_index) {
+    const int u_offset = fast_pixel_offsets[2*fast_pixel_index + 0];
+    const int v_offset = fast_pixel_offsets[2*fast_pixel_index + 1];
+    circle_offsets[fast_pixel_index] = v_offset * width + u_offset;
+  }
+
+  std::vector<int> score_image(width * height, 0);
+  std::vector<int> candidates;
+
+  for (int v = fast_half_size; v < height - fast_half_size; ++v) {
+    for (int u = fast_half_size; u < width - fast_half_size; ++u) {
+      const unsigned char* pixel_ptr = get_pixel_ptr(u, v, grey_image_ptr);
+      const int center = *pixel_ptr;
+      const int bright_threshold = center + threshold;
+      const int dark_threshold = center - threshold;
+
+      // Any arc of 9 covers at least two of the four compass points.
+      int compass_bright = 0;
+      int compass_dark = 0;
+      for (int fast_pixel_index = 0; fast_pixel_index < number_of_fast_points; fast_pixel_index += 4) {
+        const int value = pixel_ptr[circle_offsets[fast_pixel_index]];
+        compass_bright += value > bright_threshold;
+        compass_dark += value < dark_threshold;
+      }
+      if (compass_bright < 2 && compass_dark < 2) {
+        continue;
+      }
+
+      uint32_t bright_mask = 0;
+      uint32_t dark_mask = 0;
+      int bright_score = 0;
+      int dark_score = 0;
+      for (int fast_pixel_index = 0; fast_pixel_index < number_of_fast_points; ++fast_pixel_index) {
+        const int value = pixel_ptr[circle_offsets[fast_pixel_index]];
+        if (value > bright_threshold) {
+          bright_mask |= 1u << fast_pixel_index;
+          bright_score += value - bright_threshold;
+        } else if (value < dark_threshold) {
+          dark_mask |= 1u << fast_pixel_index;
+          dark_score += dark_threshold - value;
+        }
+      }
+
+      int score = 0;
+      if (has_fast_arc(bright_mask)) {
+        score = bright_score;
+      }
+      if (has_fast_arc(dark_mask)) {
+        score = std::max(score, dark_score);
+      }
+      if (score > 0) {
+        score_image[v * width + u] = score;
+        candidates.push_back(v * width + u);
+      }
+    }
+  }
+
+  for (const int pixel_index : candidates) {
+    const int score = score_image[pixel_index];
+    const int* row_ptr = score_image.data() + pixel_index;
+    // Ties are broken towards the later pixel in raster order.
+    const bool is_maximum =
+      score >= row_ptr[-width - 1] && score >= row_ptr[-width] && score >= row_ptr[-width + 1] &&
+      score >= row_ptr[-1] && score > row_ptr[1] &&
+      score > row_ptr[width - 1] && score > row_ptr[width] && score > row_ptr[width + 1];
+
+    if (is_maximum) {
+      add_keypoint(keypoints_ptr, pixel_index % width, pixel_index / width, score);
+    }
+  }
+}
+
+// Keeps at most max_per_cell keypoints with the highest score in every
+// cell_size x cell_size cell, so features stay spread over the image.
+void select_keypoints_by_grid(Keypoints* keypoints_ptr, int width, int height, int cell_size, int max_per_cell) {
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+  const int columns = (width + cell_size - 1) / cell_size;
+  const int rows = (height + cell_size - 1) / cell_size;
+
+  std::vector<int> cell_starts(columns * rows + 1, 0);
+  std::vector<int> cells(keypoint_count);
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    const int column = std::min(int(keypoints_ptr->u[keypoint_index]) / cell_size, columns - 1);
+    const int row = std::min(int(keypoints_ptr->v[keypoint_index]) / cell_size, rows - 1);
+    cells[keypoint_index] = row * columns + column;
+    ++cell_starts[cells[keypoint_index] + 1];
+  }
+  for (int cell = 0; cell < columns * rows; ++cell) {
+    cell_starts[cell + 1] += cell_starts[cell];
+  }
+
+  std::vector<int> sorted(keypoint_count);
+  std::vector<int> cell_fill(cell_starts.begin(), cell_starts.end() - 1);
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    sorted[cell_fill[cells[keypoint_index]]++] = keypoint_index;
+  }
+
+  auto higher_score = [keypoints_ptr](int a, int b) {
+    return keypoints_ptr->score[a] > keypoints_ptr->score[b];
+  };
+
+  std::vector<int> selected;
+  selected.reserve(std::min(keypoint_count, columns * rows * max_per_cell));
+  for (int cell = 0; cell < columns * rows; ++cell) {
+    auto begin = sorted.begin() + cell_starts[cell];
+    auto end = sorted.begin() + cell_starts[cell + 1];
+    if (end - begin > max_per_cell) {
+      std::partial_sort(begin, begin + max_per_cell, end, higher_score);
+      end = begin + max_per_cell;
+    }
+    selected.insert(selected.end(), begin, end);
+  }
+
+  Keypoints selected_keypoints = {};
+  for (const int keypoint_index : selected) {
+    add_keypoint(&selected_keypoints, keypoints_ptr->u[keypoint_index], keypoints_ptr->v[keypoint_index],
+                 keypoints_ptr->score[keypoint_index]);
+    selected_keypoints.angle.back() = keypoints_ptr->angle[keypoint_index];
+  }
+  *keypoints_ptr = std::move(selected_keypoints);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdlib>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "camera.h"
+#include "corner_score.h"
+#include "depth.h"
+#include "fast.h"
+#include "gradients.h"
+#include "image.h"
+#include "orb.h"
+
+// Everything derived from one camera image. Derived data that several stages
+// need, like the gradients, is computed on first use and then cached here.
+struct Frame {
+  Image grey_image;
+  ImagePyramid pyramid;
+  int gradient_level_count;
+  GradientImage gradients[max_pyramid_levels];
+  Keypoints keypoints;
+  Descriptors descriptors;
+  // Unit bearing vector of every keypoint.
+  std::vector<float> bearing_x;
+  std::vector<float> bearing_y;
+  std::vector<float> bearing_z;
+  // Depth in metres of every keypoint in RGB-D mode, 0 where it is missing.
+  std::vector<float> depths;
+};
+
+// Takes ownership of the greyscale image buffer.
+void init_frame(Frame* frame_ptr, const Image* grey_image_ptr, int level_count) {
+  frame_ptr->grey_image = *grey_image_ptr;
+  build_image_pyramid(&frame_ptr->pyramid, &frame_ptr->grey_image, level_count);
+  frame_ptr->gradient_level_count = 0;
+}
+
+// Scharr gradients for every pyramid level, computed once per frame.
+const GradientImage* get_frame_gradients(Frame* frame_ptr, BufferPool* pool_ptr) {
+  if (frame_ptr->gradient_level_count == 0) {
+    for (int level = 0; level < frame_ptr->pyramid.level_count; ++level) {
+      compute_scharr_gradients(&frame_ptr->gradients[level], &frame_ptr->pyramid.levels[level], pool_ptr);
+    }
+    frame_ptr->gradient_level_count = frame_ptr->pyramid.level_count;
+  }
+  return frame_ptr->gradients;
+}
+
+void release_frame(Frame* frame_ptr, BufferPool* pool_ptr) {
+  for (int level = 0; level < frame_ptr->gradient_level_count; ++level) {
+    release_gradients(&frame_ptr->gradients[level], pool_ptr);
+  }
+  frame_ptr->gradient_level_count = 0;
+
+  free_image_pyramid(&frame_ptr->pyramid);
+  std::free(const_cast<unsigned char*>(frame_ptr->grey_image.data_ptr));
+  frame_ptr->grey_image = {};
+
+  clear_keypoints(&frame_ptr->keypoints);
+  free_descriptors(&frame_ptr->descriptors);
+  frame_ptr->bearing_x.clear();
+  frame_ptr->bearing_y.clear();
+  frame_ptr->bearing_z.clear();
+  frame_ptr->depths.clear();
+}
+
+void compute_frame_bearings(Frame* frame_ptr, const UndistortionMap* undistortion_map_ptr) {
+  const int keypoint_count = get_keypoint_count(&frame_ptr->keypoints);
+  frame_ptr->bearing_x.resize(keypoint_count);
+  frame_ptr->bearing_y.resize(keypoint_count);
+  frame_ptr->bearing_z.resize(keypoint_count);
+  compute_bearings(frame_ptr->bearing_x.data(), frame_ptr->bearing_y.data(), frame_ptr->bearing_z.data(),
+                   frame_ptr->keypoints.u.data(), frame_ptr->keypoints.v.data(), keypoint_count,
+                   undistortion_map_ptr);
+}
+
+void compute_frame_depths(Frame* frame_ptr, const DepthImage* depth_image_ptr) {
+  frame_ptr->depths.resize(get_keypoint_count(&frame_ptr->keypoints));
+  lookup_keypoint_depths(frame_ptr->depths.data(), &frame_ptr->keypoints, depth_image_ptr);
+}
+
+struct FeatureParameters {
+  int fast_threshold = 20;
+  CornerScore corner_score = CornerScore::min_eigenvalue;
+  int grid_cell_size = 32;
+  int max_keypoints_per_cell = 5;
+};
+
+// FAST detection, corner scoring on the cached gradients, grid bucketing and
+// ORB description of the frame.
+void extract_frame_features(Frame* frame_ptr,
+                            const OrbPattern* pattern_ptr,
+                            BufferPool* pool_ptr,
+                            const FeatureParameters& parameters = {}) {
+  const Image* grey_image_ptr = &frame_ptr->grey_image;
+
+  detect_fast_points(&frame_ptr->keypoints, grey_image_ptr, parameters.fast_threshold);
+
+  if (parameters.corner_score != CornerScore::fast) {
+    score_keypoints(&frame_ptr->keypoints, &get_frame_gradients(frame_ptr, pool_ptr)[0], parameters.corner_score);
+  }
+
+  select_keypoints_by_grid(&frame_ptr->keypoints, grey_image_ptr->width, grey_image_ptr->height,
+                           parameters.grid_cell_size, parameters.max_keypoints_per_cell);
+
+  Image smoothed_image = {};
+  gaussian_blur_image(&smoothed_image, grey_image_ptr);
+  compute_orb_descriptors(&frame_ptr->descriptors, &frame_ptr->keypoints, grey_image_ptr, &smoothed_image, pattern_ptr);
+  std::free(const_cast<unsigned char*>(smoothed_image.data_ptr));
+}
@@ -1,8 +1,26 @@
 #pragma once
 #include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
 
 #include <glad/glad.h>
 
+// GL_ARB_get_program_binary (core in 4.1) is not part of the generated 3.3 loader.
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+#endif
+
+// Only debug builds check glGetError after every call, it stalls the pipeline.
+#ifdef GLAD_DEBUG
 void glad_gl_post_callback(const char* function_name_ptr, void *funcptr, int len_args, ...) {
     GLenum error_code = glad_glGetError();
 
@@ -29,10 +47,14 @@ void glad_gl_post_callback(const char* function_name_ptr, void *funcptr, int len
         fprintf(stderr, "OpenGL ERROR! %s: %s\n", function_name_ptr, error_name);
     }
 }
+#endif
 
+// Compile both stages and link before querying any status, so the driver is
+// free to compile in the background. Logs are only fetched on failure.
 unsigned int compile_shader_program(
   const char* vertex_shader_source_ptr,
-  const char* fragment_shader_source_ptr
+  const char* fragment_shader_source_ptr,
+  PFNGLPROGRAMPARAMETERIPROC program_parameteri_ptr = nullptr
 ) {
   constexpr size_t log_size = 1024;
   char error_log[log_size];
@@ -42,30 +64,35 @@ unsigned int compile_shader_program(
   glShaderSource(vertex_shader, 1, &vertex_shader_source_ptr, nullptr);
   glCompileShader(vertex_shader);
 
-  glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &error_status);
-  if(!error_status) {
-    glGetShaderInfoLog(vertex_shader, log_size, nullptr, error_log);
-    fprintf(stderr, "GLSL Vertex Shader Error!\n%s", error_log);
-  }
-
   unsigned int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
   glShaderSource(fragment_shader, 1, &fragment_shader_source_ptr, nullptr);
   glCompileShader(fragment_shader);
-
-  glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &error_status);
-  if(!error_status) {
-    glGetShaderInfoLog(fragment_shader, log_size, nullptr, error_log);
-    fprintf(stderr, "GLSL Fragment Shader Error!\n%s", error_log);
-  }
   
   unsigned int shader_program = glCreateProgram();
   glAttachShader(shader_program, vertex_shader);
   glAttachShader(shader_program, fragment_shader);
+
+  if (program_parameteri_ptr != nullptr) {
+    program_parameteri_ptr(shader_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+
   glLinkProgram(shader_program);
 
   glGetProgramiv(shader_program, GL_LINK_STATUS, &error_status);
   if(!error_status) {
-    glGetShaderInfoLog(shader_program, log_size, nullptr, error_log);
+    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &error_status);
+    if(!error_status) {
+      glGetShaderInfoLog(vertex_shader, log_size, nullptr, error_log);
+      fprintf(stderr, "GLSL Vertex Shader Error!\n%s", error_log);
+    }
+
+    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &error_status);
+    if(!error_status) {
+      glGetShaderInfoLog(fragment_shader, log_size, nullptr, error_log);
+      fprintf(stderr, "GLSL Fragment Shader Error!\n%s", error_log);
+    }
+
+    glGetProgramInfoLog(shader_program, log_size, nullptr, error_log);
     fprintf(stderr, "GLSL Shader Program Error!\n%s", error_log);
   }
 
@@ -74,3 +101,189 @@ unsigned int compile_shader_program(
 
   return shader_program;
 }
+
+// On-disk cache of linked program binaries keyed by a hash of the shader
+// sources and the driver strings. Falls back to compile_shader_program when
+// the driver has no binary formats or a cached binary is rejected.
+struct ShaderProgramCache {
+  std::string directory_path;
+  uint64_t driver_hash;
+  PFNGLGETPROGRAMBINARYPROC get_program_binary_ptr;
+  PFNGLPROGRAMBINARYPROC program_binary_ptr;
+  PFNGLPROGRAMPARAMETERIPROC program_parameteri_ptr;
+};
+
+constexpr uint32_t shader_cache_magic = 0x56534843; // "VSHC"
+
+uint64_t fnv1a_hash(const void* data_ptr, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+  const unsigned char* byte_ptr = static_cast<const unsigned char*>(data_ptr);
+  for (size_t byte_index = 0; byte_index < size; ++byte_index) {
+    hash ^= byte_ptr[byte_index];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+bool has_gl_extension(const char* extension_name) {
+  int extension_count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+  for (int extension_index = 0; extension_index < extension_count; ++extension_index) {
+    const char* name_ptr = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, extension_index));
+    if (name_ptr != nullptr && std::strcmp(name_ptr, extension_name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Must be called after gladLoadGLLoader with a current context.
+void init_shader_program_cache(ShaderProgramCache* cache_ptr,
+                               const std::string& directory_path,
+                               GLADloadproc load) {
+  cache_ptr->directory_path = directory_path;
+  cache_ptr->get_program_binary_ptr = nullptr;
+  cache_ptr->program_binary_ptr = nullptr;
+  cache_ptr->program_parameteri_ptr = nullptr;
+
+  const char* renderer_ptr = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+  const char* version_ptr = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  cache_ptr->driver_hash = fnv1a_hash(renderer_ptr, renderer_ptr ? std::strlen(renderer_ptr) : 0);
+  cache_ptr->driver_hash = fnv1a_hash(version_ptr, version_ptr ? std::strlen(version_ptr) : 0, cache_ptr->driver_hash);
+
+  const bool core_binary = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 1);
+  if (!core_binary && !has_gl_extension("GL_ARB_get_program_binary")) {
+    return;
+  }
+
+  int format_count = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+  if (format_count <= 0) {
+    return;
+  }
+
+  cache_ptr->get_program_binary_ptr = reinterpret_cast<PFNGLGETPROGRAMBINARYPROC>(load("glGetProgramBinary"));
+  cache_ptr->program_binary_ptr = reinterpret_cast<PFNGLPROGRAMBINARYPROC>(load("glProgramBinary"));
+  cache_ptr->program_parameteri_ptr = reinterpret_cast<PFNGLPROGRAMPARAMETERIPROC>(load("glProgramParameteri"));
+
+  if (cache_ptr->get_program_binary_ptr == nullptr ||
+      cache_ptr->program_binary_ptr == nullptr ||
+      cache_ptr->program_parameteri_ptr == nullptr) {
+    cache_ptr->get_program_binary_ptr = nullptr;
+    cache_ptr->program_binary_ptr = nullptr;
+    cache_ptr->program_parameteri_ptr = nullptr;
+    return;
+  }
+
+  mkdir(directory_path.data(), 0755);
+}
+
+std::string get_shader_cache_path(const ShaderProgramCache* cache_ptr,
+                                  const char* vertex_shader_source_ptr,
+                                  const char* fragment_shader_source_ptr) {
+  uint64_t hash = cache_ptr->driver_hash;
+  hash = fnv1a_hash(vertex_shader_source_ptr, std::strlen(vertex_shader_source_ptr) + 1, hash);
+  hash = fnv1a_hash(fragment_shader_source_ptr, std::strlen(fragment_shader_source_ptr) + 1, hash);
+
+  char file_name[32];
+  snprintf(file_name, sizeof(file_name), "%016llx.bin", static_cast<unsigned long long>(hash));
+  return cache_ptr->directory_path + "/" + file_name;
+}
+
+// Returns 0 when there is no usable cached binary.
+unsigned int load_cached_shader_program(const ShaderProgramCache* cache_ptr, const std::string& cache_path) {
+  FILE* fp = fopen(cache_path.data(), "rb");
+  if (fp == nullptr) {
+    return 0;
+  }
+
+  uint32_t header[3] = {}; // magic, binary format, binary size
+  std::vector<unsigned char> binary;
+  bool valid = fread(header, sizeof(header), 1, fp) == 1 && header[0] == shader_cache_magic;
+  if (valid) {
+    // A truncated or corrupt file must not size the allocation.
+    const long header_end = ftell(fp);
+    valid = fseek(fp, 0, SEEK_END) == 0 && ftell(fp) - header_end == long(header[2]) &&
+            fseek(fp, header_end, SEEK_SET) == 0;
+  }
+  if (valid) {
+    binary.resize(header[2]);
+    valid = fread(binary.data(), 1, binary.size(), fp) == binary.size();
+  }
+  fclose(fp);
+
+  if (!valid) {
+    return 0;
+  }
+
+  unsigned int shader_program = glCreateProgram();
+  cache_ptr->program_binary_ptr(shader_program, header[1], binary.data(), static_cast<GLsizei>(binary.size()));
+
+  int link_status = 0;
+  glGetProgramiv(shader_program, GL_LINK_STATUS, &link_status);
+  if (!link_status) {
+    // Driver updates may reject old binaries, the caller recompiles and overwrites.
+    glDeleteProgram(shader_program);
+    return 0;
+  }
+
+  return shader_program;
+}
+
+void store_cached_shader_program(const ShaderProgramCache* cache_ptr,
+                                 const std::string& cache_path,
+                                 unsigned int shader_program) {
+  int binary_size = 0;
+  glGetProgramiv(shader_program, GL_PROGRAM_BINARY_LENGTH, &binary_size);
+  if (binary_size <= 0) {
+    return;
+  }
+
+  std::vector<unsigned char> binary(binary_size);
+  GLenum binary_format = 0;
+  cache_ptr->get_program_binary_ptr(shader_program, binary_size, nullptr, &binary_format, binary.data());
+
+  // Write to a temporary file and rename so a crash never leaves a torn binary.
+  const std::string temp_path = cache_path + ".tmp";
+  FILE* fp = fopen(temp_path.data(), "wb");
+  if (fp == nullptr) {
+    fprintf(stderr, "ERROR! Unable to write shader cache: %s\n", temp_path.data());
+    return;
+  }
+
+  const uint32_t header[3] = { shader_cache_magic, binary_format, static_cast<uint32_t>(binary_size) };
+  const bool written = fwrite(header, sizeof(header), 1, fp) == 1 &&
+                       fwrite(binary.data(), 1, binary.size(), fp) == binary.size();
+  fclose(fp);
+
+  if (written) {
+    rename(temp_path.data(), cache_path.data());
+  } else {
+    remove(temp_path.data());
+  }
+}
+
+unsigned int load_shader_program(const ShaderProgramCache* cache_ptr,
+                                 const char* vertex_shader_source_ptr,
+                                 const char* fragment_shader_source_ptr) {
+  if (cache_ptr->program_binary_ptr == nullptr) {
+    return compile_shader_program(vertex_shader_source_ptr, fragment_shader_source_ptr);
+  }
+
+  const std::string cache_path = get_shader_cache_path(cache_ptr, vertex_shader_source_ptr, fragment_shader_source_ptr);
+
+  unsigned int shader_program = load_cached_shader_program(cache_ptr, cache_path);
+  if (shader_program != 0) {
+    return shader_program;
+  }
+
+  shader_program = compile_shader_program(vertex_shader_source_ptr, fragment_shader_source_ptr,
+                                          cache_ptr->program_parameteri_ptr);
+
+  int link_status = 0;
+  glGetProgramiv(shader_program, GL_LINK_STATUS, &link_status);
+  if (link_status) {
+    store_cached_shader_program(cache_ptr, cache_path, shader_program);
+  }
+
+  return shader_program;
+}
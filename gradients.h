@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "buffer_pool.h"
+#include "image.h"
+
+// Scharr derivatives of a greyscale image, 32 times the per pixel intensity
+// gradient. The outermost rows and columns are zero.
+struct GradientImage {
+  int width;
+  int height;
+  short* dx_ptr;
+  short* dy_ptr;
+};
+
+size_t get_gradient_buffer_size(int width, int height) {
+  // Rows are padded by 16 samples so the SIMD passes never read past the end.
+  return sizeof(short) * (width * height + 16);
+}
+
+// Separable Scharr: a vertical pass produces the [3 10 3] smoothed and the
+// [-1 0 1] differenced rows, a horizontal pass finishes dx and dy.
+void compute_scharr_gradients(GradientImage* gradient_image_ptr, const Image* grey_image_ptr, BufferPool* pool_ptr) {
+  const int width = grey_image_ptr->width;
+  const int height = grey_image_ptr->height;
+  const size_t buffer_size = get_gradient_buffer_size(width, height);
+
+  gradient_image_ptr->width = width;
+  gradient_image_ptr->height = height;
+  gradient_image_ptr->dx_ptr = (short*)acquire_buffer(pool_ptr, buffer_size);
+  gradient_image_ptr->dy_ptr = (short*)acquire_buffer(pool_ptr, buffer_size);
+
+  short* dx_ptr = gradient_image_ptr->dx_ptr;
+  short* dy_ptr = gradient_image_ptr->dy_ptr;
+
+  std::memset(dx_ptr, 0, sizeof(short) * width);
+  std::memset(dy_ptr, 0, sizeof(short) * width);
+  std::memset(dx_ptr + (height - 1) * width, 0, sizeof(short) * width);
+  std::memset(dy_ptr + (height - 1) * width, 0, sizeof(short) * width);
+
+  const size_t row_buffer_size = sizeof(short) * (width + 16);
+  short* smoothed_row_ptr = (short*)acquire_buffer(pool_ptr, row_buffer_size);
+  short* difference_row_ptr = (short*)acquire_buffer(pool_ptr, row_buffer_size);
+
+  for (int v = 1; v < height - 1; ++v) {
+    const unsigned char* above_ptr = grey_image_ptr->data_ptr + (v - 1) * width;
+    const unsigned char* center_ptr = above_ptr + width;
+    const unsigned char* below_ptr = center_ptr + width;
+
+    int u = 0;
+#if defined(__AVX2__)
+    const __m256i three = _mm256_set1_epi16(3);
+    const __m256i ten = _mm256_set1_epi16(10);
+    for (; u + 16 <= width; u += 16) {
+      const __m256i above = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(above_ptr + u)));
+      const __m256i center = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(center_ptr + u)));
+      const __m256i below = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(below_ptr + u)));
+      const __m256i smoothed = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_add_epi16(above, below), three),
+                                                _mm256_mullo_epi16(center, ten));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(smoothed_row_ptr + u), smoothed);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(difference_row_ptr + u), _mm256_sub_epi16(below, above));
+    }
+#endif
+    for (; u < width; ++u) {
+      smoothed_row_ptr[u] = 3 * (above_ptr[u] + below_ptr[u]) + 10 * center_ptr[u];
+      difference_row_ptr[u] = below_ptr[u] - above_ptr[u];
+    }
+
+    short* dx_row_ptr = dx_ptr + v * width;
+    short* dy_row_ptr = dy_ptr + v * width;
+    dx_row_ptr[0] = 0;
+    dy_row_ptr[0] = 0;
+
+    u = 1;
+#if defined(__AVX2__)
+    for (; u + 16 <= width - 1; u += 16) {
+      const __m256i smoothed_left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(smoothed_row_ptr + u - 1));
+      const __m256i smoothed_right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(smoothed_row_ptr + u + 1));
+      const __m256i difference_left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(difference_row_ptr + u - 1));
+      const __m256i difference_center = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(difference_row_ptr + u));
+      const __m256i difference_right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(difference_row_ptr + u + 1));
+      const __m256i dy = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_add_epi16(difference_left, difference_right), three),
+                                          _mm256_mullo_epi16(difference_center, ten));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dx_row_ptr + u), _mm256_sub_epi16(smoothed_right, smoothed_left));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dy_row_ptr + u), dy);
+    }
+#endif
+    for (; u < width - 1; ++u) {
+      dx_row_ptr[u] = smoothed_row_ptr[u + 1] - smoothed_row_ptr[u - 1];
+      dy_row_ptr[u] = 3 * (difference_row_ptr[u - 1] + difference_row_ptr[u + 1]) + 10 * difference_row_ptr[u];
+    }
+
+    dx_row_ptr[width - 1] = 0;
+    dy_row_ptr[width - 1] = 0;
+  }
+
+  release_buffer(pool_ptr, smoothed_row_ptr, row_buffer_size);
+  release_buffer(pool_ptr, difference_row_ptr, row_buffer_size);
+}
+
+void release_gradients(GradientImage* gradient_image_ptr, BufferPool* pool_ptr) {
+  const size_t buffer_size = get_gradient_buffer_size(gradient_image_ptr->width, gradient_image_ptr->height);
+  release_buffer(pool_ptr, gradient_image_ptr->dx_ptr, buffer_size);
+  release_buffer(pool_ptr, gradient_image_ptr->dy_ptr, buffer_size);
+  *gradient_image_ptr = {};
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+
+struct Image {
+  int width;
+  int height;
+  int channels;
+  const unsigned char* data_ptr;
+};
+
+
+void convert_image_to_greyscale(Image* grey_image_ptr, const Image* rgb_image_ptr) {
+  grey_image_ptr->width = rgb_image_ptr->width;
+  grey_image_ptr->height = rgb_image_ptr->height;
+  grey_image_ptr->channels = 1;
+  const size_t gray_buffer_size = sizeof(unsigned char) * grey_image_ptr->width * grey_image_ptr->height;
+  unsigned char* gray_buffer_ptr = (unsigned char*)std::malloc(gray_buffer_size);
+  
+  for (int pixel_index = 0; pixel_index < rgb_image_ptr->width*rgb_image_ptr->height; ++pixel_index) {
+    const unsigned char r = rgb_image_ptr->data_ptr[3*pixel_index + 0];
+    const unsigned char g = rgb_image_ptr->data_ptr[3*pixel_index + 1];
+    const unsigned char b = rgb_image_ptr->data_ptr[3*pixel_index + 2];
+
+    gray_buffer_ptr[pixel_index] = std::min((0.299f*r + 0.587f*g + 0.114f*b), 255.0f);
+  }
+  
+  grey_image_ptr->data_ptr = gray_buffer_ptr;
+}
+
+
+const unsigned char* get_pixel_ptr(int u, int v, const Image* image_ptr) {
+  return image_ptr->data_ptr + v * image_ptr->width + u;
+}
+
+
+// 7 tap Gaussian, sigma = 2, weights sum to 256.
+const int gaussian_kernel[] = { 18, 34, 49, 54, 49, 34, 18 };
+constexpr int gaussian_half_size = 3;
+
+// Separable blur of a greyscale image into a newly allocated buffer.
+// Borders are clamped.
+void gaussian_blur_image(Image* blurred_image_ptr, const Image* grey_image_ptr) {
+  const int width = grey_image_ptr->width;
+  const int height = grey_image_ptr->height;
+
+  blurred_image_ptr->width = width;
+  blurred_image_ptr->height = height;
+  blurred_image_ptr->channels = 1;
+
+  unsigned short* row_buffer_ptr = (unsigned short*)std::malloc(sizeof(unsigned short) * width * height);
+  unsigned char* blurred_buffer_ptr = (unsigned char*)std::malloc(sizeof(unsigned char) * width * height);
+
+  for (int v = 0; v < height; ++v) {
+    const unsigned char* src_row_ptr = grey_image_ptr->data_ptr + v * width;
+    unsigned short* dst_row_ptr = row_buffer_ptr + v * width;
+    for (int u = 0; u < width; ++u) {
+      int sum = 0;
+      for (int k = -gaussian_half_size; k <= gaussian_half_size; ++k) {
+        const int sample_u = std::clamp(u + k, 0, width - 1);
+        sum += gaussian_kernel[k + gaussian_half_size] * src_row_ptr[sample_u];
+      }
+      // Keep the 8 fractional bits for the vertical pass, 255*256 fits in 16 bits.
+      dst_row_ptr[u] = sum;
+    }
+  }
+
+  for (int v = 0; v < height; ++v) {
+    for (int u = 0; u < width; ++u) {
+      int sum = 0;
+      for (int k = -gaussian_half_size; k <= gaussian_half_size; ++k) {
+        const int sample_v = std::clamp(v + k, 0, height - 1);
+        sum += gaussian_kernel[k + gaussian_half_size] * row_buffer_ptr[sample_v * width + u];
+      }
+      blurred_buffer_ptr[v * width + u] = (sum + (1 << 15)) >> 16;
+    }
+  }
+
+  std::free(row_buffer_ptr);
+  blurred_image_ptr->data_ptr = blurred_buffer_ptr;
+}
+
+constexpr int max_pyramid_levels = 6;
+
+// Level 0 aliases the source image, every further level is half the size of
+// the previous one and owned by the pyramid.
+struct ImagePyramid {
+  int level_count;
+  Image levels[max_pyramid_levels];
+};
+
+// 5 tap binomial blur followed by 2x decimation, borders are clamped.
+void downsample_image(Image* half_image_ptr, const Image* image_ptr) {
+  const int width = image_ptr->width;
+  const int height = image_ptr->height;
+  const int half_width = (width + 1) / 2;
+  const int half_height = (height + 1) / 2;
+
+  half_image_ptr->width = half_width;
+  half_image_ptr->height = half_height;
+  half_image_ptr->channels = 1;
+
+  constexpr int kernel[] = { 1, 4, 6, 4, 1 };
+
+  unsigned short* row_buffer_ptr = (unsigned short*)std::malloc(sizeof(unsigned short) * half_width * height);
+  unsigned char* half_buffer_ptr = (unsigned char*)std::malloc(sizeof(unsigned char) * half_width * half_height);
+
+  for (int v = 0; v < height; ++v) {
+    const unsigned char* src_row_ptr = image_ptr->data_ptr + v * width;
+    for (int half_u = 0; half_u < half_width; ++half_u) {
+      int sum = 0;
+      for (int k = -2; k <= 2; ++k) {
+        sum += kernel[k + 2] * src_row_ptr[std::clamp(2 * half_u + k, 0, width - 1)];
+      }
+      row_buffer_ptr[v * half_width + half_u] = sum;
+    }
+  }
+
+  for (int half_v = 0; half_v < half_height; ++half_v) {
+    for (int half_u = 0; half_u < half_width; ++half_u) {
+      int sum = 0;
+      for (int k = -2; k <= 2; ++k) {
+        sum += kernel[k + 2] * row_buffer_ptr[std::clamp(2 * half_v + k, 0, height - 1) * half_width + half_u];
+      }
+      half_buffer_ptr[half_v * half_width + half_u] = (sum + 128) >> 8;
+    }
+  }
+
+  std::free(row_buffer_ptr);
+  half_image_ptr->data_ptr = half_buffer_ptr;
+}
+
+void build_image_pyramid(ImagePyramid* pyramid_ptr, const Image* grey_image_ptr, int level_count) {
+  pyramid_ptr->level_count = std::min(level_count, max_pyramid_levels);
+  pyramid_ptr->levels[0] = *grey_image_ptr;
+  for (int level = 1; level < pyramid_ptr->level_count; ++level) {
+    downsample_image(&pyramid_ptr->levels[level], &pyramid_ptr->levels[level - 1]);
+  }
+}
+
+void free_image_pyramid(ImagePyramid* pyramid_ptr) {
+  for (int level = 1; level < pyramid_ptr->level_count; ++level) {
+    std::free(const_cast<unsigned char*>(pyramid_ptr->levels[level].data_ptr));
+  }
+  pyramid_ptr->level_count = 0;
+}
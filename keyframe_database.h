@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+#include "vocabulary.h"
+
+// Inverted index from words to the keyframes that contain them. A query only
+// touches the keyframes sharing a word with it, so its cost follows the
+// number of common words rather than the size of the map.
+
+struct InvertedIndexEntry {
+  int keyframe_id;
+  float weight;
+};
+
+struct KeyframeDatabase {
+  std::vector<std::vector<InvertedIndexEntry>> inverted_index;
+  // Query scratch, indexed by keyframe id and kept zeroed between queries.
+  std::vector<float> scores;
+  std::vector<int> touched_ids;
+};
+
+struct KeyframeQueryResult {
+  int keyframe_id;
+  float score;
+};
+
+void init_keyframe_database(KeyframeDatabase* database_ptr, const Vocabulary* vocabulary_ptr) {
+  database_ptr->inverted_index.assign(vocabulary_ptr->word_count, {});
+  database_ptr->scores.clear();
+  database_ptr->touched_ids.clear();
+}
+
+// Keyframe ids are small non-negative integers, like frame indices.
+void add_keyframe_to_database(KeyframeDatabase* database_ptr, int keyframe_id, const BowVector* bow_vector_ptr) {
+  for (size_t index = 0; index < bow_vector_ptr->words.size(); ++index) {
+    database_ptr->inverted_index[bow_vector_ptr->words[index]].push_back({ keyframe_id, bow_vector_ptr->weights[index] });
+  }
+  if (keyframe_id >= int(database_ptr->scores.size())) {
+    database_ptr->scores.resize(keyframe_id + 1, 0.0f);
+  }
+}
+
+void remove_keyframe_from_database(KeyframeDatabase* database_ptr, int keyframe_id, const BowVector* bow_vector_ptr) {
+  for (const int word : bow_vector_ptr->words) {
+    std::vector<InvertedIndexEntry>& entries = database_ptr->inverted_index[word];
+    for (size_t index = 0; index < entries.size(); ++index) {
+      if (entries[index].keyframe_id == keyframe_id) {
+        entries[index] = entries.back();
+        entries.pop_back();
+        break;
+      }
+    }
+  }
+}
+
+// Keyframes with a similarity of at least min_score, best first and at most
+// max_results of them. Only ids up to max_keyframe_id are considered, which
+// keeps the recent neighbourhood out of loop queries.
+void query_keyframe_database(std::vector<KeyframeQueryResult>* results_ptr,
+                             KeyframeDatabase* database_ptr,
+                             const BowVector* bow_vector_ptr,
+                             int max_results,
+                             float min_score,
+                             int max_keyframe_id = INT_MAX) {
+  float* scores_ptr = database_ptr->scores.data();
+  std::vector<int>& touched_ids = database_ptr->touched_ids;
+  for (size_t index = 0; index < bow_vector_ptr->words.size(); ++index) {
+    const float weight = bow_vector_ptr->weights[index];
+    for (const InvertedIndexEntry& entry : database_ptr->inverted_index[bow_vector_ptr->words[index]]) {
+      if (entry.keyframe_id > max_keyframe_id) {
+        continue;
+      }
+      if (scores_ptr[entry.keyframe_id] == 0.0f) {
+        touched_ids.push_back(entry.keyframe_id);
+      }
+      scores_ptr[entry.keyframe_id] += get_bow_word_score(weight, entry.weight);
+    }
+  }
+
+  results_ptr->clear();
+  for (const int keyframe_id : touched_ids) {
+    if (scores_ptr[keyframe_id] >= min_score) {
+      results_ptr->push_back({ keyframe_id, scores_ptr[keyframe_id] });
+    }
+    scores_ptr[keyframe_id] = 0.0f;
+  }
+  touched_ids.clear();
+
+  const auto better = [](const KeyframeQueryResult& a, const KeyframeQueryResult& b) {
+    return a.score > b.score || (a.score == b.score && a.keyframe_id < b.keyframe_id);
+  };
+  if (int(results_ptr->size()) > max_results) {
+    std::partial_sort(results_ptr->begin(), results_ptr->begin() + max_results, results_ptr->end(), better);
+    results_ptr->resize(max_results);
+  } else {
+    std::sort(results_ptr->begin(), results_ptr->end(), better);
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "linalg.h"
+
+struct KeyframeSelectionParameters {
+  // A new keyframe is due once fewer than this fraction of the reference
+  // keyframe's points are still tracked...
+  float max_tracked_ratio = 0.9f;
+  // ...and the views have moved apart enough to triangulate new points.
+  float min_parallax_degrees = 1.0f;
+  // Below this many tracked points tracking is about to be lost, so any
+  // frame past min_interval is taken.
+  int min_tracked_count = 50;
+  // Seconds since the last keyframe.
+  double min_interval = 0.1;
+  double max_interval = 1.0;
+};
+
+// Tracker side keyframe decision. reference_tracked_count is the number of
+// map points the last keyframe tracked when it was inserted.
+bool should_insert_keyframe(int tracked_count,
+                            int reference_tracked_count,
+                            float median_parallax_degrees,
+                            double time_since_keyframe,
+                            const KeyframeSelectionParameters& parameters = {}) {
+  if (time_since_keyframe < parameters.min_interval) {
+    return false;
+  }
+  if (time_since_keyframe >= parameters.max_interval || tracked_count < parameters.min_tracked_count) {
+    return true;
+  }
+  return tracked_count < parameters.max_tracked_ratio * reference_tracked_count &&
+         median_parallax_degrees >= parameters.min_parallax_degrees;
+}
+
+// Median angle between matched rays once the rotation between the views is
+// removed, so pure rotation shows no parallax. Points are on the normalized
+// image planes and rotation takes view 1 to view 2.
+float compute_median_parallax_degrees(const float* x1_ptr,
+                                      const float* y1_ptr,
+                                      const float* x2_ptr,
+                                      const float* y2_ptr,
+                                      const unsigned char* mask_ptr,
+                                      int count,
+                                      const Mat3& rotation) {
+  std::vector<float> angles;
+  angles.reserve(count);
+  for (int index = 0; index < count; ++index) {
+    if (mask_ptr != nullptr && !mask_ptr[index]) {
+      continue;
+    }
+    const Vec3 ray1 = rotation * Vec3{ x1_ptr[index], y1_ptr[index], 1.0 };
+    const Vec3 ray2 = { x2_ptr[index], y2_ptr[index], 1.0 };
+    const double cosine = dot(ray1, ray2) / (norm(ray1) * norm(ray2));
+    angles.push_back(float(std::acos(std::min(1.0, cosine)) * 180.0 / pi));
+  }
+
+  if (angles.empty()) {
+    return 0.0f;
+  }
+  std::nth_element(angles.begin(), angles.begin() + angles.size() / 2, angles.end());
+  return angles[angles.size() / 2];
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "fast.h"
+#include "gradients.h"
+#include "image.h"
+
+struct KltParameters {
+  int window_half_size = 7;
+  int level_count = 4;
+  // Iteration cap per pyramid level, index 0 is full resolution.
+  int max_iterations[max_pyramid_levels] = { 20, 10, 10, 10, 10, 10 };
+  // Stop iterating once the update is below this many pixels.
+  float epsilon = 0.01f;
+  // Smallest accepted eigenvalue of the structure tensor, per pixel of window
+  // in squared intensity units.
+  float min_eigenvalue = 1.0f;
+  // Largest accepted mean absolute intensity difference after convergence.
+  float max_error = 30.0f;
+};
+
+constexpr int klt_max_window_half_size = 15;
+constexpr int klt_max_window_area = (2 * klt_max_window_half_size + 1) * (2 * klt_max_window_half_size + 1);
+// Patches are zero padded to a multiple of 16 samples for the SIMD sums.
+constexpr int klt_max_padded_area = (klt_max_window_area + 15) & ~15;
+constexpr int klt_patch_slack = 8;
+
+// Bilinear weights use 14 fractional bits, interpolated intensities keep 5.
+constexpr int klt_weight_bits = 14;
+constexpr int klt_intensity_bits = 5;
+constexpr int klt_interpolation_shift = klt_weight_bits - klt_intensity_bits;
+
+struct BilinearWeights {
+  int w00;
+  int w01;
+  int w10;
+  int w11;
+};
+
+BilinearWeights get_bilinear_weights(float u, float v) {
+  const float a = u - std::floor(u);
+  const float b = v - std::floor(v);
+  constexpr float one = 1 << klt_weight_bits;
+  BilinearWeights weights;
+  weights.w00 = std::lround((1.0f - a) * (1.0f - b) * one);
+  weights.w01 = std::lround(a * (1.0f - b) * one);
+  weights.w10 = std::lround((1.0f - a) * b * one);
+  weights.w11 = (1 << klt_weight_bits) - weights.w00 - weights.w01 - weights.w10;
+  return weights;
+}
+
+// Samples a size x size patch with its top left corner at (u, v) into
+// intensities with klt_intensity_bits fractional bits. The SIMD path writes
+// up to 7 samples past the end of the patch, so patches need that much slack,
+// and reads up to 8 pixels past the right edge of the sampled area.
+void sample_patch(short* patch_ptr, const Image* image_ptr, float u, float v, int size) {
+  const BilinearWeights weights = get_bilinear_weights(u, v);
+  const int width = image_ptr->width;
+  const unsigned char* origin_ptr = get_pixel_ptr(int(std::floor(u)), int(std::floor(v)), image_ptr);
+  constexpr int rounding = 1 << (klt_interpolation_shift - 1);
+
+#if defined(__AVX2__)
+  const __m128i top_weights = _mm_set1_epi32((weights.w01 << 16) | weights.w00);
+  const __m128i bottom_weights = _mm_set1_epi32((weights.w11 << 16) | weights.w10);
+  const __m128i rounding_x4 = _mm_set1_epi32(rounding);
+
+  for (int row = 0; row < size; ++row) {
+    const unsigned char* row_ptr = origin_ptr + row * width;
+    for (int column = 0; column < size; column += 8) {
+      const unsigned char* pixel_ptr = row_ptr + column;
+      const __m128i p00 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixel_ptr)));
+      const __m128i p01 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixel_ptr + 1)));
+      const __m128i p10 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixel_ptr + width)));
+      const __m128i p11 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixel_ptr + width + 1)));
+
+      // Interleaved (left, right) pairs so one madd applies both horizontal weights.
+      __m128i low = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(p00, p01), top_weights),
+                                  _mm_madd_epi16(_mm_unpacklo_epi16(p10, p11), bottom_weights));
+      __m128i high = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(p00, p01), top_weights),
+                                   _mm_madd_epi16(_mm_unpackhi_epi16(p10, p11), bottom_weights));
+      low = _mm_srai_epi32(_mm_add_epi32(low, rounding_x4), klt_interpolation_shift);
+      high = _mm_srai_epi32(_mm_add_epi32(high, rounding_x4), klt_interpolation_shift);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(patch_ptr + row * size + column), _mm_packs_epi32(low, high));
+    }
+  }
+#else
+  for (int row = 0; row < size; ++row) {
+    const unsigned char* row_ptr = origin_ptr + row * width;
+    for (int column = 0; column < size; ++column) {
+      const unsigned char* pixel_ptr = row_ptr + column;
+      const int value = weights.w00 * pixel_ptr[0] + weights.w01 * pixel_ptr[1] +
+                        weights.w10 * pixel_ptr[width] + weights.w11 * pixel_ptr[width + 1];
+      patch_ptr[row * size + column] = (value + rounding) >> klt_interpolation_shift;
+    }
+  }
+#endif
+}
+
+// Same as sample_patch for an int16 image. Values keep their scale, and the
+// SIMD path reads up to 8 samples past the right edge of the sampled area.
+void sample_short_patch(short* patch_ptr, const short* image_ptr, int width, float u, float v, int size) {
+  const BilinearWeights weights = get_bilinear_weights(u, v);
+  const short* origin_ptr = image_ptr + int(std::floor(u)) + int(std::floor(v)) * width;
+  constexpr int rounding = 1 << (klt_weight_bits - 1);
+
+#if defined(__AVX2__)
+  const __m128i top_weights = _mm_set1_epi32((weights.w01 << 16) | weights.w00);
+  const __m128i bottom_weights = _mm_set1_epi32((weights.w11 << 16) | weights.w10);
+  const __m128i rounding_x4 = _mm_set1_epi32(rounding);
+
+  for (int row = 0; row < size; ++row) {
+    const short* row_ptr = origin_ptr + row * width;
+    for (int column = 0; column < size; column += 8) {
+      const short* pixel_ptr = row_ptr + column;
+      const __m128i p00 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel_ptr));
+      const __m128i p01 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel_ptr + 1));
+      const __m128i p10 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel_ptr + width));
+      const __m128i p11 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel_ptr + width + 1));
+
+      __m128i low = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(p00, p01), top_weights),
+                                  _mm_madd_epi16(_mm_unpacklo_epi16(p10, p11), bottom_weights));
+      __m128i high = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(p00, p01), top_weights),
+                                   _mm_madd_epi16(_mm_unpackhi_epi16(p10, p11), bottom_weights));
+      low = _mm_srai_epi32(_mm_add_epi32(low, rounding_x4), klt_weight_bits);
+      high = _mm_srai_epi32(_mm_add_epi32(high, rounding_x4), klt_weight_bits);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(patch_ptr + row * size + column), _mm_packs_epi32(low, high));
+    }
+  }
+#else
+  for (int row = 0; row < size; ++row) {
+    const short* row_ptr = origin_ptr + row * width;
+    for (int column = 0; column < size; ++column) {
+      const short* pixel_ptr = row_ptr + column;
+      const int value = weights.w00 * pixel_ptr[0] + weights.w01 * pixel_ptr[1] +
+                        weights.w10 * pixel_ptr[width] + weights.w11 * pixel_ptr[width + 1];
+      patch_ptr[row * size + column] = (value + rounding) >> klt_weight_bits;
+    }
+  }
+#endif
+}
+
+// Sums of a[i] * b[i] over padded int16 arrays. Pairs are summed in 32 bit and
+// accumulated in float so large windows cannot overflow.
+void dot_products_int16(float* sums_ptr,
+                        const short* a_ptr,
+                        const short* const* b_ptrs,
+                        int b_count,
+                        int padded_size) {
+#if defined(__AVX2__)
+  __m256 sums[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+  for (int index = 0; index < padded_size; index += 16) {
+    const __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i*>(a_ptr + index));
+    for (int b_index = 0; b_index < b_count; ++b_index) {
+      const __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i*>(b_ptrs[b_index] + index));
+      sums[b_index] = _mm256_add_ps(sums[b_index], _mm256_cvtepi32_ps(_mm256_madd_epi16(a, b)));
+    }
+  }
+  for (int b_index = 0; b_index < b_count; ++b_index) {
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, sums[b_index]);
+    sums_ptr[b_index] = lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+  }
+#else
+  for (int b_index = 0; b_index < b_count; ++b_index) {
+    float sum = 0.0f;
+    for (int index = 0; index < padded_size; index += 2) {
+      sum += float(a_ptr[index] * b_ptrs[b_index][index] + a_ptr[index + 1] * b_ptrs[b_index][index + 1]);
+    }
+    sums_ptr[b_index] = sum;
+  }
+#endif
+}
+
+// Sparse pyramidal Lucas-Kanade. Tracks every keypoint from the previous
+// pyramid into the next one, writing the tracked location and a status of 1
+// for tracked and 0 for lost points. previous_gradients_ptr holds the Scharr
+// gradients of every level of the previous pyramid.
+void track_klt(float* tracked_u_ptr,
+               float* tracked_v_ptr,
+               unsigned char* status_ptr,
+               const Keypoints* keypoints_ptr,
+               const ImagePyramid* previous_pyramid_ptr,
+               const GradientImage* previous_gradients_ptr,
+               const ImagePyramid* next_pyramid_ptr,
+               const KltParameters& parameters = {}) {
+  const int half_size = std::min(parameters.window_half_size, klt_max_window_half_size);
+  const int window_size = 2 * half_size + 1;
+  const int window_area = window_size * window_size;
+  const int padded_area = (window_area + 15) & ~15;
+  const int level_count = std::min({ parameters.level_count,
+                                     previous_pyramid_ptr->level_count,
+                                     next_pyramid_ptr->level_count });
+
+  alignas(32) short previous_patch[klt_max_padded_area + klt_patch_slack] = {};
+  alignas(32) short next_patch[klt_max_padded_area + klt_patch_slack] = {};
+  alignas(32) short difference[klt_max_padded_area] = {};
+  alignas(32) short gradient_u[klt_max_padded_area + klt_patch_slack] = {};
+  alignas(32) short gradient_v[klt_max_padded_area + klt_patch_slack] = {};
+
+  const short* gradients[3] = { gradient_u, gradient_v, gradient_v };
+
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    float flow_u = 0.0f;
+    float flow_v = 0.0f;
+    unsigned char status = 1;
+
+    for (int level = level_count - 1; level >= 0 && status; --level) {
+      const Image* previous_image_ptr = &previous_pyramid_ptr->levels[level];
+      const Image* next_image_ptr = &next_pyramid_ptr->levels[level];
+      const float scale = 1.0f / (1 << level);
+      const float u = keypoints_ptr->u[keypoint_index] * scale;
+      const float v = keypoints_ptr->v[keypoint_index] * scale;
+
+      if (level != level_count - 1) {
+        flow_u *= 2.0f;
+        flow_v *= 2.0f;
+      }
+
+      // Same margin as the next image, the SIMD samplers read the whole
+      // window plus one row and column for the interpolation.
+      const float previous_u = u - half_size;
+      const float previous_v = v - half_size;
+      if (previous_u < 0 || previous_v < 0 ||
+          previous_u + window_size + 1 >= previous_image_ptr->width ||
+          previous_v + window_size + 1 >= previous_image_ptr->height) {
+        // Coarse levels just pass the guess on, at full resolution the point is lost.
+        status = level > 0;
+        continue;
+      }
+
+      const GradientImage* gradient_image_ptr = &previous_gradients_ptr[level];
+      sample_patch(previous_patch, previous_image_ptr, previous_u, previous_v, window_size);
+      sample_short_patch(gradient_u, gradient_image_ptr->dx_ptr, gradient_image_ptr->width, previous_u, previous_v, window_size);
+      sample_short_patch(gradient_v, gradient_image_ptr->dy_ptr, gradient_image_ptr->width, previous_u, previous_v, window_size);
+
+      // The SIMD samplers write past the window, restore the zero padding.
+      for (int index = window_area; index < padded_area; ++index) {
+        previous_patch[index] = 0;
+        gradient_u[index] = 0;
+        gradient_v[index] = 0;
+      }
+
+      float tensor[3];
+      dot_products_int16(tensor, gradient_u, gradients, 2, padded_area);
+      dot_products_int16(tensor + 2, gradient_v, gradients + 1, 1, padded_area);
+      const float gxx = tensor[0];
+      const float gxy = tensor[1];
+      const float gyy = tensor[2];
+
+      // Scharr gradients are 32 times the intensity gradient.
+      constexpr float gradient_scale = 1.0f / (32.0f * 32.0f);
+      const float min_eigenvalue = 0.5f * (gxx + gyy - std::sqrt((gxx - gyy) * (gxx - gyy) + 4.0f * gxy * gxy));
+      if (min_eigenvalue * gradient_scale / window_area < parameters.min_eigenvalue) {
+        status = 0;
+        break;
+      }
+
+      const float inverse_determinant = 1.0f / (gxx * gyy - gxy * gxy);
+      const float epsilon_squared = parameters.epsilon * parameters.epsilon;
+      const int max_iterations = parameters.max_iterations[level];
+
+      for (int iteration = 0; iteration < max_iterations; ++iteration) {
+        const float next_u = u + flow_u - half_size;
+        const float next_v = v + flow_v - half_size;
+        if (next_u < 0 || next_v < 0 ||
+            next_u + window_size + 1 >= next_image_ptr->width || next_v + window_size + 1 >= next_image_ptr->height) {
+          status = level > 0;
+          break;
+        }
+
+        sample_patch(next_patch, next_image_ptr, next_u, next_v, window_size);
+        for (int index = 0; index < window_area; ++index) {
+          difference[index] = previous_patch[index] - next_patch[index];
+        }
+
+        float mismatch[2];
+        dot_products_int16(mismatch, difference, gradients, 2, padded_area);
+
+        // Intensities and gradients both carry a factor 32, which cancels.
+        const float delta_u = inverse_determinant * (gyy * mismatch[0] - gxy * mismatch[1]);
+        const float delta_v = inverse_determinant * (gxx * mismatch[1] - gxy * mismatch[0]);
+        flow_u += delta_u;
+        flow_v += delta_v;
+
+        if (delta_u * delta_u + delta_v * delta_v < epsilon_squared) {
+          break;
+        }
+      }
+    }
+
+    const float tracked_u = keypoints_ptr->u[keypoint_index] + flow_u;
+    const float tracked_v = keypoints_ptr->v[keypoint_index] + flow_v;
+
+    if (status) {
+      const Image* next_image_ptr = &next_pyramid_ptr->levels[0];
+      const float next_u = tracked_u - half_size;
+      const float next_v = tracked_v - half_size;
+      if (next_u < 0 || next_v < 0 ||
+          next_u + window_size + 1 >= next_image_ptr->width || next_v + window_size + 1 >= next_image_ptr->height) {
+        status = 0;
+      } else {
+        // previous_patch still holds the full resolution template.
+        sample_patch(next_patch, next_image_ptr, next_u, next_v, window_size);
+        int error_sum = 0;
+        for (int index = 0; index < window_area; ++index) {
+          error_sum += std::abs(previous_patch[index] - next_patch[index]);
+        }
+        const float mean_error = float(error_sum) / (window_area << klt_intensity_bits);
+        status = mean_error <= parameters.max_error;
+      }
+    }
+
+    tracked_u_ptr[keypoint_index] = tracked_u;
+    tracked_v_ptr[keypoint_index] = tracked_v;
+    status_ptr[keypoint_index] = status;
+  }
+}
@@ -0,0 +1,643 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// Small fixed-size linear algebra for geometry. Everything is plain structs
+// on the stack, loops have fixed trip counts so the compiler can unroll and
+// vectorize them, and the arithmetic-only parts are constexpr.
+
+constexpr double pi = 3.14159265358979323846;
+
+struct Vec3 {
+  double x;
+  double y;
+  double z;
+};
+
+constexpr Vec3 operator+(const Vec3& a, const Vec3& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+constexpr Vec3 operator-(const Vec3& a, const Vec3& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+constexpr Vec3 operator-(const Vec3& a) { return { -a.x, -a.y, -a.z }; }
+constexpr Vec3 operator*(double s, const Vec3& a) { return { s * a.x, s * a.y, s * a.z }; }
+
+constexpr double dot(const Vec3& a, const Vec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+constexpr Vec3 cross(const Vec3& a, const Vec3& b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+double norm(const Vec3& a) { return std::sqrt(dot(a, a)); }
+Vec3 normalized(const Vec3& a) { return (1.0 / norm(a)) * a; }
+
+// Row major 3x3 matrix.
+struct Mat3 {
+  double m[3][3];
+};
+
+constexpr Mat3 identity3() {
+  return {{ { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } }};
+}
+
+constexpr Mat3 operator+(const Mat3& a, const Mat3& b) {
+  Mat3 c = {};
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      c.m[row][column] = a.m[row][column] + b.m[row][column];
+    }
+  }
+  return c;
+}
+
+constexpr Mat3 operator*(double s, const Mat3& a) {
+  Mat3 c = {};
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      c.m[row][column] = s * a.m[row][column];
+    }
+  }
+  return c;
+}
+
+constexpr Mat3 operator*(const Mat3& a, const Mat3& b) {
+  Mat3 c = {};
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      c.m[row][column] = a.m[row][0] * b.m[0][column] + a.m[row][1] * b.m[1][column] + a.m[row][2] * b.m[2][column];
+    }
+  }
+  return c;
+}
+
+constexpr Vec3 operator*(const Mat3& a, const Vec3& v) {
+  return { a.m[0][0] * v.x + a.m[0][1] * v.y + a.m[0][2] * v.z,
+           a.m[1][0] * v.x + a.m[1][1] * v.y + a.m[1][2] * v.z,
+           a.m[2][0] * v.x + a.m[2][1] * v.y + a.m[2][2] * v.z };
+}
+
+constexpr Mat3 transpose(const Mat3& a) {
+  Mat3 t = {};
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      t.m[row][column] = a.m[column][row];
+    }
+  }
+  return t;
+}
+
+constexpr double determinant(const Mat3& a) {
+  return a.m[0][0] * (a.m[1][1] * a.m[2][2] - a.m[1][2] * a.m[2][1]) -
+         a.m[0][1] * (a.m[1][0] * a.m[2][2] - a.m[1][2] * a.m[2][0]) +
+         a.m[0][2] * (a.m[1][0] * a.m[2][1] - a.m[1][1] * a.m[2][0]);
+}
+
+constexpr Mat3 skew(const Vec3& v) {
+  return {{ { 0.0, -v.z, v.y }, { v.z, 0.0, -v.x }, { -v.y, v.x, 0.0 } }};
+}
+
+constexpr Vec3 get_column(const Mat3& a, int column) {
+  return { a.m[0][column], a.m[1][column], a.m[2][column] };
+}
+
+constexpr void set_column(Mat3* a_ptr, int column, const Vec3& v) {
+  a_ptr->m[0][column] = v.x;
+  a_ptr->m[1][column] = v.y;
+  a_ptr->m[2][column] = v.z;
+}
+
+// Inverse from the adjugate, callers check the determinant for singularity.
+constexpr Mat3 inverse(const Mat3& a) {
+  const Vec3 r0 = { a.m[0][0], a.m[0][1], a.m[0][2] };
+  const Vec3 r1 = { a.m[1][0], a.m[1][1], a.m[1][2] };
+  const Vec3 r2 = { a.m[2][0], a.m[2][1], a.m[2][2] };
+  const Vec3 c0 = cross(r1, r2);
+  const Vec3 c1 = cross(r2, r0);
+  const Vec3 c2 = cross(r0, r1);
+  const double inverse_determinant = 1.0 / dot(r0, c0);
+  Mat3 result = {};
+  set_column(&result, 0, inverse_determinant * c0);
+  set_column(&result, 1, inverse_determinant * c1);
+  set_column(&result, 2, inverse_determinant * c2);
+  return result;
+}
+
+// Rotation matrix of an axis-angle vector (Rodrigues).
+Mat3 exp_so3(const Vec3& omega) {
+  const double theta_squared = dot(omega, omega);
+  double a;
+  double b;
+  if (theta_squared < 1e-12) {
+    a = 1.0 - theta_squared / 6.0;
+    b = 0.5 - theta_squared / 24.0;
+  } else {
+    const double theta = std::sqrt(theta_squared);
+    a = std::sin(theta) / theta;
+    b = (1.0 - std::cos(theta)) / theta_squared;
+  }
+
+  const Mat3 k = skew(omega);
+  return identity3() + a * k + b * (k * k);
+}
+
+// Axis-angle vector of a rotation matrix, the inverse of exp_so3.
+Vec3 log_so3(const Mat3& rotation) {
+  const double cosine = std::clamp(0.5 * (rotation.m[0][0] + rotation.m[1][1] + rotation.m[2][2] - 1.0), -1.0, 1.0);
+  const Vec3 axis_sine = { 0.5 * (rotation.m[2][1] - rotation.m[1][2]),
+                           0.5 * (rotation.m[0][2] - rotation.m[2][0]),
+                           0.5 * (rotation.m[1][0] - rotation.m[0][1]) };
+  const double theta = std::acos(cosine);
+  if (theta < 1e-6) {
+    return axis_sine;
+  }
+  if (theta < pi - 1e-3) {
+    return (theta / std::sin(theta)) * axis_sine;
+  }
+
+  // Near pi the sine vanishes, take the axis from the largest diagonal term
+  // of R + R^T = 2 cos I + 2 (1 - cos) a a^T.
+  int k = 0;
+  for (int i = 1; i < 3; ++i) {
+    if (rotation.m[i][i] > rotation.m[k][k]) {
+      k = i;
+    }
+  }
+  double axis[3];
+  for (int i = 0; i < 3; ++i) {
+    axis[i] = 0.5 * (rotation.m[i][k] + rotation.m[k][i]) - (i == k ? cosine : 0.0);
+  }
+  Vec3 direction = normalized({ axis[0], axis[1], axis[2] });
+  if (dot(direction, axis_sine) < 0.0) {
+    direction = -direction;
+  }
+  return theta * direction;
+}
+
+// Cyclic Jacobi eigen decomposition of a symmetric matrix. Eigenvalues are
+// sorted in descending order, eigenvectors are the columns of vectors.
+void symmetric_eigen_3x3(const Mat3& a, Vec3* values_ptr, Mat3* vectors_ptr) {
+  Mat3 d = a;
+  Mat3 v = identity3();
+
+  for (int sweep = 0; sweep < 32; ++sweep) {
+    const double off_diagonal = d.m[0][1] * d.m[0][1] + d.m[0][2] * d.m[0][2] + d.m[1][2] * d.m[1][2];
+    const double diagonal = d.m[0][0] * d.m[0][0] + d.m[1][1] * d.m[1][1] + d.m[2][2] * d.m[2][2];
+    if (off_diagonal <= 1e-30 * diagonal || off_diagonal == 0.0) {
+      break;
+    }
+
+    for (int p = 0; p < 2; ++p) {
+      for (int q = p + 1; q < 3; ++q) {
+        if (d.m[p][q] == 0.0) {
+          continue;
+        }
+        const double theta = (d.m[q][q] - d.m[p][p]) / (2.0 * d.m[p][q]);
+        const double t = (theta >= 0.0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+        const double c = 1.0 / std::sqrt(t * t + 1.0);
+        const double s = t * c;
+
+        // d = J^T d J with the rotation J in the (p, q) plane.
+        for (int k = 0; k < 3; ++k) {
+          const double dkp = d.m[k][p];
+          const double dkq = d.m[k][q];
+          d.m[k][p] = c * dkp - s * dkq;
+          d.m[k][q] = s * dkp + c * dkq;
+        }
+        for (int k = 0; k < 3; ++k) {
+          const double dpk = d.m[p][k];
+          const double dqk = d.m[q][k];
+          d.m[p][k] = c * dpk - s * dqk;
+          d.m[q][k] = s * dpk + c * dqk;
+        }
+        for (int k = 0; k < 3; ++k) {
+          const double vkp = v.m[k][p];
+          const double vkq = v.m[k][q];
+          v.m[k][p] = c * vkp - s * vkq;
+          v.m[k][q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+
+  int order[3] = { 0, 1, 2 };
+  std::sort(order, order + 3, [&d](int i, int j) { return d.m[i][i] > d.m[j][j]; });
+
+  *values_ptr = { d.m[order[0]][order[0]], d.m[order[1]][order[1]], d.m[order[2]][order[2]] };
+  for (int column = 0; column < 3; ++column) {
+    set_column(vectors_ptr, column, get_column(v, order[column]));
+  }
+}
+
+// a = u * diag(s) * v^T with u and v proper rotations. Singular values are
+// sorted by magnitude, the last one carries the sign of det(a).
+void svd_3x3(const Mat3& a, Mat3* u_ptr, Vec3* s_ptr, Mat3* v_ptr) {
+  Vec3 eigenvalues;
+  Mat3 v;
+  symmetric_eigen_3x3(transpose(a) * a, &eigenvalues, &v);
+
+  if (determinant(v) < 0.0) {
+    set_column(&v, 2, -get_column(v, 2));
+  }
+
+  const Vec3 v0 = get_column(v, 0);
+  const Vec3 v1 = get_column(v, 1);
+  const Vec3 v2 = get_column(v, 2);
+
+  Vec3 u0 = a * v0;
+  const double s0 = norm(u0);
+  u0 = s0 > 0.0 ? (1.0 / s0) * u0 : Vec3{ 1.0, 0.0, 0.0 };
+
+  // Gram-Schmidt keeps u orthonormal when a is rank deficient.
+  Vec3 u1 = a * v1;
+  u1 = u1 - dot(u1, u0) * u0;
+  double s1 = norm(u1);
+  if (s1 > 1e-300) {
+    u1 = (1.0 / s1) * u1;
+  } else {
+    const Vec3 axis = std::fabs(u0.x) < 0.9 ? Vec3{ 1.0, 0.0, 0.0 } : Vec3{ 0.0, 1.0, 0.0 };
+    u1 = normalized(cross(u0, axis));
+  }
+  s1 = dot(a * v1, u1);
+
+  const Vec3 u2 = cross(u0, u1);
+  const double s2 = dot(a * v2, u2);
+
+  set_column(u_ptr, 0, u0);
+  set_column(u_ptr, 1, u1);
+  set_column(u_ptr, 2, u2);
+  *s_ptr = { s0, s1, s2 };
+  *v_ptr = v;
+}
+
+// Cholesky solve of the symmetric positive definite system a * x = b for a
+// compile time size. Returns false if a is not positive definite.
+template <int N>
+bool solve_cholesky_fixed(double x[N], const double a[N][N], const double b[N]) {
+  double l[N][N] = {};
+  for (int j = 0; j < N; ++j) {
+    double diagonal = a[j][j];
+    for (int k = 0; k < j; ++k) {
+      diagonal -= l[j][k] * l[j][k];
+    }
+    if (!(diagonal > 0.0)) {
+      return false;
+    }
+    l[j][j] = std::sqrt(diagonal);
+    for (int i = j + 1; i < N; ++i) {
+      double value = a[i][j];
+      for (int k = 0; k < j; ++k) {
+        value -= l[i][k] * l[j][k];
+      }
+      l[i][j] = value / l[j][j];
+    }
+  }
+
+  double y[N] = {};
+  for (int i = 0; i < N; ++i) {
+    double value = b[i];
+    for (int k = 0; k < i; ++k) {
+      value -= l[i][k] * y[k];
+    }
+    y[i] = value / l[i][i];
+  }
+  for (int i = N - 1; i >= 0; --i) {
+    double value = y[i];
+    for (int k = i + 1; k < N; ++k) {
+      value -= l[k][i] * x[k];
+    }
+    x[i] = value / l[i][i];
+  }
+  return true;
+}
+
+bool solve_cholesky(Vec3* x_ptr, const Mat3& a, const Vec3& b) {
+  const double rhs[3] = { b.x, b.y, b.z };
+  double x[3];
+  if (!solve_cholesky_fixed<3>(x, a.m, rhs)) {
+    return false;
+  }
+  *x_ptr = { x[0], x[1], x[2] };
+  return true;
+}
+
+// 6-vectors hold twists and pose updates ordered (w, v), rotation first.
+struct Vec6 {
+  double v[6];
+};
+
+// Row major 6x6 matrix.
+struct Mat6 {
+  double m[6][6];
+};
+
+constexpr Vec6 make_vec6(const Vec3& head, const Vec3& tail) {
+  return {{ head.x, head.y, head.z, tail.x, tail.y, tail.z }};
+}
+
+constexpr Vec3 get_head(const Vec6& a) { return { a.v[0], a.v[1], a.v[2] }; }
+constexpr Vec3 get_tail(const Vec6& a) { return { a.v[3], a.v[4], a.v[5] }; }
+
+constexpr Vec6 operator+(const Vec6& a, const Vec6& b) {
+  Vec6 c = {};
+  for (int i = 0; i < 6; ++i) {
+    c.v[i] = a.v[i] + b.v[i];
+  }
+  return c;
+}
+
+constexpr Vec6 operator-(const Vec6& a) {
+  Vec6 c = {};
+  for (int i = 0; i < 6; ++i) {
+    c.v[i] = -a.v[i];
+  }
+  return c;
+}
+
+constexpr Vec6 operator*(double s, const Vec6& a) {
+  Vec6 c = {};
+  for (int i = 0; i < 6; ++i) {
+    c.v[i] = s * a.v[i];
+  }
+  return c;
+}
+
+constexpr double dot(const Vec6& a, const Vec6& b) {
+  double sum = 0.0;
+  for (int i = 0; i < 6; ++i) {
+    sum += a.v[i] * b.v[i];
+  }
+  return sum;
+}
+
+constexpr Mat6 identity6() {
+  Mat6 a = {};
+  for (int i = 0; i < 6; ++i) {
+    a.m[i][i] = 1.0;
+  }
+  return a;
+}
+
+constexpr Mat6 operator*(double s, const Mat6& a) {
+  Mat6 c = {};
+  for (int row = 0; row < 6; ++row) {
+    for (int column = 0; column < 6; ++column) {
+      c.m[row][column] = s * a.m[row][column];
+    }
+  }
+  return c;
+}
+
+constexpr Mat6 operator*(const Mat6& a, const Mat6& b) {
+  Mat6 c = {};
+  for (int row = 0; row < 6; ++row) {
+    for (int k = 0; k < 6; ++k) {
+      for (int column = 0; column < 6; ++column) {
+        c.m[row][column] += a.m[row][k] * b.m[k][column];
+      }
+    }
+  }
+  return c;
+}
+
+constexpr Vec6 operator*(const Mat6& a, const Vec6& x) {
+  Vec6 y = {};
+  for (int row = 0; row < 6; ++row) {
+    for (int column = 0; column < 6; ++column) {
+      y.v[row] += a.m[row][column] * x.v[column];
+    }
+  }
+  return y;
+}
+
+constexpr Mat6 transpose(const Mat6& a) {
+  Mat6 t = {};
+  for (int row = 0; row < 6; ++row) {
+    for (int column = 0; column < 6; ++column) {
+      t.m[row][column] = a.m[column][row];
+    }
+  }
+  return t;
+}
+
+bool solve_cholesky(Vec6* x_ptr, const Mat6& a, const Vec6& b) {
+  return solve_cholesky_fixed<6>(x_ptr->v, a.m, b.v);
+}
+
+// One-sided Jacobi SVD, a = u * diag(s) * v^T. Columns of a are rotated until
+// they are mutually orthogonal, which stays accurate for ill-conditioned
+// normal equations. Singular values are non-negative and sorted in
+// descending order, u is completed to an orthonormal basis when a is rank
+// deficient.
+void svd_6x6(const Mat6& a, Mat6* u_ptr, Vec6* s_ptr, Mat6* v_ptr) {
+  Mat6 w = a;
+  Mat6 v = identity6();
+
+  for (int sweep = 0; sweep < 32; ++sweep) {
+    bool rotated = false;
+    for (int p = 0; p < 5; ++p) {
+      for (int q = p + 1; q < 6; ++q) {
+        double alpha = 0.0;
+        double beta = 0.0;
+        double gamma = 0.0;
+        for (int k = 0; k < 6; ++k) {
+          alpha += w.m[k][p] * w.m[k][p];
+          beta += w.m[k][q] * w.m[k][q];
+          gamma += w.m[k][p] * w.m[k][q];
+        }
+        if (gamma == 0.0 || std::fabs(gamma) <= 1e-15 * std::sqrt(alpha * beta)) {
+          continue;
+        }
+        rotated = true;
+
+        const double zeta = (beta - alpha) / (2.0 * gamma);
+        const double t = (zeta >= 0.0 ? 1.0 : -1.0) / (std::fabs(zeta) + std::sqrt(zeta * zeta + 1.0));
+        const double c = 1.0 / std::sqrt(t * t + 1.0);
+        const double s = t * c;
+        for (int k = 0; k < 6; ++k) {
+          const double wkp = w.m[k][p];
+          const double wkq = w.m[k][q];
+          w.m[k][p] = c * wkp - s * wkq;
+          w.m[k][q] = s * wkp + c * wkq;
+          const double vkp = v.m[k][p];
+          const double vkq = v.m[k][q];
+          v.m[k][p] = c * vkp - s * vkq;
+          v.m[k][q] = s * vkp + c * vkq;
+        }
+      }
+    }
+    if (!rotated) {
+      break;
+    }
+  }
+
+  double norms[6];
+  for (int column = 0; column < 6; ++column) {
+    double squared = 0.0;
+    for (int k = 0; k < 6; ++k) {
+      squared += w.m[k][column] * w.m[k][column];
+    }
+    norms[column] = std::sqrt(squared);
+  }
+  int order[6] = { 0, 1, 2, 3, 4, 5 };
+  std::sort(order, order + 6, [&norms](int i, int j) { return norms[i] > norms[j]; });
+
+  const double tolerance = 1e-12 * norms[order[0]];
+  Mat6 u = {};
+  for (int column = 0; column < 6; ++column) {
+    const int source = order[column];
+    s_ptr->v[column] = norms[source];
+    for (int k = 0; k < 6; ++k) {
+      v_ptr->m[k][column] = v.m[k][source];
+    }
+    if (norms[source] > tolerance && norms[source] > 0.0) {
+      for (int k = 0; k < 6; ++k) {
+        u.m[k][column] = w.m[k][source] / norms[source];
+      }
+      continue;
+    }
+
+    // Null column, take the unit vector with the largest component outside
+    // the columns found so far and orthonormalize it against them.
+    double best[6] = {};
+    double best_squared = -1.0;
+    for (int axis = 0; axis < 6; ++axis) {
+      double candidate[6] = {};
+      candidate[axis] = 1.0;
+      for (int previous = 0; previous < column; ++previous) {
+        const double projection = u.m[axis][previous];
+        for (int k = 0; k < 6; ++k) {
+          candidate[k] -= projection * u.m[k][previous];
+        }
+      }
+      double squared = 0.0;
+      for (const double value : candidate) {
+        squared += value * value;
+      }
+      if (squared > best_squared) {
+        best_squared = squared;
+        std::copy(candidate, candidate + 6, best);
+      }
+    }
+    const double inverse_norm = 1.0 / std::sqrt(best_squared);
+    for (int k = 0; k < 6; ++k) {
+      u.m[k][column] = inverse_norm * best[k];
+    }
+  }
+  *u_ptr = u;
+}
+
+// Unit quaternion in the (x, y, z, w) order of TUM trajectory files.
+struct Quaternion {
+  double x;
+  double y;
+  double z;
+  double w;
+};
+
+constexpr Quaternion operator*(const Quaternion& a, const Quaternion& b) {
+  return { a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+           a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+           a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+           a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z };
+}
+
+constexpr Quaternion conjugate(const Quaternion& q) { return { -q.x, -q.y, -q.z, q.w }; }
+
+// Unit norm with a non-negative w, so equal rotations compare equal.
+Quaternion normalized(const Quaternion& q) {
+  const double scale = (q.w < 0.0 ? -1.0 : 1.0) / std::sqrt(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+  return { scale * q.x, scale * q.y, scale * q.z, scale * q.w };
+}
+
+// The quaternion does not have to be normalized.
+constexpr Mat3 rotation_from_quaternion(const Quaternion& q) {
+  const double s = 2.0 / (q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+  const double xx = s * q.x * q.x, yy = s * q.y * q.y, zz = s * q.z * q.z;
+  const double xy = s * q.x * q.y, xz = s * q.x * q.z, yz = s * q.y * q.z;
+  const double wx = s * q.w * q.x, wy = s * q.w * q.y, wz = s * q.w * q.z;
+  return {{ { 1.0 - yy - zz, xy - wz, xz + wy },
+            { xy + wz, 1.0 - xx - zz, yz - wx },
+            { xz - wy, yz + wx, 1.0 - xx - yy } }};
+}
+
+// Shepperd's method, pivoting on the largest of w, x, y, z for accuracy at
+// every angle.
+Quaternion quaternion_from_rotation(const Mat3& r) {
+  const double trace = r.m[0][0] + r.m[1][1] + r.m[2][2];
+  Quaternion q;
+  if (trace >= r.m[0][0] && trace >= r.m[1][1] && trace >= r.m[2][2]) {
+    const double s = 2.0 * std::sqrt(1.0 + trace);
+    q = { (r.m[2][1] - r.m[1][2]) / s, (r.m[0][2] - r.m[2][0]) / s, (r.m[1][0] - r.m[0][1]) / s, 0.25 * s };
+  } else if (r.m[0][0] >= r.m[1][1] && r.m[0][0] >= r.m[2][2]) {
+    const double s = 2.0 * std::sqrt(1.0 + r.m[0][0] - r.m[1][1] - r.m[2][2]);
+    q = { 0.25 * s, (r.m[0][1] + r.m[1][0]) / s, (r.m[0][2] + r.m[2][0]) / s, (r.m[2][1] - r.m[1][2]) / s };
+  } else if (r.m[1][1] >= r.m[2][2]) {
+    const double s = 2.0 * std::sqrt(1.0 - r.m[0][0] + r.m[1][1] - r.m[2][2]);
+    q = { (r.m[0][1] + r.m[1][0]) / s, 0.25 * s, (r.m[1][2] + r.m[2][1]) / s, (r.m[0][2] - r.m[2][0]) / s };
+  } else {
+    const double s = 2.0 * std::sqrt(1.0 - r.m[0][0] - r.m[1][1] + r.m[2][2]);
+    q = { (r.m[0][2] + r.m[2][0]) / s, (r.m[1][2] + r.m[2][1]) / s, 0.25 * s, (r.m[1][0] - r.m[0][1]) / s };
+  }
+  return normalized(q);
+}
+
+// Rigid transform X' = rotation * X + translation.
+struct Pose {
+  Mat3 rotation;
+  Vec3 translation;
+};
+
+constexpr Pose identity_pose() { return { identity3(), {} }; }
+
+constexpr Vec3 operator*(const Pose& a, const Vec3& x) { return a.rotation * x + a.translation; }
+
+constexpr Pose operator*(const Pose& a, const Pose& b) {
+  return { a.rotation * b.rotation, a.rotation * b.translation + a.translation };
+}
+
+constexpr Pose inverse(const Pose& a) {
+  const Mat3 rotation = transpose(a.rotation);
+  return { rotation, -(rotation * a.translation) };
+}
+
+// Coefficients of the SO(3) series shared by exp_se3 and log_se3:
+// sin(theta) / theta, (1 - cos(theta)) / theta^2, (theta - sin(theta)) / theta^3.
+void get_so3_coefficients(double theta_squared, double* a_ptr, double* b_ptr, double* c_ptr) {
+  if (theta_squared < 1e-8) {
+    *a_ptr = 1.0 - theta_squared / 6.0;
+    *b_ptr = 0.5 - theta_squared / 24.0;
+    *c_ptr = 1.0 / 6.0 - theta_squared / 120.0;
+    return;
+  }
+  const double theta = std::sqrt(theta_squared);
+  const double sine = std::sin(theta);
+  *a_ptr = sine / theta;
+  *b_ptr = (1.0 - std::cos(theta)) / theta_squared;
+  *c_ptr = (theta - sine) / (theta_squared * theta);
+}
+
+// Pose of a twist (w, v): rotation exp(w) and translation V(w) * v.
+Pose exp_se3(const Vec6& twist) {
+  const Vec3 omega = get_head(twist);
+  double a;
+  double b;
+  double c;
+  get_so3_coefficients(dot(omega, omega), &a, &b, &c);
+
+  const Mat3 k = skew(omega);
+  const Mat3 k_squared = k * k;
+  const Mat3 rotation = identity3() + a * k + b * k_squared;
+  const Mat3 v = identity3() + b * k + c * k_squared;
+  return { rotation, v * get_tail(twist) };
+}
+
+// Twist of a pose, the inverse of exp_se3.
+Vec6 log_se3(const Pose& pose) {
+  const Vec3 omega = log_so3(pose.rotation);
+  const double theta_squared = dot(omega, omega);
+  double a;
+  double b;
+  double c;
+  get_so3_coefficients(theta_squared, &a, &b, &c);
+
+  // V^-1 = I - K / 2 + (1 - a / (2 b)) / theta^2 K^2.
+  const double d = theta_squared < 1e-8 ? 1.0 / 12.0 + theta_squared / 720.0 : (1.0 - 0.5 * a / b) / theta_squared;
+  const Mat3 k = skew(omega);
+  const Mat3 inverse_v = identity3() + -0.5 * k + d * (k * k);
+  return make_vec6(omega, inverse_v * pose.translation);
+}
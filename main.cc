@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <vector>
@@ -5,110 +6,244 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include "absolute_pose.h"
+#include "buffer_pool.h"
+#include "camera.h"
+#include "depth.h"
+#include "fast.h"
+#include "frame.h"
 #include "gl.h"
+#include "image.h"
+#include "keyframe_selection.h"
+#include "klt.h"
+#include "mapping.h"
+#include "matching.h"
+#include "motion_model.h"
+#include "orb.h"
+#include "pose_refinement.h"
+#include "relative_pose.h"
+#include "sequence.h"
+#include "thread_pool.h"
+#include "trajectory.h"
 #include "util.h"
+#include "vocabulary.h"
 
 // TODO(Matias):
 // - Display image feed with OpenGL
 // - Draw some points on the images
 
 
-struct Image {
-  int width;
-  int height;
-  int channels;
-  const unsigned char* data_ptr;
-};
-
-
-void convert_image_to_greyscale(Image* grey_image_ptr, const Image* rgb_image_ptr) {
-  grey_image_ptr->width = rgb_image_ptr->width;
-  grey_image_ptr->height = rgb_image_ptr->height;
-  grey_image_ptr->channels = 1;
-  const size_t gray_buffer_size = sizeof(unsigned char) * grey_image_ptr->width * grey_image_ptr->height;
-  unsigned char* gray_buffer_ptr = (unsigned char*)std::malloc(gray_buffer_size);
-  
-  for (int pixel_index = 0; pixel_index < rgb_image_ptr->width*rgb_image_ptr->height; ++pixel_index) {
-    const unsigned char r = rgb_image_ptr->data_ptr[3*pixel_index + 0];
-    const unsigned char g = rgb_image_ptr->data_ptr[3*pixel_index + 1];
-    const unsigned char b = rgb_image_ptr->data_ptr[3*pixel_index + 2];
+int main() {
+  std::string dataset_path("dataset/rgbd_dataset_freiburg3_long_office_household/");
 
-    gray_buffer_ptr[pixel_index] = std::min((0.299f*r + 0.587f*g + 0.114f*b), 255.0f);
+  Sequence sequence = {};
+  if (!load_sequence(&sequence, dataset_path)) {
+    return EXIT_FAILURE;
   }
-  
-  grey_image_ptr->data_ptr = gray_buffer_ptr;
-}
 
+  // Sequences that ship depth images run in RGB-D mode.
+  const bool rgbd_mode = has_depth(&sequence);
 
-const unsigned char* get_pixel_ptr(int u, int v, const Image* image_ptr) {
-  return image_ptr->data_ptr + v * image_ptr->width + u;
-}
+  std::string image_path = get_image_path(&sequence, 0);
+  
+  Image rgb_image = {};
+  rgb_image.data_ptr = stbi_load(image_path.data(), &rgb_image.width, &rgb_image.height, &rgb_image.channels, 3);
+  
+  std::cout << "Image: " << rgb_image.width << "x" << rgb_image.height << ":" << rgb_image.channels << '\n';
 
-// TODO(Matias): Reorder these for better cache performance
-const int fast_pixel_offsets[] = {
-//u   v
-  0, -3, // 1
-  1, -3, // 2
-  2, -2, // 3
-  3, -1, // 4
-  3,  0, // 5
-  3,  1, // 6
-  2,  2, // 7
-  1,  3, // 8
-  0,  3, // 9
- -1,  3, // 10
- -2,  2, // 11
- -3,  1, // 12
- -3,  0, // 13
- -3, -1, // 14
- -2, -2, // 15
- -1, -3, // 16
-};
-constexpr int number_of_fast_points = 16;
-
-void detect_fast_points(const Image* grey_image_ptr) {
-
-  const auto width = grey_image_ptr->width;
-  const auto height = grey_image_ptr->height;
-
-  constexpr int fast_half_size = 3;
+  Image grey_image = {};
+  
+  convert_image_to_greyscale(&grey_image, &rgb_image);
   
-  for (int v = fast_half_size; v < height - fast_half_size; ++v) {
-    for (int u = fast_half_size; u < width - fast_half_size; ++u) {
+  Camera camera = {};
+  if (!load_camera(&camera, "config/freiburg3.txt")) {
+    return EXIT_FAILURE;
+  }
 
-      for (int fast_pixel_index = 0; fast_pixel_index < number_of_fast_points; ++fast_pixel_index) {
-        const int u_offset = fast_pixel_offsets[2*fast_pixel_index + 0];
-        const int v_offset = fast_pixel_offsets[2*fast_pixel_index + 1];
+  UndistortionMap undistortion_map = {};
+  build_undistortion_map(&undistortion_map, &camera);
+
+  static OrbPattern orb_pattern;
+  init_orb_pattern(&orb_pattern);
+
+  BufferPool buffer_pool = {};
+  ThreadPool thread_pool = {};
+  init_thread_pool(&thread_pool);
+
+  MappingParameters mapping_parameters = {};
+  mapping_parameters.triangulation.threshold = 2.0f / camera.fx;
+  mapping_parameters.bundle_adjustment.huber_threshold = 1.0 / camera.fx;
+  mapping_parameters.loop_pose.threshold = 2.0f / camera.fx;
+  // Loop detection is optional, see the README for training a vocabulary.
+  Vocabulary vocabulary = {};
+  const bool has_vocabulary = load_vocabulary(&vocabulary, "config/vocabulary.bin");
+  if (has_vocabulary) {
+    std::cout << "Vocabulary: " << vocabulary.word_count << " words\n";
+  } else {
+    std::cout << "Loop detection disabled\n";
+  }
+  Mapper mapper;
+  start_mapper(&mapper, mapping_parameters, has_vocabulary ? &vocabulary : nullptr);
+  const MapSnapshot* map_snapshot_ptr = nullptr;
+  KltParameters klt_parameters = {};
+
+  Frame frame = {};
+  init_frame(&frame, &grey_image, klt_parameters.level_count);
+  extract_frame_features(&frame, &orb_pattern, &buffer_pool);
+  compute_frame_bearings(&frame, &undistortion_map);
+
+  if (rgbd_mode) {
+    const std::string depth_path = get_depth_path(&sequence, 0);
+    // Only keypoint depths are needed, so skip the dense conversion.
+    DepthImage depth_image = {};
+    if (!depth_path.empty() && load_depth_image(&depth_image, depth_path, camera.depth_scale, DepthMode::sparse, &buffer_pool)) {
+      compute_frame_depths(&frame, &depth_image);
+      release_depth_image(&depth_image, &buffer_pool);
+    }
+  }
 
-        const unsigned char* pixel_ptr = get_pixel_ptr(u + u_offset, v + v_offset, grey_image_ptr);
+  std::cout << "Keypoints: " << get_keypoint_count(&frame.keypoints) << '\n';
+
+  std::string next_image_path = get_image_path(&sequence, 1);
+
+  Image next_rgb_image = {};
+  next_rgb_image.data_ptr = stbi_load(next_image_path.data(), &next_rgb_image.width, &next_rgb_image.height, &next_rgb_image.channels, 3);
+
+  Image next_grey_image = {};
+  convert_image_to_greyscale(&next_grey_image, &next_rgb_image);
+
+  Frame next_frame = {};
+  init_frame(&next_frame, &next_grey_image, klt_parameters.level_count);
+  extract_frame_features(&next_frame, &orb_pattern, &buffer_pool);
+  compute_frame_bearings(&next_frame, &undistortion_map);
+
+  // The first frame is the world frame. The motion model only has that pose,
+  // so it predicts a static camera and the search window stays wide.
+  MotionModel motion_model = {};
+  update_motion_model(&motion_model, identity3(), Vec3{}, sequence.image_timestamps[0]);
+  Mat3 predicted_rotation;
+  Vec3 predicted_translation;
+  predict_pose(&predicted_rotation, &predicted_translation, &motion_model, sequence.image_timestamps[1]);
+
+  // Without a pose prediction the previous location is the best guess for
+  // where each keypoint lands.
+  KeypointGrid next_grid = {};
+  build_keypoint_grid(&next_grid, &next_frame.keypoints, next_frame.grey_image.width, next_frame.grey_image.height);
+
+  std::vector<Match> matches;
+  match_descriptors_in_windows(&matches, &frame.descriptors, frame.keypoints.u.data(), frame.keypoints.v.data(),
+                               &next_frame.keypoints, &next_frame.descriptors, &next_grid,
+                               get_search_radius(&motion_model));
+
+  std::cout << "Matches: " << matches.size() << '\n';
+
+  // PROSAC expects the most distinctive matches first.
+  std::sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) { return a.distance < b.distance; });
+
+  const int match_count = int(matches.size());
+  std::vector<float> x1(match_count), y1(match_count), x2(match_count), y2(match_count);
+  for (int match_index = 0; match_index < match_count; ++match_index) {
+    const int query_index = matches[match_index].query_index;
+    const int train_index = matches[match_index].train_index;
+    x1[match_index] = frame.bearing_x[query_index] / frame.bearing_z[query_index];
+    y1[match_index] = frame.bearing_y[query_index] / frame.bearing_z[query_index];
+    x2[match_index] = next_frame.bearing_x[train_index] / next_frame.bearing_z[train_index];
+    y2[match_index] = next_frame.bearing_y[train_index] / next_frame.bearing_z[train_index];
+  }
 
-        unsigned char* pixel_write_ptr = const_cast<unsigned char*>(pixel_ptr);
+  RelativePoseParameters relative_pose_parameters = {};
+  relative_pose_parameters.threshold = 1.0f / camera.fx;
+  relative_pose_parameters.use_prior = true;
+  relative_pose_parameters.prior_rotation = predicted_rotation;
+  relative_pose_parameters.prior_translation = predicted_translation;
+
+  RelativePose relative_pose = {};
+  if (estimate_relative_pose(&relative_pose, x1.data(), y1.data(), x2.data(), y2.data(), match_count,
+                             relative_pose_parameters, &thread_pool)) {
+    std::cout << "Relative pose inliers: " << relative_pose.inlier_count << "/" << match_count
+              << " after " << relative_pose.iteration_count << " iterations, t = ("
+              << relative_pose.translation.x << ", " << relative_pose.translation.y << ", " << relative_pose.translation.z << ")\n";
+  }
 
-        *pixel_write_ptr = 0;
+  // With depth the first frame's keypoints are known in 3D, which fixes the
+  // scale and turns the problem into PnP.
+  AbsolutePose absolute_pose = {};
+  bool has_absolute_pose = false;
+  if (!frame.depths.empty()) {
+    std::vector<float> point_x, point_y, point_z, image_x, image_y;
+    for (int match_index = 0; match_index < match_count; ++match_index) {
+      const float depth = frame.depths[matches[match_index].query_index];
+      if (depth <= 0.0f) {
+        continue;
       }
+      point_x.push_back(depth * x1[match_index]);
+      point_y.push_back(depth * y1[match_index]);
+      point_z.push_back(depth);
+      image_x.push_back(x2[match_index]);
+      image_y.push_back(y2[match_index]);
+    }
 
-      return;
+    AbsolutePoseParameters absolute_pose_parameters = {};
+    absolute_pose_parameters.threshold = 2.0f / camera.fx;
+    absolute_pose_parameters.use_prior = true;
+    absolute_pose_parameters.prior_rotation = predicted_rotation;
+    absolute_pose_parameters.prior_translation = predicted_translation;
+
+    if (estimate_absolute_pose(&absolute_pose, point_x.data(), point_y.data(), point_z.data(), image_x.data(), image_y.data(),
+                               int(point_x.size()), absolute_pose_parameters)) {
+      PoseRefinementParameters refinement_parameters = {};
+      refinement_parameters.huber_threshold = 1.0f / camera.fx;
+      refinement_parameters.inlier_threshold = absolute_pose_parameters.threshold;
+      refine_absolute_pose(&absolute_pose, point_x.data(), point_y.data(), point_z.data(), image_x.data(), image_y.data(),
+                           int(point_x.size()), refinement_parameters);
+      std::cout << "PnP inliers: " << absolute_pose.inlier_count << "/" << point_x.size()
+                << ", t = (" << absolute_pose.translation.x << ", " << absolute_pose.translation.y << ", "
+                << absolute_pose.translation.z << ") m\n";
+      update_motion_model(&motion_model, absolute_pose.rotation, absolute_pose.translation, sequence.image_timestamps[1]);
+      has_absolute_pose = true;
     }
   }
-}
 
-int main() {
-  std::string dataset_path("dataset/rgbd_dataset_freiburg3_long_office_household/");
+  // The first frame anchors the map. With a PnP pose the map is metric,
+  // otherwise points are up to the unknown scale of t.
+  // Triangulation and bundle adjustment run on the mapping thread. The
+  // initial pair is always inserted, the selection policy in
+  // keyframe_selection.h is for the frames tracked after it.
+  if (has_absolute_pose || relative_pose.inlier_count > 0) {
+    MapKeyframe* first_keyframe_ptr = new MapKeyframe{};
+    init_map_keyframe(first_keyframe_ptr, &frame, 0, identity3(), Vec3{});
+    MapKeyframe* second_keyframe_ptr = new MapKeyframe{};
+    if (has_absolute_pose) {
+      init_map_keyframe(second_keyframe_ptr, &next_frame, 1, absolute_pose.rotation, absolute_pose.translation);
+    } else {
+      init_map_keyframe(second_keyframe_ptr, &next_frame, 1, relative_pose.rotation, relative_pose.translation);
+    }
+    // The tracker keeps keyframes the mapper did not take.
+    for (MapKeyframe* keyframe_ptr : { first_keyframe_ptr, second_keyframe_ptr }) {
+      if (!submit_keyframe(&mapper, keyframe_ptr)) {
+        free_map_keyframe(keyframe_ptr);
+        delete keyframe_ptr;
+      }
+    }
+  }
 
-  std::vector<std::string> image_paths =  get_image_paths(dataset_path);
-  
-  std::string image_path = dataset_path + image_paths.at(0);
-  
-  Image rgb_image = {};
-  rgb_image.data_ptr = stbi_load(image_path.data(), &rgb_image.width, &rgb_image.height, &rgb_image.channels, 3);
-  
-  std::cout << "Image: " << rgb_image.width << "x" << rgb_image.height << ":" << rgb_image.channels << '\n';
+  // Monocular poses are up to scale, the model extrapolates in map units.
+  if (motion_model.pose_count == 1 && relative_pose.inlier_count > 0) {
+    update_motion_model(&motion_model, relative_pose.rotation, relative_pose.translation, sequence.image_timestamps[1]);
+  }
 
-  Image grey_image = {};
-  
-  convert_image_to_greyscale(&grey_image, &rgb_image);
-  
-  detect_fast_points(&grey_image);
+  const int keypoint_count = get_keypoint_count(&frame.keypoints);
+  std::vector<float> tracked_u(keypoint_count);
+  std::vector<float> tracked_v(keypoint_count);
+  std::vector<unsigned char> tracked_status(keypoint_count);
+  track_klt(tracked_u.data(), tracked_v.data(), tracked_status.data(), &frame.keypoints,
+            &frame.pyramid, get_frame_gradients(&frame, &buffer_pool), &next_frame.pyramid, klt_parameters);
+
+  int tracked_count = 0;
+  for (const unsigned char status : tracked_status) {
+    tracked_count += status;
+  }
+  std::cout << "KLT tracked: " << tracked_count << '\n';
 
   glfwSetErrorCallback(glfw_error_callback);
 
@@ -126,8 +261,13 @@ int main() {
   }
   
   glfwMakeContextCurrent(window_ptr);
+#ifdef GLAD_DEBUG
   glad_set_post_callback(glad_gl_post_callback);
+#endif
   gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress));
+
+  ShaderProgramCache shader_cache = {};
+  init_shader_program_cache(&shader_cache, "shader_cache", reinterpret_cast<GLADloadproc>(glfwGetProcAddress));
   
   glfwSetFramebufferSizeCallback(window_ptr, glfw_frambuffer_resize_callback);
   glfwSetKeyCallback(window_ptr, glfw_key_callback);
@@ -199,13 +339,13 @@ int main() {
   
   )GLSL";
   
-  const unsigned int image_shader_program = compile_shader_program(image_vs, image_fs);
+  const unsigned int image_shader_program = load_shader_program(&shader_cache, image_vs, image_fs);
 
   unsigned int image_texture = 0;
   glGenTextures(1, &image_texture);
   glBindTexture(GL_TEXTURE_2D, image_texture);
 
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, rgb_image.width, rgb_image.height, 0, GL_RED, GL_UNSIGNED_BYTE, grey_image.data_ptr);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, rgb_image.width, rgb_image.height, 0, GL_RED, GL_UNSIGNED_BYTE, frame.grey_image.data_ptr);
 
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -216,6 +356,14 @@ int main() {
   glUniform1i(uniform_loc, 0);
 
   while (!glfwWindowShouldClose(window_ptr)) {
+    const MapSnapshot* previous_snapshot_ptr = map_snapshot_ptr;
+    map_snapshot_ptr = update_map_snapshot(&mapper, map_snapshot_ptr);
+    if (map_snapshot_ptr != previous_snapshot_ptr) {
+      std::cout << "Map version " << map_snapshot_ptr->version << ": " << map_snapshot_ptr->keyframe_rotations.size()
+                << " keyframes, " << map_snapshot_ptr->map_points.live_count << " points, "
+                << map_snapshot_ptr->loop_candidate_count << " loop candidates, "
+                << map_snapshot_ptr->loop_closure_count << " loops closed\n";
+    }
 
     glClearColor(0.2f, 0.3, 0.4, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -230,4 +378,22 @@ int main() {
     glfwSwapBuffers(window_ptr);
     glfwPollEvents();
   }
+
+  // Keyframe trajectory of the final map for evaluate_trajectory.
+  map_snapshot_ptr = update_map_snapshot(&mapper, map_snapshot_ptr);
+  if (map_snapshot_ptr != nullptr) {
+    Trajectory trajectory = {};
+    for (size_t keyframe_index = 0; keyframe_index < map_snapshot_ptr->keyframe_frame_indices.size(); ++keyframe_index) {
+      add_trajectory_pose(&trajectory, sequence.image_timestamps[map_snapshot_ptr->keyframe_frame_indices[keyframe_index]],
+                          map_snapshot_ptr->keyframe_rotations[keyframe_index],
+                          map_snapshot_ptr->keyframe_translations[keyframe_index]);
+    }
+    write_trajectory(&trajectory, "trajectory.txt");
+  }
+
+  stop_mapper(&mapper, map_snapshot_ptr);
+  if (has_vocabulary) {
+    free_vocabulary(&vocabulary);
+  }
+  free_thread_pool(&thread_pool);
 }
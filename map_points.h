@@ -0,0 +1,332 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "camera.h"
+#include "linalg.h"
+#include "orb.h"
+
+// Stable reference to a map point. Slots are reused after removal, the
+// generation tells a stale handle from the point that took over its slot.
+struct MapPointHandle {
+  uint32_t index;
+  uint32_t generation;
+};
+
+constexpr MapPointHandle invalid_map_point_handle = { UINT32_MAX, 0 };
+
+// Map points in struct-of-arrays layout, one slot per point. Removed slots
+// stay in place with alive = 0 until a new point reuses them, so the arrays
+// can be streamed front to back without indirection.
+struct MapPoints {
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+  Descriptors descriptors;
+  std::vector<int> observation_counts;
+  std::vector<uint32_t> generations;
+  std::vector<unsigned char> alive;
+  std::vector<uint32_t> free_slots;
+  int live_count;
+};
+
+int get_map_point_slot_count(const MapPoints* map_points_ptr) {
+  return int(map_points_ptr->x.size());
+}
+
+// Slot of a live point, or -1 when the handle is stale.
+int get_map_point_index(const MapPoints* map_points_ptr, MapPointHandle handle) {
+  if (handle.index >= uint32_t(get_map_point_slot_count(map_points_ptr)) ||
+      !map_points_ptr->alive[handle.index] ||
+      map_points_ptr->generations[handle.index] != handle.generation) {
+    return -1;
+  }
+  return int(handle.index);
+}
+
+MapPointHandle add_map_point(MapPoints* map_points_ptr, const Vec3& position, const unsigned char* descriptor_ptr) {
+  uint32_t index;
+  if (!map_points_ptr->free_slots.empty()) {
+    index = map_points_ptr->free_slots.back();
+    map_points_ptr->free_slots.pop_back();
+  } else {
+    index = uint32_t(get_map_point_slot_count(map_points_ptr));
+    map_points_ptr->x.push_back(0.0f);
+    map_points_ptr->y.push_back(0.0f);
+    map_points_ptr->z.push_back(0.0f);
+    map_points_ptr->observation_counts.push_back(0);
+    map_points_ptr->generations.push_back(0);
+    map_points_ptr->alive.push_back(0);
+
+    Descriptors* descriptors_ptr = &map_points_ptr->descriptors;
+    if (descriptors_ptr->count == descriptors_ptr->capacity) {
+      reserve_descriptors(descriptors_ptr, std::max(256, 2 * descriptors_ptr->capacity));
+    }
+    ++descriptors_ptr->count;
+  }
+
+  map_points_ptr->x[index] = float(position.x);
+  map_points_ptr->y[index] = float(position.y);
+  map_points_ptr->z[index] = float(position.z);
+  map_points_ptr->observation_counts[index] = 2;
+  map_points_ptr->alive[index] = 1;
+  std::memcpy(map_points_ptr->descriptors.data_ptr + descriptor_size * index, descriptor_ptr, descriptor_size);
+  ++map_points_ptr->live_count;
+
+  return { index, map_points_ptr->generations[index] };
+}
+
+bool remove_map_point(MapPoints* map_points_ptr, MapPointHandle handle) {
+  const int index = get_map_point_index(map_points_ptr, handle);
+  if (index < 0) {
+    return false;
+  }
+  map_points_ptr->alive[index] = 0;
+  ++map_points_ptr->generations[index];
+  map_points_ptr->free_slots.push_back(uint32_t(index));
+  --map_points_ptr->live_count;
+  return true;
+}
+
+void free_map_points(MapPoints* map_points_ptr) {
+  free_descriptors(&map_points_ptr->descriptors);
+  *map_points_ptr = {};
+}
+
+// Deep copy that reuses the storage already held by the destination.
+void copy_map_points(MapPoints* destination_ptr, const MapPoints* source_ptr) {
+  destination_ptr->x = source_ptr->x;
+  destination_ptr->y = source_ptr->y;
+  destination_ptr->z = source_ptr->z;
+  destination_ptr->observation_counts = source_ptr->observation_counts;
+  destination_ptr->generations = source_ptr->generations;
+  destination_ptr->alive = source_ptr->alive;
+  destination_ptr->free_slots = source_ptr->free_slots;
+  destination_ptr->live_count = source_ptr->live_count;
+
+  const int count = source_ptr->descriptors.count;
+  reserve_descriptors(&destination_ptr->descriptors, count);
+  if (count > 0) {
+    std::memcpy(destination_ptr->descriptors.data_ptr, source_ptr->descriptors.data_ptr, descriptor_size * count);
+  }
+  destination_ptr->descriptors.count = count;
+}
+
+struct TriangulationParameters {
+  // Largest reprojection error in normalized image coordinates.
+  float threshold = 0.004f;
+  // Rays closer than this are too ill-conditioned to give a usable depth.
+  float min_parallax_degrees = 1.0f;
+};
+
+// Linear (DLT) triangulation from two views with world-to-camera poses. Each
+// observation contributes two rows of A * X = b, solved in the least squares
+// sense. Returns false for (near) parallel rays.
+bool triangulate_point(Vec3* point_ptr,
+                       const Mat3& rotation1, const Vec3& translation1, double x1, double y1,
+                       const Mat3& rotation2, const Vec3& translation2, double x2, double y2) {
+  Mat3 normal = {};
+  Vec3 right = {};
+  auto add_row = [&](const Vec3& a, double b) {
+    for (int row = 0; row < 3; ++row) {
+      const double a_row = row == 0 ? a.x : row == 1 ? a.y : a.z;
+      normal.m[row][0] += a_row * a.x;
+      normal.m[row][1] += a_row * a.y;
+      normal.m[row][2] += a_row * a.z;
+    }
+    right = right + b * a;
+  };
+
+  const Mat3* rotations[2] = { &rotation1, &rotation2 };
+  const Vec3* translations[2] = { &translation1, &translation2 };
+  const double xs[2] = { x1, x2 };
+  const double ys[2] = { y1, y2 };
+  for (int view = 0; view < 2; ++view) {
+    const Mat3& r = *rotations[view];
+    const Vec3& t = *translations[view];
+    const Vec3 r0 = { r.m[0][0], r.m[0][1], r.m[0][2] };
+    const Vec3 r1 = { r.m[1][0], r.m[1][1], r.m[1][2] };
+    const Vec3 r2 = { r.m[2][0], r.m[2][1], r.m[2][2] };
+    add_row(r0 - xs[view] * r2, xs[view] * t.z - t.x);
+    add_row(r1 - ys[view] * r2, ys[view] * t.z - t.y);
+  }
+
+  const double scale = normal.m[0][0] + normal.m[1][1] + normal.m[2][2];
+  if (std::fabs(determinant(normal)) <= 1e-12 * scale * scale * scale) {
+    return false;
+  }
+  *point_ptr = inverse(normal) * right;
+  return true;
+}
+
+// Triangulates the inlier matches between two posed views and stores the
+// points that are in front of both cameras, have enough parallax and
+// reproject within the threshold. handles_ptr gets a handle per match, or
+// invalid_map_point_handle. Returns the number of new points.
+int triangulate_matches(MapPointHandle* handles_ptr,
+                        MapPoints* map_points_ptr,
+                        const Mat3& rotation1, const Vec3& translation1,
+                        const Mat3& rotation2, const Vec3& translation2,
+                        const float* x1_ptr, const float* y1_ptr,
+                        const float* x2_ptr, const float* y2_ptr,
+                        const unsigned char* inlier_mask_ptr,
+                        const Descriptors* descriptors_ptr,
+                        const int* descriptor_indices_ptr,
+                        int count,
+                        const TriangulationParameters& parameters = {}) {
+  const double max_parallax_cosine = std::cos(parameters.min_parallax_degrees * pi / 180.0);
+  const double threshold_squared = double(parameters.threshold) * parameters.threshold;
+  const Vec3 center1 = -(transpose(rotation1) * translation1);
+  const Vec3 center2 = -(transpose(rotation2) * translation2);
+
+  int added_count = 0;
+  for (int index = 0; index < count; ++index) {
+    handles_ptr[index] = invalid_map_point_handle;
+    if (!inlier_mask_ptr[index]) {
+      continue;
+    }
+
+    Vec3 point;
+    if (!triangulate_point(&point, rotation1, translation1, x1_ptr[index], y1_ptr[index],
+                           rotation2, translation2, x2_ptr[index], y2_ptr[index])) {
+      continue;
+    }
+
+    const Vec3 ray1 = point - center1;
+    const Vec3 ray2 = point - center2;
+    if (dot(ray1, ray2) > max_parallax_cosine * norm(ray1) * norm(ray2)) {
+      continue;
+    }
+
+    const Vec3 camera_point1 = rotation1 * point + translation1;
+    const Vec3 camera_point2 = rotation2 * point + translation2;
+    if (camera_point1.z <= 0.0 || camera_point2.z <= 0.0) {
+      continue;
+    }
+
+    const double dx1 = camera_point1.x / camera_point1.z - x1_ptr[index];
+    const double dy1 = camera_point1.y / camera_point1.z - y1_ptr[index];
+    const double dx2 = camera_point2.x / camera_point2.z - x2_ptr[index];
+    const double dy2 = camera_point2.y / camera_point2.z - y2_ptr[index];
+    if (dx1 * dx1 + dy1 * dy1 > threshold_squared || dx2 * dx2 + dy2 * dy2 > threshold_squared) {
+      continue;
+    }
+
+    handles_ptr[index] = add_map_point(map_points_ptr, point,
+                                       get_descriptor_ptr(descriptor_indices_ptr[index], descriptors_ptr));
+    ++added_count;
+  }
+  return added_count;
+}
+
+// Projects every slot into a camera with a world-to-camera pose. Slots that
+// are dead, behind the camera or outside the image get u = v = -1, which the
+// windowed matcher skips.
+void project_map_points(float* u_ptr,
+                        float* v_ptr,
+                        const MapPoints* map_points_ptr,
+                        const Mat3& rotation,
+                        const Vec3& translation,
+                        const Camera* camera_ptr) {
+  const int count = get_map_point_slot_count(map_points_ptr);
+  const float* x_ptr = map_points_ptr->x.data();
+  const float* y_ptr = map_points_ptr->y.data();
+  const float* z_ptr = map_points_ptr->z.data();
+  const unsigned char* alive_ptr = map_points_ptr->alive.data();
+
+  float r[9];
+  for (int k = 0; k < 9; ++k) {
+    r[k] = float(rotation.m[k / 3][k % 3]);
+  }
+  const float t[3] = { float(translation.x), float(translation.y), float(translation.z) };
+  constexpr float min_depth = 0.01f;
+
+  int index = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  const __m256 r00 = _mm256_set1_ps(r[0]), r01 = _mm256_set1_ps(r[1]), r02 = _mm256_set1_ps(r[2]);
+  const __m256 r10 = _mm256_set1_ps(r[3]), r11 = _mm256_set1_ps(r[4]), r12 = _mm256_set1_ps(r[5]);
+  const __m256 r20 = _mm256_set1_ps(r[6]), r21 = _mm256_set1_ps(r[7]), r22 = _mm256_set1_ps(r[8]);
+  const __m256 t0 = _mm256_set1_ps(t[0]), t1 = _mm256_set1_ps(t[1]), t2 = _mm256_set1_ps(t[2]);
+  const __m256 fx = _mm256_set1_ps(camera_ptr->fx), fy = _mm256_set1_ps(camera_ptr->fy);
+  const __m256 cx = _mm256_set1_ps(camera_ptr->cx), cy = _mm256_set1_ps(camera_ptr->cy);
+  const __m256 k1 = _mm256_set1_ps(camera_ptr->k1), k2 = _mm256_set1_ps(camera_ptr->k2);
+  const __m256 k3 = _mm256_set1_ps(camera_ptr->k3);
+  const __m256 p1 = _mm256_set1_ps(camera_ptr->p1), p2 = _mm256_set1_ps(camera_ptr->p2);
+  const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f);
+  const __m256 width = _mm256_set1_ps(float(camera_ptr->width));
+  const __m256 height = _mm256_set1_ps(float(camera_ptr->height));
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 depth_limit = _mm256_set1_ps(min_depth);
+  const __m256 invisible = _mm256_set1_ps(-1.0f);
+
+  for (; index + 8 <= count; index += 8) {
+    const __m256 px = _mm256_loadu_ps(x_ptr + index);
+    const __m256 py = _mm256_loadu_ps(y_ptr + index);
+    const __m256 pz = _mm256_loadu_ps(z_ptr + index);
+    const __m256i alive = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(alive_ptr + index)));
+
+    const __m256 camera_x = _mm256_fmadd_ps(r00, px, _mm256_fmadd_ps(r01, py, _mm256_fmadd_ps(r02, pz, t0)));
+    const __m256 camera_y = _mm256_fmadd_ps(r10, px, _mm256_fmadd_ps(r11, py, _mm256_fmadd_ps(r12, pz, t1)));
+    const __m256 camera_z = _mm256_fmadd_ps(r20, px, _mm256_fmadd_ps(r21, py, _mm256_fmadd_ps(r22, pz, t2)));
+
+    const __m256 inverse_z = _mm256_div_ps(one, camera_z);
+    const __m256 x = _mm256_mul_ps(camera_x, inverse_z);
+    const __m256 y = _mm256_mul_ps(camera_y, inverse_z);
+
+    const __m256 xx = _mm256_mul_ps(x, x);
+    const __m256 yy = _mm256_mul_ps(y, y);
+    const __m256 xy = _mm256_mul_ps(x, y);
+    const __m256 r2 = _mm256_add_ps(xx, yy);
+    const __m256 radial = _mm256_fmadd_ps(r2, _mm256_fmadd_ps(r2, _mm256_fmadd_ps(r2, k3, k2), k1), one);
+    const __m256 distorted_x = _mm256_fmadd_ps(x, radial, _mm256_fmadd_ps(_mm256_mul_ps(two, p1), xy,
+                                               _mm256_mul_ps(p2, _mm256_fmadd_ps(two, xx, r2))));
+    const __m256 distorted_y = _mm256_fmadd_ps(y, radial, _mm256_fmadd_ps(_mm256_mul_ps(two, p2), xy,
+                                               _mm256_mul_ps(p1, _mm256_fmadd_ps(two, yy, r2))));
+    const __m256 u = _mm256_fmadd_ps(fx, distorted_x, cx);
+    const __m256 v = _mm256_fmadd_ps(fy, distorted_y, cy);
+
+    __m256 visible = _mm256_castsi256_ps(_mm256_cmpgt_epi32(alive, _mm256_setzero_si256()));
+    visible = _mm256_and_ps(visible, _mm256_cmp_ps(camera_z, depth_limit, _CMP_GT_OQ));
+    visible = _mm256_and_ps(visible, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    visible = _mm256_and_ps(visible, _mm256_cmp_ps(u, width, _CMP_LT_OQ));
+    visible = _mm256_and_ps(visible, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    visible = _mm256_and_ps(visible, _mm256_cmp_ps(v, height, _CMP_LT_OQ));
+
+    _mm256_storeu_ps(u_ptr + index, _mm256_blendv_ps(invisible, u, visible));
+    _mm256_storeu_ps(v_ptr + index, _mm256_blendv_ps(invisible, v, visible));
+  }
+#endif
+
+  for (; index < count; ++index) {
+    u_ptr[index] = -1.0f;
+    v_ptr[index] = -1.0f;
+    if (!alive_ptr[index]) {
+      continue;
+    }
+    const float px = x_ptr[index];
+    const float py = y_ptr[index];
+    const float pz = z_ptr[index];
+    const float camera_x = r[0] * px + r[1] * py + r[2] * pz + t[0];
+    const float camera_y = r[3] * px + r[4] * py + r[5] * pz + t[1];
+    const float camera_z = r[6] * px + r[7] * py + r[8] * pz + t[2];
+    if (camera_z <= min_depth) {
+      continue;
+    }
+    float u = -1.0f;
+    float v = -1.0f;
+    project_point(camera_ptr, camera_x, camera_y, camera_z, &u, &v);
+    if (u >= 0.0f && u < camera_ptr->width && v >= 0.0f && v < camera_ptr->height) {
+      u_ptr[index] = u;
+      v_ptr[index] = v;
+    }
+  }
+}
@@ -0,0 +1,767 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "absolute_pose.h"
+#include "bundle_adjustment.h"
+#include "fast.h"
+#include "frame.h"
+#include "keyframe_database.h"
+#include "linalg.h"
+#include "map_points.h"
+#include "matching.h"
+#include "orb.h"
+#include "pose_graph.h"
+#include "pose_refinement.h"
+#include "spsc_queue.h"
+#include "vocabulary.h"
+
+// Everything the mapping thread needs from a tracked frame. Owned by the
+// tracker until submit_keyframe succeeds, by the mapper after.
+struct MapKeyframe {
+  // Index of the image in the sequence.
+  int frame_index;
+  int width;
+  int height;
+  // World to camera.
+  Mat3 rotation;
+  Vec3 translation;
+  // Version of the snapshot the pose was tracked against. Loop corrections
+  // published after it are applied when the keyframe reaches the mapper,
+  // 0 skips them.
+  uint64_t map_version;
+  Keypoints keypoints;
+  Descriptors descriptors;
+  // Keypoints on the normalized image plane.
+  std::vector<float> x;
+  std::vector<float> y;
+  // Map point observed by every keypoint, filled in by the mapper.
+  std::vector<MapPointHandle> point_handles;
+  // Word of every keypoint and the bag of words, filled in by the mapper
+  // when it has a vocabulary.
+  std::vector<int> words;
+  BowVector bow_vector;
+};
+
+void init_map_keyframe(MapKeyframe* keyframe_ptr,
+                       const Frame* frame_ptr,
+                       int frame_index,
+                       const Mat3& rotation,
+                       const Vec3& translation) {
+  const int keypoint_count = get_keypoint_count(&frame_ptr->keypoints);
+  keyframe_ptr->frame_index = frame_index;
+  keyframe_ptr->width = frame_ptr->grey_image.width;
+  keyframe_ptr->height = frame_ptr->grey_image.height;
+  keyframe_ptr->rotation = rotation;
+  keyframe_ptr->translation = translation;
+  keyframe_ptr->map_version = 0;
+  keyframe_ptr->keypoints = frame_ptr->keypoints;
+
+  keyframe_ptr->descriptors = {};
+  reserve_descriptors(&keyframe_ptr->descriptors, keypoint_count);
+  std::memcpy(keyframe_ptr->descriptors.data_ptr, frame_ptr->descriptors.data_ptr, descriptor_size * keypoint_count);
+  keyframe_ptr->descriptors.count = keypoint_count;
+
+  keyframe_ptr->x.resize(keypoint_count);
+  keyframe_ptr->y.resize(keypoint_count);
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    keyframe_ptr->x[keypoint_index] = frame_ptr->bearing_x[keypoint_index] / frame_ptr->bearing_z[keypoint_index];
+    keyframe_ptr->y[keypoint_index] = frame_ptr->bearing_y[keypoint_index] / frame_ptr->bearing_z[keypoint_index];
+  }
+  keyframe_ptr->point_handles.assign(keypoint_count, invalid_map_point_handle);
+}
+
+void free_map_keyframe(MapKeyframe* keyframe_ptr) {
+  free_descriptors(&keyframe_ptr->descriptors);
+}
+
+// Immutable view of the map handed to the tracker. A snapshot is never
+// written while the tracker holds it.
+struct MapSnapshot {
+  uint64_t version;
+  int loop_candidate_count;
+  int loop_closure_count;
+  MapPoints map_points;
+  std::vector<int> keyframe_frame_indices;
+  std::vector<Mat3> keyframe_rotations;
+  std::vector<Vec3> keyframe_translations;
+  // Appearance of every keyframe for relocalization, only filled in when
+  // the mapper has a vocabulary. Keyframe k observes the map point slots
+  // keyframe_point_slots[keyframe_point_offsets[k] .. keyframe_point_offsets[k + 1]).
+  std::vector<BowVector> keyframe_bow_vectors;
+  std::vector<int> keyframe_point_offsets;
+  std::vector<int> keyframe_point_slots;
+};
+
+struct MappingParameters {
+  // Keyframes refined by local bundle adjustment, the oldest two are fixed.
+  int window_size = 10;
+  // Pixels around a keypoint searched for its match in the next keyframe.
+  float search_radius = 48.0f;
+  // Hard cap on the map size, the oldest keyframes are dropped beyond it.
+  int max_keyframes = 200;
+  // A keyframe is redundant when this fraction of its points is seen by at
+  // least redundant_observer_count other keyframes.
+  float redundant_point_ratio = 0.9f;
+  int redundant_observer_count = 3;
+  // New points have to be seen by min_point_observations keyframes within
+  // point_probation keyframes of their creation or they are culled.
+  int point_probation = 3;
+  int min_point_observations = 3;
+  // Loop candidates are keyframes at least loop_min_frame_gap frames older
+  // than the new one that look more like it than loop_relative_score times
+  // its similarity to the previous keyframe, and at least loop_min_score.
+  int loop_min_frame_gap = 100;
+  float loop_min_score = 0.05f;
+  float loop_relative_score = 0.75f;
+  int loop_max_candidates = 3;
+  // A candidate is verified by PnP of the new keyframe against the map
+  // points of the candidate and needs this many inliers to close the loop.
+  int loop_min_inliers = 30;
+  AbsolutePoseParameters loop_pose;
+  PoseGraphParameters pose_graph;
+  TriangulationParameters triangulation;
+  BundleAdjustmentParameters bundle_adjustment;
+};
+
+// A keyframe that looks like an older part of the map.
+struct LoopCandidate {
+  int frame_index;
+  int match_frame_index;
+  float score;
+};
+
+// Verified loop, measurement is T_frame * T_match^-1 as seen through the
+// map points of the matched keyframe.
+struct LoopEdge {
+  int frame_index;
+  int match_frame_index;
+  Pose measurement;
+};
+
+// Correction of the newest keyframes by a closed loop, old world to new,
+// and the version of the first snapshot that has it.
+struct MapCorrection {
+  uint64_t version;
+  Pose correction;
+};
+
+constexpr int mapping_queue_capacity = 8;
+
+// Background mapper. Keyframes flow in through an SPSC queue, snapshots flow
+// out through an atomic pointer swap, and snapshots the tracker is done with
+// come back through a second queue to be recycled. The tracker never takes
+// a lock and never frees map memory.
+struct Mapper {
+  MappingParameters parameters;
+  SpscQueue<MapKeyframe*> keyframe_queue;
+  SpscQueue<MapSnapshot*> retired_snapshots;
+  // Newest published snapshot the tracker has not picked up yet.
+  std::atomic<MapSnapshot*> latest_snapshot;
+  std::atomic<bool> stopping;
+  std::thread thread;
+
+  // Owned by the mapping thread.
+  std::vector<MapKeyframe*> keyframes;
+  MapPoints map_points;
+  // Keyframe sequence number at which every slot was created.
+  std::vector<int> point_created_keyframes;
+  int keyframe_counter;
+  std::vector<MapSnapshot*> free_snapshots;
+  uint64_t version;
+  // Place recognition, disabled without a vocabulary.
+  const Vocabulary* vocabulary_ptr;
+  KeyframeDatabase keyframe_database;
+  std::vector<LoopCandidate> loop_candidates;
+  std::vector<LoopEdge> loop_edges;
+  // Pose graph optimization over every keyframe runs on its own thread so
+  // mapping goes on meanwhile. The problem belongs to that thread until
+  // pose_graph_done is set. A loop found while it runs is picked up by the
+  // next optimization.
+  std::thread pose_graph_thread;
+  std::atomic<bool> pose_graph_done;
+  bool pose_graph_running;
+  bool pose_graph_pending;
+  PoseGraphProblem pose_graph;
+  std::vector<int> pose_graph_frame_indices;
+  std::vector<Pose> pose_graph_initial_poses;
+  std::vector<MapCorrection> map_corrections;
+  int loop_closure_count;
+};
+
+// Quantizes the new keyframe, looks it up among the older keyframes and adds
+// it to the database. Runs before the keyframe joins the map, so the newest
+// map keyframe is its predecessor. Returns the number of candidates appended
+// to loop_candidates.
+int detect_loop_candidates(Mapper* mapper_ptr, MapKeyframe* keyframe_ptr) {
+  if (mapper_ptr->vocabulary_ptr == nullptr) {
+    return 0;
+  }
+  const size_t previous_count = mapper_ptr->loop_candidates.size();
+  const MappingParameters& parameters = mapper_ptr->parameters;
+
+  keyframe_ptr->words.resize(keyframe_ptr->descriptors.count);
+  compute_bow_vector(&keyframe_ptr->bow_vector, keyframe_ptr->words.data(), mapper_ptr->vocabulary_ptr,
+                     &keyframe_ptr->descriptors);
+
+  if (!mapper_ptr->keyframes.empty()) {
+    const float reference_score = score_bow_vectors(&keyframe_ptr->bow_vector, &mapper_ptr->keyframes.back()->bow_vector);
+    const float min_score = std::max(parameters.loop_min_score, parameters.loop_relative_score * reference_score);
+    std::vector<KeyframeQueryResult> results;
+    query_keyframe_database(&results, &mapper_ptr->keyframe_database, &keyframe_ptr->bow_vector,
+                            parameters.loop_max_candidates, min_score,
+                            keyframe_ptr->frame_index - parameters.loop_min_frame_gap);
+    for (const KeyframeQueryResult& result : results) {
+      mapper_ptr->loop_candidates.push_back({ keyframe_ptr->frame_index, result.keyframe_id, result.score });
+    }
+  }
+
+  add_keyframe_to_database(&mapper_ptr->keyframe_database, keyframe_ptr->frame_index, &keyframe_ptr->bow_vector);
+  return int(mapper_ptr->loop_candidates.size() - previous_count);
+}
+
+MapKeyframe* find_map_keyframe(Mapper* mapper_ptr, int frame_index) {
+  for (MapKeyframe* keyframe_ptr : mapper_ptr->keyframes) {
+    if (keyframe_ptr->frame_index == frame_index) {
+      return keyframe_ptr;
+    }
+  }
+  return nullptr;
+}
+
+// Locates the keyframe against the map points the candidate observes. With
+// enough inliers the located pose is free of the drift accumulated since
+// the candidate, and the loop edge is the motion from candidate to keyframe.
+bool verify_loop_candidate(LoopEdge* edge_ptr,
+                           Mapper* mapper_ptr,
+                           const MapKeyframe* keyframe_ptr,
+                           const MapKeyframe* candidate_ptr) {
+  const MappingParameters& parameters = mapper_ptr->parameters;
+  const MapPoints* map_points_ptr = &mapper_ptr->map_points;
+
+  std::vector<Match> matches;
+  match_descriptors_brute_force(&matches, &keyframe_ptr->descriptors, &candidate_ptr->descriptors);
+  // PROSAC expects the most distinctive matches first.
+  std::sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) { return a.distance < b.distance; });
+
+  std::vector<float> point_x, point_y, point_z, image_x, image_y;
+  for (const Match& match : matches) {
+    const int slot = get_map_point_index(map_points_ptr, candidate_ptr->point_handles[match.train_index]);
+    if (slot < 0) {
+      continue;
+    }
+    point_x.push_back(map_points_ptr->x[slot]);
+    point_y.push_back(map_points_ptr->y[slot]);
+    point_z.push_back(map_points_ptr->z[slot]);
+    image_x.push_back(keyframe_ptr->x[match.query_index]);
+    image_y.push_back(keyframe_ptr->y[match.query_index]);
+  }
+  const int count = int(point_x.size());
+  if (count < parameters.loop_min_inliers) {
+    return false;
+  }
+
+  AbsolutePose pose = {};
+  if (!estimate_absolute_pose(&pose, point_x.data(), point_y.data(), point_z.data(), image_x.data(), image_y.data(), count,
+                              parameters.loop_pose)) {
+    return false;
+  }
+  PoseRefinementParameters refinement_parameters = {};
+  refinement_parameters.huber_threshold = 0.5f * parameters.loop_pose.threshold;
+  refinement_parameters.inlier_threshold = parameters.loop_pose.threshold;
+  refine_absolute_pose(&pose, point_x.data(), point_y.data(), point_z.data(), image_x.data(), image_y.data(), count,
+                       refinement_parameters);
+  if (pose.inlier_count < parameters.loop_min_inliers) {
+    return false;
+  }
+
+  edge_ptr->frame_index = keyframe_ptr->frame_index;
+  edge_ptr->match_frame_index = candidate_ptr->frame_index;
+  edge_ptr->measurement = Pose{ pose.rotation, pose.translation } *
+                          inverse(Pose{ candidate_ptr->rotation, candidate_ptr->translation });
+  return true;
+}
+
+void run_pose_graph_thread(Mapper* mapper_ptr) {
+  PoseGraphResult result;
+  run_pose_graph_optimization(&result, &mapper_ptr->pose_graph, mapper_ptr->parameters.pose_graph);
+  mapper_ptr->pose_graph_done.store(true, std::memory_order_release);
+}
+
+// Builds the pose graph of the current keyframes, odometry edges between
+// neighbours from their current poses plus every loop edge, and hands it to
+// the optimization thread. The oldest keyframe pins the gauge.
+void start_pose_graph_optimization(Mapper* mapper_ptr) {
+  PoseGraphProblem* problem_ptr = &mapper_ptr->pose_graph;
+  *problem_ptr = {};
+  mapper_ptr->pose_graph_frame_indices.clear();
+  mapper_ptr->pose_graph_initial_poses.clear();
+  for (const MapKeyframe* keyframe_ptr : mapper_ptr->keyframes) {
+    const Pose pose = { keyframe_ptr->rotation, keyframe_ptr->translation };
+    const int node = add_pose_graph_node(problem_ptr, pose, problem_ptr->poses.empty());
+    if (node > 0) {
+      add_pose_graph_edge(problem_ptr, node - 1, node, pose * inverse(problem_ptr->poses[node - 1]));
+    }
+    mapper_ptr->pose_graph_frame_indices.push_back(keyframe_ptr->frame_index);
+    mapper_ptr->pose_graph_initial_poses.push_back(pose);
+  }
+
+  const std::vector<int>& frame_indices = mapper_ptr->pose_graph_frame_indices;
+  for (const LoopEdge& edge : mapper_ptr->loop_edges) {
+    const auto from = std::find(frame_indices.begin(), frame_indices.end(), edge.match_frame_index);
+    const auto to = std::find(frame_indices.begin(), frame_indices.end(), edge.frame_index);
+    if (from != frame_indices.end() && to != frame_indices.end()) {
+      add_pose_graph_edge(problem_ptr, int(from - frame_indices.begin()), int(to - frame_indices.begin()),
+                          edge.measurement);
+    }
+  }
+
+  mapper_ptr->pose_graph_pending = false;
+  mapper_ptr->pose_graph_running = true;
+  mapper_ptr->pose_graph_done.store(false, std::memory_order_relaxed);
+  mapper_ptr->pose_graph_thread = std::thread(run_pose_graph_thread, mapper_ptr);
+}
+
+// Verifies the candidates the new keyframe just produced and schedules a
+// pose graph optimization for every verified loop.
+void close_loops(Mapper* mapper_ptr, const MapKeyframe* keyframe_ptr, int candidate_count) {
+  // Right after a loop the next keyframes see the same place again, closing
+  // it once is enough.
+  const std::vector<LoopEdge>& loop_edges = mapper_ptr->loop_edges;
+  if (!loop_edges.empty() &&
+      keyframe_ptr->frame_index - loop_edges.back().frame_index < mapper_ptr->parameters.loop_min_frame_gap) {
+    candidate_count = 0;
+  }
+  const int candidate_end = int(mapper_ptr->loop_candidates.size());
+  for (int index = candidate_end - candidate_count; index < candidate_end; ++index) {
+    const MapKeyframe* candidate_ptr = find_map_keyframe(mapper_ptr, mapper_ptr->loop_candidates[index].match_frame_index);
+    LoopEdge edge;
+    if (candidate_ptr != nullptr && verify_loop_candidate(&edge, mapper_ptr, keyframe_ptr, candidate_ptr)) {
+      mapper_ptr->loop_edges.push_back(edge);
+      mapper_ptr->pose_graph_pending = true;
+      // One verified candidate is enough, the others see the same place.
+      break;
+    }
+  }
+  if (mapper_ptr->pose_graph_pending && !mapper_ptr->pose_graph_running) {
+    start_pose_graph_optimization(mapper_ptr);
+  }
+}
+
+// Moves every keyframe and point by the correction of the optimized graph,
+// all between two mapping steps so the next snapshot has the whole loop
+// closed. Keyframe k is corrected by W_k = T_k'^-1 T_k, which takes the old
+// world to the new one. Keyframes added while the graph was optimized take
+// the correction of the newest keyframe in the graph, points take the
+// correction of the first keyframe observing them.
+void apply_pose_graph_correction(Mapper* mapper_ptr) {
+  mapper_ptr->pose_graph_thread.join();
+  mapper_ptr->pose_graph_running = false;
+
+  const PoseGraphProblem* problem_ptr = &mapper_ptr->pose_graph;
+  const std::vector<int>& frame_indices = mapper_ptr->pose_graph_frame_indices;
+  if (frame_indices.empty()) {
+    return;
+  }
+  std::vector<Pose> corrections(frame_indices.size());
+  for (size_t node = 0; node < frame_indices.size(); ++node) {
+    corrections[node] = inverse(problem_ptr->poses[node]) * mapper_ptr->pose_graph_initial_poses[node];
+  }
+
+  MapPoints* map_points_ptr = &mapper_ptr->map_points;
+  std::vector<unsigned char> corrected(get_map_point_slot_count(map_points_ptr), 0);
+  size_t node = 0;
+  for (MapKeyframe* keyframe_ptr : mapper_ptr->keyframes) {
+    while (node + 1 < frame_indices.size() && frame_indices[node] < keyframe_ptr->frame_index) {
+      ++node;
+    }
+    const Pose& correction = corrections[node];
+    const Pose pose = Pose{ keyframe_ptr->rotation, keyframe_ptr->translation } * inverse(correction);
+    keyframe_ptr->rotation = pose.rotation;
+    keyframe_ptr->translation = pose.translation;
+
+    for (const MapPointHandle handle : keyframe_ptr->point_handles) {
+      const int slot = get_map_point_index(map_points_ptr, handle);
+      if (slot < 0 || corrected[slot]) {
+        continue;
+      }
+      corrected[slot] = 1;
+      const Vec3 point = correction * Vec3{ map_points_ptr->x[slot], map_points_ptr->y[slot], map_points_ptr->z[slot] };
+      map_points_ptr->x[slot] = float(point.x);
+      map_points_ptr->y[slot] = float(point.y);
+      map_points_ptr->z[slot] = float(point.z);
+    }
+  }
+  // Keyframes tracked against older snapshots are still on their way.
+  mapper_ptr->map_corrections.push_back({ mapper_ptr->version + 1, corrections.back() });
+  ++mapper_ptr->loop_closure_count;
+
+  if (mapper_ptr->pose_graph_pending) {
+    start_pose_graph_optimization(mapper_ptr);
+  }
+}
+
+// Moves a keyframe tracked before the latest loop corrections into the
+// corrected world.
+void apply_map_corrections(const Mapper* mapper_ptr, MapKeyframe* keyframe_ptr) {
+  if (keyframe_ptr->map_version == 0) {
+    return;
+  }
+  Pose pose = { keyframe_ptr->rotation, keyframe_ptr->translation };
+  for (const MapCorrection& correction : mapper_ptr->map_corrections) {
+    if (correction.version > keyframe_ptr->map_version) {
+      pose = pose * inverse(correction.correction);
+    }
+  }
+  keyframe_ptr->rotation = pose.rotation;
+  keyframe_ptr->translation = pose.translation;
+}
+
+// Matches the new keyframe against the previous one. Matches of points the
+// previous keyframe already observes extend those points, the rest are
+// triangulated.
+void add_keyframe_to_map(Mapper* mapper_ptr, MapKeyframe* keyframe_ptr) {
+  if (mapper_ptr->keyframes.empty()) {
+    mapper_ptr->keyframes.push_back(keyframe_ptr);
+    return;
+  }
+  MapKeyframe* previous_ptr = mapper_ptr->keyframes.back();
+  MapPoints* map_points_ptr = &mapper_ptr->map_points;
+
+  KeypointGrid grid;
+  build_keypoint_grid(&grid, &keyframe_ptr->keypoints, keyframe_ptr->width, keyframe_ptr->height);
+  std::vector<Match> matches;
+  match_descriptors_in_windows(&matches, &previous_ptr->descriptors, previous_ptr->keypoints.u.data(),
+                               previous_ptr->keypoints.v.data(), &keyframe_ptr->keypoints, &keyframe_ptr->descriptors,
+                               &grid, mapper_ptr->parameters.search_radius);
+
+  std::vector<float> x1, y1, x2, y2;
+  std::vector<int> train_indices;
+  for (const Match& match : matches) {
+    const MapPointHandle handle = previous_ptr->point_handles[match.query_index];
+    const int slot = get_map_point_index(map_points_ptr, handle);
+    if (slot >= 0) {
+      keyframe_ptr->point_handles[match.train_index] = handle;
+      ++map_points_ptr->observation_counts[slot];
+      continue;
+    }
+    x1.push_back(previous_ptr->x[match.query_index]);
+    y1.push_back(previous_ptr->y[match.query_index]);
+    x2.push_back(keyframe_ptr->x[match.train_index]);
+    y2.push_back(keyframe_ptr->y[match.train_index]);
+    train_indices.push_back(match.train_index);
+  }
+
+  const int count = int(train_indices.size());
+  std::vector<unsigned char> candidate_mask(count, 1);
+  std::vector<MapPointHandle> handles(count);
+  triangulate_matches(handles.data(), map_points_ptr, previous_ptr->rotation, previous_ptr->translation,
+                      keyframe_ptr->rotation, keyframe_ptr->translation, x1.data(), y1.data(), x2.data(), y2.data(),
+                      candidate_mask.data(), &keyframe_ptr->descriptors, train_indices.data(), count,
+                      mapper_ptr->parameters.triangulation);
+
+  // The previous keyframe observes the new points too.
+  int candidate_index = 0;
+  for (const Match& match : matches) {
+    if (get_map_point_index(map_points_ptr, previous_ptr->point_handles[match.query_index]) >= 0) {
+      continue;
+    }
+    const MapPointHandle handle = handles[candidate_index++];
+    if (handle.index != invalid_map_point_handle.index) {
+      previous_ptr->point_handles[match.query_index] = handle;
+      keyframe_ptr->point_handles[match.train_index] = handle;
+      if (handle.index >= mapper_ptr->point_created_keyframes.size()) {
+        mapper_ptr->point_created_keyframes.resize(handle.index + 1);
+      }
+      mapper_ptr->point_created_keyframes[handle.index] = mapper_ptr->keyframe_counter;
+    }
+  }
+
+  mapper_ptr->keyframes.push_back(keyframe_ptr);
+}
+
+// Drops points that were not picked up by enough keyframes while on
+// probation. Keyframes keep their stale handles, which no longer resolve.
+void cull_map_points(Mapper* mapper_ptr) {
+  MapPoints* map_points_ptr = &mapper_ptr->map_points;
+  const int slot_count = get_map_point_slot_count(map_points_ptr);
+  for (int slot = 0; slot < slot_count; ++slot) {
+    if (!map_points_ptr->alive[slot] ||
+        mapper_ptr->point_created_keyframes[slot] + mapper_ptr->parameters.point_probation != mapper_ptr->keyframe_counter ||
+        map_points_ptr->observation_counts[slot] >= mapper_ptr->parameters.min_point_observations) {
+      continue;
+    }
+    remove_map_point(map_points_ptr, { uint32_t(slot), map_points_ptr->generations[slot] });
+  }
+}
+
+// Removes a keyframe and the points that fall below two observations
+// without it.
+void remove_map_keyframe(Mapper* mapper_ptr, int keyframe_index) {
+  MapKeyframe* keyframe_ptr = mapper_ptr->keyframes[keyframe_index];
+  MapPoints* map_points_ptr = &mapper_ptr->map_points;
+  for (const MapPointHandle handle : keyframe_ptr->point_handles) {
+    const int slot = get_map_point_index(map_points_ptr, handle);
+    if (slot >= 0 && --map_points_ptr->observation_counts[slot] < 2) {
+      remove_map_point(map_points_ptr, handle);
+    }
+  }
+
+  if (mapper_ptr->vocabulary_ptr != nullptr) {
+    remove_keyframe_from_database(&mapper_ptr->keyframe_database, keyframe_ptr->frame_index, &keyframe_ptr->bow_vector);
+  }
+  free_map_keyframe(keyframe_ptr);
+  delete keyframe_ptr;
+  mapper_ptr->keyframes.erase(mapper_ptr->keyframes.begin() + keyframe_index);
+}
+
+// Culls keyframes of the local window whose points are almost all seen by
+// other keyframes, then enforces max_keyframes. The two newest keyframes are
+// kept since the next keyframe is matched against the newest and the
+// window needs a second one to hold the scale.
+void cull_map_keyframes(Mapper* mapper_ptr) {
+  const MappingParameters& parameters = mapper_ptr->parameters;
+  const MapPoints* map_points_ptr = &mapper_ptr->map_points;
+  const int window_begin = std::max(0, int(mapper_ptr->keyframes.size()) - parameters.window_size);
+
+  for (int keyframe_index = int(mapper_ptr->keyframes.size()) - 3; keyframe_index >= window_begin; --keyframe_index) {
+    int point_count = 0;
+    int redundant_count = 0;
+    for (const MapPointHandle handle : mapper_ptr->keyframes[keyframe_index]->point_handles) {
+      const int slot = get_map_point_index(map_points_ptr, handle);
+      if (slot < 0) {
+        continue;
+      }
+      ++point_count;
+      redundant_count += map_points_ptr->observation_counts[slot] - 1 >= parameters.redundant_observer_count;
+    }
+    if (point_count > 0 && redundant_count >= parameters.redundant_point_ratio * point_count) {
+      remove_map_keyframe(mapper_ptr, keyframe_index);
+    }
+  }
+
+  while (int(mapper_ptr->keyframes.size()) > std::max(parameters.max_keyframes, 2)) {
+    remove_map_keyframe(mapper_ptr, 0);
+  }
+}
+
+// Local bundle adjustment over the newest window_size keyframes and every
+// point they observe. Results are written back to the keyframes and map.
+void optimize_local_window(Mapper* mapper_ptr) {
+  const int keyframe_count = int(mapper_ptr->keyframes.size());
+  const int window_begin = std::max(0, keyframe_count - mapper_ptr->parameters.window_size);
+  MapPoints* map_points_ptr = &mapper_ptr->map_points;
+
+  BundleAdjustmentProblem problem = {};
+  std::vector<int> point_indices(get_map_point_slot_count(map_points_ptr), -1);
+  std::vector<int> point_slots;
+  for (int keyframe_index = window_begin; keyframe_index < keyframe_count; ++keyframe_index) {
+    const MapKeyframe* keyframe_ptr = mapper_ptr->keyframes[keyframe_index];
+    // Monocular maps have a free scale, so two keyframes are held fixed.
+    const int problem_keyframe = add_keyframe(&problem, keyframe_ptr->rotation, keyframe_ptr->translation,
+                                              keyframe_index < window_begin + 2);
+    const int keypoint_count = int(keyframe_ptr->point_handles.size());
+    for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+      const int slot = get_map_point_index(map_points_ptr, keyframe_ptr->point_handles[keypoint_index]);
+      if (slot < 0) {
+        continue;
+      }
+      if (point_indices[slot] < 0) {
+        point_indices[slot] = add_point(&problem, { map_points_ptr->x[slot], map_points_ptr->y[slot], map_points_ptr->z[slot] });
+        point_slots.push_back(slot);
+      }
+      add_observation(&problem, problem_keyframe, point_indices[slot], keyframe_ptr->x[keypoint_index],
+                      keyframe_ptr->y[keypoint_index]);
+    }
+  }
+
+  if (problem.points.empty()) {
+    return;
+  }
+
+  BundleAdjustmentResult result;
+  run_bundle_adjustment(&result, &problem, mapper_ptr->parameters.bundle_adjustment);
+
+  for (int keyframe_index = window_begin; keyframe_index < keyframe_count; ++keyframe_index) {
+    MapKeyframe* keyframe_ptr = mapper_ptr->keyframes[keyframe_index];
+    keyframe_ptr->rotation = problem.rotations[keyframe_index - window_begin];
+    keyframe_ptr->translation = problem.translations[keyframe_index - window_begin];
+  }
+  for (int point_index = 0; point_index < int(point_slots.size()); ++point_index) {
+    const Vec3& point = problem.points[point_index];
+    map_points_ptr->x[point_slots[point_index]] = float(point.x);
+    map_points_ptr->y[point_slots[point_index]] = float(point.y);
+    map_points_ptr->z[point_slots[point_index]] = float(point.z);
+  }
+}
+
+void free_map_snapshot(MapSnapshot* snapshot_ptr) {
+  free_map_points(&snapshot_ptr->map_points);
+  delete snapshot_ptr;
+}
+
+// Copies the map into a recycled snapshot and swaps it in. A snapshot the
+// tracker never picked up is recycled right away.
+void publish_map_snapshot(Mapper* mapper_ptr) {
+  MapSnapshot* snapshot_ptr;
+  while (try_pop(&mapper_ptr->retired_snapshots, &snapshot_ptr)) {
+    mapper_ptr->free_snapshots.push_back(snapshot_ptr);
+  }
+
+  if (mapper_ptr->free_snapshots.empty()) {
+    snapshot_ptr = new MapSnapshot{};
+  } else {
+    snapshot_ptr = mapper_ptr->free_snapshots.back();
+    mapper_ptr->free_snapshots.pop_back();
+  }
+
+  snapshot_ptr->version = ++mapper_ptr->version;
+  snapshot_ptr->loop_candidate_count = int(mapper_ptr->loop_candidates.size());
+  snapshot_ptr->loop_closure_count = mapper_ptr->loop_closure_count;
+  copy_map_points(&snapshot_ptr->map_points, &mapper_ptr->map_points);
+  snapshot_ptr->keyframe_frame_indices.clear();
+  snapshot_ptr->keyframe_rotations.clear();
+  snapshot_ptr->keyframe_translations.clear();
+  for (const MapKeyframe* keyframe_ptr : mapper_ptr->keyframes) {
+    snapshot_ptr->keyframe_frame_indices.push_back(keyframe_ptr->frame_index);
+    snapshot_ptr->keyframe_rotations.push_back(keyframe_ptr->rotation);
+    snapshot_ptr->keyframe_translations.push_back(keyframe_ptr->translation);
+  }
+
+  // Recycled snapshots keep the capacity of their bag of words vectors.
+  const int keyframe_count = mapper_ptr->vocabulary_ptr != nullptr ? int(mapper_ptr->keyframes.size()) : 0;
+  snapshot_ptr->keyframe_bow_vectors.resize(keyframe_count);
+  snapshot_ptr->keyframe_point_offsets.assign(1, 0);
+  snapshot_ptr->keyframe_point_slots.clear();
+  for (int keyframe_index = 0; keyframe_index < keyframe_count; ++keyframe_index) {
+    const MapKeyframe* keyframe_ptr = mapper_ptr->keyframes[keyframe_index];
+    snapshot_ptr->keyframe_bow_vectors[keyframe_index] = keyframe_ptr->bow_vector;
+    for (const MapPointHandle handle : keyframe_ptr->point_handles) {
+      const int slot = get_map_point_index(&mapper_ptr->map_points, handle);
+      if (slot >= 0) {
+        snapshot_ptr->keyframe_point_slots.push_back(slot);
+      }
+    }
+    snapshot_ptr->keyframe_point_offsets.push_back(int(snapshot_ptr->keyframe_point_slots.size()));
+  }
+
+  MapSnapshot* unread_ptr = mapper_ptr->latest_snapshot.exchange(snapshot_ptr, std::memory_order_acq_rel);
+  if (unread_ptr != nullptr) {
+    mapper_ptr->free_snapshots.push_back(unread_ptr);
+  }
+}
+
+void run_mapping_loop(Mapper* mapper_ptr) {
+  while (!mapper_ptr->stopping.load(std::memory_order_acquire)) {
+    if (mapper_ptr->pose_graph_running && mapper_ptr->pose_graph_done.load(std::memory_order_acquire)) {
+      apply_pose_graph_correction(mapper_ptr);
+      publish_map_snapshot(mapper_ptr);
+    }
+
+    MapKeyframe* keyframe_ptr;
+    if (!try_pop(&mapper_ptr->keyframe_queue, &keyframe_ptr)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+
+    apply_map_corrections(mapper_ptr, keyframe_ptr);
+    const int candidate_count = detect_loop_candidates(mapper_ptr, keyframe_ptr);
+    add_keyframe_to_map(mapper_ptr, keyframe_ptr);
+    close_loops(mapper_ptr, keyframe_ptr, candidate_count);
+    ++mapper_ptr->keyframe_counter;
+    cull_map_points(mapper_ptr);
+    optimize_local_window(mapper_ptr);
+    cull_map_keyframes(mapper_ptr);
+    publish_map_snapshot(mapper_ptr);
+  }
+}
+
+// The vocabulary is optional and has to outlive the mapper.
+void start_mapper(Mapper* mapper_ptr, const MappingParameters& parameters = {}, const Vocabulary* vocabulary_ptr = nullptr) {
+  mapper_ptr->parameters = parameters;
+  mapper_ptr->vocabulary_ptr = vocabulary_ptr;
+  if (vocabulary_ptr != nullptr) {
+    init_keyframe_database(&mapper_ptr->keyframe_database, vocabulary_ptr);
+  }
+  mapper_ptr->loop_candidates.clear();
+  mapper_ptr->loop_edges.clear();
+  mapper_ptr->map_corrections.clear();
+  mapper_ptr->pose_graph_done.store(false, std::memory_order_relaxed);
+  mapper_ptr->pose_graph_running = false;
+  mapper_ptr->pose_graph_pending = false;
+  mapper_ptr->loop_closure_count = 0;
+  init_spsc_queue(&mapper_ptr->keyframe_queue, mapping_queue_capacity);
+  // Snapshots in flight are bounded by the tracker's current one, the unread
+  // latest one and those waiting to be recycled.
+  init_spsc_queue(&mapper_ptr->retired_snapshots, mapping_queue_capacity);
+  mapper_ptr->latest_snapshot.store(nullptr, std::memory_order_relaxed);
+  mapper_ptr->stopping.store(false, std::memory_order_relaxed);
+  mapper_ptr->map_points = {};
+  mapper_ptr->keyframe_counter = 0;
+  mapper_ptr->version = 0;
+  mapper_ptr->thread = std::thread(run_mapping_loop, mapper_ptr);
+}
+
+// Tracker side. Hands a keyframe to the mapper, which then owns it. Returns
+// false when the mapper is still busy with earlier keyframes, the caller
+// keeps ownership and can skip this keyframe.
+bool submit_keyframe(Mapper* mapper_ptr, MapKeyframe* keyframe_ptr) {
+  return try_push(&mapper_ptr->keyframe_queue, keyframe_ptr);
+}
+
+// Tracker side. Returns the newest snapshot, retiring current_ptr if a newer
+// one was published. Never blocks.
+const MapSnapshot* update_map_snapshot(Mapper* mapper_ptr, const MapSnapshot* current_ptr) {
+  MapSnapshot* latest_ptr = mapper_ptr->latest_snapshot.exchange(nullptr, std::memory_order_acq_rel);
+  if (latest_ptr == nullptr) {
+    return current_ptr;
+  }
+  if (current_ptr != nullptr && !try_push(&mapper_ptr->retired_snapshots, const_cast<MapSnapshot*>(current_ptr))) {
+    // Only reachable if the mapper stopped recycling.
+    free_map_snapshot(const_cast<MapSnapshot*>(current_ptr));
+  }
+  return latest_ptr;
+}
+
+// Stops the mapping thread and frees every keyframe and snapshot, including
+// current_ptr held by the tracker.
+void stop_mapper(Mapper* mapper_ptr, const MapSnapshot* current_ptr) {
+  mapper_ptr->stopping.store(true, std::memory_order_release);
+  mapper_ptr->thread.join();
+  if (mapper_ptr->pose_graph_running) {
+    mapper_ptr->pose_graph_thread.join();
+    mapper_ptr->pose_graph_running = false;
+  }
+
+  MapKeyframe* keyframe_ptr;
+  while (try_pop(&mapper_ptr->keyframe_queue, &keyframe_ptr)) {
+    free_map_keyframe(keyframe_ptr);
+    delete keyframe_ptr;
+  }
+  for (MapKeyframe* map_keyframe_ptr : mapper_ptr->keyframes) {
+    free_map_keyframe(map_keyframe_ptr);
+    delete map_keyframe_ptr;
+  }
+  mapper_ptr->keyframes.clear();
+
+  MapSnapshot* snapshot_ptr;
+  while (try_pop(&mapper_ptr->retired_snapshots, &snapshot_ptr)) {
+    mapper_ptr->free_snapshots.push_back(snapshot_ptr);
+  }
+  if (current_ptr != nullptr) {
+    mapper_ptr->free_snapshots.push_back(const_cast<MapSnapshot*>(current_ptr));
+  }
+  snapshot_ptr = mapper_ptr->latest_snapshot.exchange(nullptr);
+  if (snapshot_ptr != nullptr) {
+    mapper_ptr->free_snapshots.push_back(snapshot_ptr);
+  }
+  for (MapSnapshot* free_snapshot_ptr : mapper_ptr->free_snapshots) {
+    free_map_snapshot(free_snapshot_ptr);
+  }
+  mapper_ptr->free_snapshots.clear();
+  free_map_points(&mapper_ptr->map_points);
+}
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "orb.h"
+
+struct Match {
+  int query_index;
+  int train_index;
+  int distance;
+};
+
+struct MatchingParameters {
+  int max_distance = 64;
+  // Lowe ratio test on Hamming distances, 1.0 disables it.
+  float ratio = 0.8f;
+  bool cross_check = true;
+};
+
+int hamming_distance(const unsigned char* a_ptr, const unsigned char* b_ptr) {
+  uint64_t a[4];
+  uint64_t b[4];
+  std::memcpy(a, a_ptr, descriptor_size);
+  std::memcpy(b, b_ptr, descriptor_size);
+  return __builtin_popcountll(a[0] ^ b[0]) + __builtin_popcountll(a[1] ^ b[1]) +
+         __builtin_popcountll(a[2] ^ b[2]) + __builtin_popcountll(a[3] ^ b[3]);
+}
+
+constexpr int no_match_distance = 1 << 16;
+
+// Running best and second best distance of one query over part of the train set.
+struct QueryBest {
+  int best;
+  int second;
+  int best_index;
+};
+
+void merge_query_best(QueryBest* query_best_ptr, int distance, int second, int train_index) {
+  if (distance < query_best_ptr->best) {
+    query_best_ptr->second = std::min(query_best_ptr->best, second);
+    query_best_ptr->best = distance;
+    query_best_ptr->best_index = train_index;
+  } else {
+    query_best_ptr->second = std::min(query_best_ptr->second, distance);
+  }
+}
+
+#if defined(__AVX2__)
+// Per 64 bit lane sums of the set bits in a ^ b, using the vpshufb nibble lookup.
+__m256i hamming_lane_sums(__m256i a, __m256i b) {
+  const __m256i nibble_popcount = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  const __m256i x = _mm256_xor_si256(a, b);
+  const __m256i low = _mm256_shuffle_epi8(nibble_popcount, _mm256_and_si256(x, low_mask));
+  const __m256i high = _mm256_shuffle_epi8(nibble_popcount, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask));
+  return _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256());
+}
+
+// Lane sums of four pairs packed into the four 16 bit fields of each 64 bit lane.
+__m256i hamming_packed_x4(__m256i query, const __m256i* train_ptr) {
+  __m256i packed = hamming_lane_sums(query, _mm256_load_si256(train_ptr + 0));
+  packed = _mm256_or_si256(packed, _mm256_slli_epi64(hamming_lane_sums(query, _mm256_load_si256(train_ptr + 1)), 16));
+  packed = _mm256_or_si256(packed, _mm256_slli_epi64(hamming_lane_sums(query, _mm256_load_si256(train_ptr + 2)), 32));
+  packed = _mm256_or_si256(packed, _mm256_slli_epi64(hamming_lane_sums(query, _mm256_load_si256(train_ptr + 3)), 48));
+  return packed;
+}
+
+// Distances from one query to eight consecutive train descriptors as 32 bit lanes.
+__m256i hamming_distance_x8(__m256i query, const unsigned char* train_ptr) {
+  const __m256i* train = reinterpret_cast<const __m256i*>(train_ptr);
+  const __m256i a = hamming_packed_x4(query, train);
+  const __m256i b = hamming_packed_x4(query, train + 4);
+
+  // Horizontal add of the four lanes of a and b at once.
+  const __m256i lo = _mm256_permute2x128_si256(a, b, 0x20);
+  const __m256i hi = _mm256_permute2x128_si256(a, b, 0x31);
+  __m256i sum = _mm256_add_epi64(lo, hi);
+  sum = _mm256_add_epi64(sum, _mm256_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(2, 0, 2, 0));
+
+  return _mm256_cvtepu16_epi32(_mm256_castsi256_si128(sum));
+}
+
+// Scans one tile of train descriptors for one query. Eight independent
+// best/second candidates are tracked per lane and merged at the end, and the
+// per train best query is updated in place.
+void match_query_against_tile(QueryBest* query_best_ptr,
+                              int* train_best_distance_ptr,
+                              int* train_best_query_ptr,
+                              const unsigned char* query_ptr,
+                              int query_index,
+                              const Descriptors* train_descriptors_ptr,
+                              int train_begin,
+                              int train_end) {
+  const __m256i query = _mm256_load_si256(reinterpret_cast<const __m256i*>(query_ptr));
+  const __m256i query_index_x8 = _mm256_set1_epi32(query_index);
+  const __m256i lane_offsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  __m256i best = _mm256_set1_epi32(no_match_distance);
+  __m256i second = best;
+  __m256i best_index = _mm256_set1_epi32(-1);
+
+  int train_index = train_begin;
+  for (; train_index + 8 <= train_end; train_index += 8) {
+    const __m256i distance = hamming_distance_x8(query, get_descriptor_ptr(train_index, train_descriptors_ptr));
+    const __m256i index = _mm256_add_epi32(_mm256_set1_epi32(train_index), lane_offsets);
+
+    const __m256i is_better = _mm256_cmpgt_epi32(best, distance);
+    second = _mm256_min_epi32(second, _mm256_max_epi32(best, distance));
+    best = _mm256_min_epi32(best, distance);
+    best_index = _mm256_blendv_epi8(best_index, index, is_better);
+
+    __m256i* train_distance_ptr = reinterpret_cast<__m256i*>(train_best_distance_ptr + train_index);
+    __m256i* train_query_ptr = reinterpret_cast<__m256i*>(train_best_query_ptr + train_index);
+    const __m256i train_distance = _mm256_loadu_si256(train_distance_ptr);
+    const __m256i is_train_better = _mm256_cmpgt_epi32(train_distance, distance);
+    _mm256_storeu_si256(train_distance_ptr, _mm256_min_epi32(train_distance, distance));
+    _mm256_storeu_si256(train_query_ptr, _mm256_blendv_epi8(_mm256_loadu_si256(train_query_ptr), query_index_x8, is_train_better));
+  }
+
+  alignas(32) int lane_best[8];
+  alignas(32) int lane_second[8];
+  alignas(32) int lane_index[8];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lane_best), best);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lane_second), second);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lane_index), best_index);
+  for (int lane = 0; lane < 8; ++lane) {
+    merge_query_best(query_best_ptr, lane_best[lane], lane_second[lane], lane_index[lane]);
+  }
+
+  for (; train_index < train_end; ++train_index) {
+    const int distance = hamming_distance(query_ptr, get_descriptor_ptr(train_index, train_descriptors_ptr));
+    merge_query_best(query_best_ptr, distance, no_match_distance, train_index);
+    if (distance < train_best_distance_ptr[train_index]) {
+      train_best_distance_ptr[train_index] = distance;
+      train_best_query_ptr[train_index] = query_index;
+    }
+  }
+}
+#else
+void match_query_against_tile(QueryBest* query_best_ptr,
+                              int* train_best_distance_ptr,
+                              int* train_best_query_ptr,
+                              const unsigned char* query_ptr,
+                              int query_index,
+                              const Descriptors* train_descriptors_ptr,
+                              int train_begin,
+                              int train_end) {
+  for (int train_index = train_begin; train_index < train_end; ++train_index) {
+    const int distance = hamming_distance(query_ptr, get_descriptor_ptr(train_index, train_descriptors_ptr));
+    merge_query_best(query_best_ptr, distance, no_match_distance, train_index);
+    if (distance < train_best_distance_ptr[train_index]) {
+      train_best_distance_ptr[train_index] = distance;
+      train_best_query_ptr[train_index] = query_index;
+    }
+  }
+}
+#endif
+
+// Tile sizes chosen so a query tile (1 KiB) and a train tile (8 KiB) stay in L1.
+constexpr int matching_query_tile = 32;
+constexpr int matching_train_tile = 256;
+
+// Applies the distance threshold, ratio test and cross check to the best
+// candidate of every query.
+void collect_matches(std::vector<Match>* matches_ptr,
+                     const std::vector<QueryBest>& query_best,
+                     const std::vector<int>& train_best_query,
+                     const MatchingParameters& parameters) {
+  matches_ptr->clear();
+
+  for (int query_index = 0; query_index < static_cast<int>(query_best.size()); ++query_index) {
+    const int train_index = query_best[query_index].best_index;
+    const int distance = query_best[query_index].best;
+
+    if (train_index < 0 || distance > parameters.max_distance) {
+      continue;
+    }
+    if (parameters.ratio < 1.0f && distance >= parameters.ratio * query_best[query_index].second) {
+      continue;
+    }
+    if (parameters.cross_check && train_best_query[train_index] != query_index) {
+      continue;
+    }
+
+    matches_ptr->push_back({ query_index, train_index, distance });
+  }
+}
+
+// Brute force matching of every query descriptor against every train
+// descriptor. Keeps the best match per query that passes the distance
+// threshold, the ratio test and, optionally, the mutual nearest neighbour check.
+void match_descriptors_brute_force(std::vector<Match>* matches_ptr,
+                                   const Descriptors* query_descriptors_ptr,
+                                   const Descriptors* train_descriptors_ptr,
+                                   const MatchingParameters& parameters = {}) {
+  const int query_count = query_descriptors_ptr->count;
+  const int train_count = train_descriptors_ptr->count;
+
+  std::vector<QueryBest> query_best(query_count, { no_match_distance, no_match_distance, -1 });
+  std::vector<int> train_best_distance(train_count, no_match_distance);
+  std::vector<int> train_best_query(train_count, -1);
+
+  for (int query_tile = 0; query_tile < query_count; query_tile += matching_query_tile) {
+    const int query_end = std::min(query_tile + matching_query_tile, query_count);
+
+    for (int train_tile = 0; train_tile < train_count; train_tile += matching_train_tile) {
+      const int train_end = std::min(train_tile + matching_train_tile, train_count);
+
+      for (int query_index = query_tile; query_index < query_end; ++query_index) {
+        match_query_against_tile(&query_best[query_index],
+                                 train_best_distance.data(),
+                                 train_best_query.data(),
+                                 get_descriptor_ptr(query_index, query_descriptors_ptr),
+                                 query_index,
+                                 train_descriptors_ptr,
+                                 train_tile,
+                                 train_end);
+      }
+    }
+  }
+
+  collect_matches(matches_ptr, query_best, train_best_query, parameters);
+}
+
+// Uniform grid over the image holding keypoint indices sorted by cell, built
+// with a counting sort. Keypoints of cell c are
+// keypoint_indices[cell_starts[c] .. cell_starts[c + 1]).
+struct KeypointGrid {
+  int cell_size;
+  int columns;
+  int rows;
+  std::vector<int> cell_starts;
+  std::vector<int> keypoint_indices;
+};
+
+void build_keypoint_grid(KeypointGrid* grid_ptr,
+                         const Keypoints* keypoints_ptr,
+                         int width,
+                         int height,
+                         int cell_size = 16) {
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+
+  grid_ptr->cell_size = cell_size;
+  grid_ptr->columns = (width + cell_size - 1) / cell_size;
+  grid_ptr->rows = (height + cell_size - 1) / cell_size;
+
+  const int cell_count = grid_ptr->columns * grid_ptr->rows;
+  grid_ptr->cell_starts.assign(cell_count + 1, 0);
+  grid_ptr->keypoint_indices.resize(keypoint_count);
+
+  auto get_cell = [grid_ptr, keypoints_ptr](int keypoint_index) {
+    const int column = std::clamp(int(keypoints_ptr->u[keypoint_index]) / grid_ptr->cell_size, 0, grid_ptr->columns - 1);
+    const int row = std::clamp(int(keypoints_ptr->v[keypoint_index]) / grid_ptr->cell_size, 0, grid_ptr->rows - 1);
+    return row * grid_ptr->columns + column;
+  };
+
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    ++grid_ptr->cell_starts[get_cell(keypoint_index) + 1];
+  }
+  for (int cell = 0; cell < cell_count; ++cell) {
+    grid_ptr->cell_starts[cell + 1] += grid_ptr->cell_starts[cell];
+  }
+
+  std::vector<int> cell_fill(grid_ptr->cell_starts.begin(), grid_ptr->cell_starts.end() - 1);
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    grid_ptr->keypoint_indices[cell_fill[get_cell(keypoint_index)]++] = keypoint_index;
+  }
+}
+
+// For every query with a predicted location, searches only the train
+// keypoints within search_radius pixels of the prediction. Predictions with a
+// negative or NaN coordinate are skipped. The ratio test is applied within the window and the
+// cross check keeps the closest query per train keypoint.
+void match_descriptors_in_windows(std::vector<Match>* matches_ptr,
+                                  const Descriptors* query_descriptors_ptr,
+                                  const float* predicted_u_ptr,
+                                  const float* predicted_v_ptr,
+                                  const Keypoints* train_keypoints_ptr,
+                                  const Descriptors* train_descriptors_ptr,
+                                  const KeypointGrid* grid_ptr,
+                                  float search_radius,
+                                  const MatchingParameters& parameters = {}) {
+  const int query_count = query_descriptors_ptr->count;
+  const int train_count = train_descriptors_ptr->count;
+  const float radius_squared = search_radius * search_radius;
+
+  std::vector<QueryBest> query_best(query_count, { no_match_distance, no_match_distance, -1 });
+  std::vector<int> train_best_distance(train_count, no_match_distance);
+  std::vector<int> train_best_query(train_count, -1);
+
+  for (int query_index = 0; query_index < query_count; ++query_index) {
+    const float predicted_u = predicted_u_ptr[query_index];
+    const float predicted_v = predicted_v_ptr[query_index];
+    // Also rejects NaN predictions.
+    if (!(predicted_u >= 0.0f && predicted_v >= 0.0f)) {
+      continue;
+    }
+
+    // Cell ranges stay in floating point until clamped to the grid, so a
+    // prediction far outside the image never overflows the conversion. A
+    // window entirely past the right or bottom edge is skipped.
+    const float cell_size = float(grid_ptr->cell_size);
+    const float last_column = float(grid_ptr->columns - 1);
+    const float last_row = float(grid_ptr->rows - 1);
+    const float column_begin_cell = std::floor((predicted_u - search_radius) / cell_size);
+    const float row_begin_cell = std::floor((predicted_v - search_radius) / cell_size);
+    if (!(column_begin_cell <= last_column && row_begin_cell <= last_row)) {
+      continue;
+    }
+    const int column_begin = int(std::max(column_begin_cell, 0.0f));
+    const int column_end = int(std::min(std::floor((predicted_u + search_radius) / cell_size), last_column));
+    const int row_begin = int(std::max(row_begin_cell, 0.0f));
+    const int row_end = int(std::min(std::floor((predicted_v + search_radius) / cell_size), last_row));
+
+    const unsigned char* query_ptr = get_descriptor_ptr(query_index, query_descriptors_ptr);
+    QueryBest* best_ptr = &query_best[query_index];
+
+    for (int row = row_begin; row <= row_end; ++row) {
+      // Cells of one row are contiguous in keypoint_indices.
+      const int begin = grid_ptr->cell_starts[row * grid_ptr->columns + column_begin];
+      const int end = grid_ptr->cell_starts[row * grid_ptr->columns + column_end + 1];
+
+      for (int grid_index = begin; grid_index < end; ++grid_index) {
+        const int train_index = grid_ptr->keypoint_indices[grid_index];
+        const float du = train_keypoints_ptr->u[train_index] - predicted_u;
+        const float dv = train_keypoints_ptr->v[train_index] - predicted_v;
+        if (du * du + dv * dv > radius_squared) {
+          continue;
+        }
+
+        const int distance = hamming_distance(query_ptr, get_descriptor_ptr(train_index, train_descriptors_ptr));
+        merge_query_best(best_ptr, distance, no_match_distance, train_index);
+        if (distance < train_best_distance[train_index]) {
+          train_best_distance[train_index] = distance;
+          train_best_query[train_index] = query_index;
+        }
+      }
+    }
+  }
+
+  collect_matches(matches_ptr, query_best, train_best_query, parameters);
+}
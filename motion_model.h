@@ -0,0 +1,61 @@
+#pragma once
+
+#include "linalg.h"
+
+// Constant velocity model over world-to-camera poses. The motion between the
+// last two poses is stored as a twist per second and extrapolated on SE(3)
+// over the time to the next frame, so dropped frames do not break the
+// prediction and the camera keeps moving along the same screw.
+struct MotionModel {
+  int pose_count;
+  double last_timestamp;
+  Pose last_pose;
+  Vec6 velocity;
+};
+
+struct MotionModelParameters {
+  // Matcher search radius in pixels without and with a velocity estimate.
+  float search_radius = 32.0f;
+  float predicted_search_radius = 12.0f;
+};
+
+void reset_motion_model(MotionModel* model_ptr) {
+  *model_ptr = {};
+}
+
+void update_motion_model(MotionModel* model_ptr, const Mat3& rotation, const Vec3& translation, double timestamp) {
+  if (model_ptr->pose_count > 0 && timestamp > model_ptr->last_timestamp) {
+    // Motion T_k * T_{k-1}^-1 between the previous and the new pose.
+    const Pose delta = Pose{ rotation, translation } * inverse(model_ptr->last_pose);
+    model_ptr->velocity = (1.0 / (timestamp - model_ptr->last_timestamp)) * log_se3(delta);
+  }
+  model_ptr->last_timestamp = timestamp;
+  model_ptr->last_pose = { rotation, translation };
+  ++model_ptr->pose_count;
+}
+
+// Pose expected at timestamp. With a single pose so far the camera is
+// assumed static. Returns false before the first pose.
+bool predict_pose(Mat3* rotation_ptr, Vec3* translation_ptr, const MotionModel* model_ptr, double timestamp) {
+  if (model_ptr->pose_count == 0) {
+    return false;
+  }
+
+  Pose pose = model_ptr->last_pose;
+  if (model_ptr->pose_count > 1) {
+    pose = exp_se3((timestamp - model_ptr->last_timestamp) * model_ptr->velocity) * pose;
+  }
+  *rotation_ptr = pose.rotation;
+  *translation_ptr = pose.translation;
+  return true;
+}
+
+bool has_velocity(const MotionModel* model_ptr) {
+  return model_ptr->pose_count >= 2;
+}
+
+// A velocity estimate puts projected points within a few pixels of their
+// match, so the search window shrinks.
+float get_search_radius(const MotionModel* model_ptr, const MotionModelParameters& parameters = {}) {
+  return has_velocity(model_ptr) ? parameters.predicted_search_radius : parameters.search_radius;
+}
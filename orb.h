@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "fast.h"
+#include "image.h"
+
+// 256 bit descriptors, one 32 byte row per keypoint. The buffer is 32 byte
+// aligned so every row can be loaded with a single aligned AVX2 load.
+constexpr int descriptor_size = 32;
+
+struct Descriptors {
+  int count;
+  int capacity;
+  unsigned char* data_ptr;
+};
+
+void reserve_descriptors(Descriptors* descriptors_ptr, int capacity) {
+  if (capacity <= descriptors_ptr->capacity) {
+    return;
+  }
+
+  unsigned char* data_ptr = (unsigned char*)std::aligned_alloc(32, descriptor_size * capacity);
+  if (descriptors_ptr->data_ptr != nullptr) {
+    std::memcpy(data_ptr, descriptors_ptr->data_ptr, descriptor_size * descriptors_ptr->count);
+    std::free(descriptors_ptr->data_ptr);
+  }
+
+  descriptors_ptr->data_ptr = data_ptr;
+  descriptors_ptr->capacity = capacity;
+}
+
+void free_descriptors(Descriptors* descriptors_ptr) {
+  std::free(descriptors_ptr->data_ptr);
+  *descriptors_ptr = {};
+}
+
+const unsigned char* get_descriptor_ptr(int index, const Descriptors* descriptors_ptr) {
+  return descriptors_ptr->data_ptr + descriptor_size * index;
+}
+
+constexpr int orb_patch_radius = 15;
+constexpr int orb_border = orb_patch_radius + 1;
+constexpr int orb_pair_count = 8 * descriptor_size;
+constexpr int orb_angle_bins = 30;
+
+// Test pairs for every discretized orientation, stored as (u_a, v_a, u_b, v_b).
+struct OrbPattern {
+  signed char pairs[orb_angle_bins][orb_pair_count][4];
+  int umax[orb_patch_radius + 1];
+};
+
+// Pairs are drawn i.i.d. from an isotropic Gaussian with sigma = patch_size / 5
+// (BRIEF G II) with a fixed seed, and kept inside the patch disc so every
+// rotated copy stays within orb_patch_radius.
+void init_orb_pattern(OrbPattern* pattern_ptr) {
+  uint32_t state = 0x9e3779b9;
+  auto next_uniform = [&state]() {
+    state = state * 1664525u + 1013904223u;
+    return ((state >> 8) + 0.5f) / float(1 << 24);
+  };
+  auto next_gaussian = [&next_uniform]() {
+    const float r = std::sqrt(-2.0f * std::log(next_uniform()));
+    return r * std::cos(6.2831853f * next_uniform());
+  };
+
+  constexpr float sigma = (2 * orb_patch_radius + 1) / 5.0f;
+  constexpr float max_radius = orb_patch_radius - 1.0f;
+
+  float base_pairs[orb_pair_count][4];
+  for (int pair_index = 0; pair_index < orb_pair_count; ++pair_index) {
+    for (int point_index = 0; point_index < 2; ++point_index) {
+      float u, v;
+      do {
+        u = sigma * next_gaussian();
+        v = sigma * next_gaussian();
+      } while (u * u + v * v > max_radius * max_radius);
+      base_pairs[pair_index][2 * point_index + 0] = u;
+      base_pairs[pair_index][2 * point_index + 1] = v;
+    }
+  }
+
+  for (int angle_bin = 0; angle_bin < orb_angle_bins; ++angle_bin) {
+    const float angle = angle_bin * (6.2831853f / orb_angle_bins);
+    const float c = std::cos(angle);
+    const float s = std::sin(angle);
+    for (int pair_index = 0; pair_index < orb_pair_count; ++pair_index) {
+      for (int point_index = 0; point_index < 2; ++point_index) {
+        const float u = base_pairs[pair_index][2 * point_index + 0];
+        const float v = base_pairs[pair_index][2 * point_index + 1];
+        pattern_ptr->pairs[angle_bin][pair_index][2 * point_index + 0] = std::lround(c * u - s * v);
+        pattern_ptr->pairs[angle_bin][pair_index][2 * point_index + 1] = std::lround(s * u + c * v);
+      }
+    }
+  }
+
+  // Half widths of the circular orientation patch per row.
+  for (int v = 0; v <= orb_patch_radius; ++v) {
+    pattern_ptr->umax[v] = std::lround(std::sqrt(float(orb_patch_radius * orb_patch_radius - v * v)));
+  }
+}
+
+// Drops keypoints whose patch would leave the image.
+void remove_border_keypoints(Keypoints* keypoints_ptr, int width, int height, int border) {
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+  int write_index = 0;
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    const float u = keypoints_ptr->u[keypoint_index];
+    const float v = keypoints_ptr->v[keypoint_index];
+    if (u < border || v < border || u >= width - border || v >= height - border) {
+      continue;
+    }
+    keypoints_ptr->u[write_index] = u;
+    keypoints_ptr->v[write_index] = v;
+    keypoints_ptr->score[write_index] = keypoints_ptr->score[keypoint_index];
+    keypoints_ptr->angle[write_index] = keypoints_ptr->angle[keypoint_index];
+    ++write_index;
+  }
+  keypoints_ptr->u.resize(write_index);
+  keypoints_ptr->v.resize(write_index);
+  keypoints_ptr->score.resize(write_index);
+  keypoints_ptr->angle.resize(write_index);
+}
+
+// Intensity centroid orientation over a disc of radius orb_patch_radius.
+void compute_keypoint_orientations(Keypoints* keypoints_ptr,
+                                   const Image* grey_image_ptr,
+                                   const OrbPattern* pattern_ptr) {
+  const int width = grey_image_ptr->width;
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    const int u = std::lround(keypoints_ptr->u[keypoint_index]);
+    const int v = std::lround(keypoints_ptr->v[keypoint_index]);
+    const unsigned char* center_ptr = get_pixel_ptr(u, v, grey_image_ptr);
+
+    int m10 = 0;
+    int m01 = 0;
+
+    for (int du = -orb_patch_radius; du <= orb_patch_radius; ++du) {
+      m10 += du * center_ptr[du];
+    }
+
+    // Rows above and below the center are handled as symmetric pairs.
+    for (int dv = 1; dv <= orb_patch_radius; ++dv) {
+      const int umax = pattern_ptr->umax[dv];
+      int row_sum = 0;
+      for (int du = -umax; du <= umax; ++du) {
+        const int below = center_ptr[dv * width + du];
+        const int above = center_ptr[-dv * width + du];
+        row_sum += below - above;
+        m10 += du * (below + above);
+      }
+      m01 += dv * row_sum;
+    }
+
+    keypoints_ptr->angle[keypoint_index] = std::atan2(float(m01), float(m10));
+  }
+}
+
+// Steered BRIEF on the smoothed image. Keypoints too close to the border are
+// removed first, so afterwards descriptor row i belongs to keypoint i.
+void compute_orb_descriptors(Descriptors* descriptors_ptr,
+                             Keypoints* keypoints_ptr,
+                             const Image* grey_image_ptr,
+                             const Image* smoothed_image_ptr,
+                             const OrbPattern* pattern_ptr) {
+  const int width = grey_image_ptr->width;
+
+  remove_border_keypoints(keypoints_ptr, grey_image_ptr->width, grey_image_ptr->height, orb_border);
+  compute_keypoint_orientations(keypoints_ptr, grey_image_ptr, pattern_ptr);
+
+  const int keypoint_count = get_keypoint_count(keypoints_ptr);
+  reserve_descriptors(descriptors_ptr, keypoint_count);
+  descriptors_ptr->count = keypoint_count;
+
+  constexpr float bins_per_radian = orb_angle_bins / 6.2831853f;
+
+  for (int keypoint_index = 0; keypoint_index < keypoint_count; ++keypoint_index) {
+    const int u = std::lround(keypoints_ptr->u[keypoint_index]);
+    const int v = std::lround(keypoints_ptr->v[keypoint_index]);
+    const unsigned char* center_ptr = get_pixel_ptr(u, v, smoothed_image_ptr);
+
+    int angle_bin = std::lround(keypoints_ptr->angle[keypoint_index] * bins_per_radian);
+    angle_bin = ((angle_bin % orb_angle_bins) + orb_angle_bins) % orb_angle_bins;
+    const signed char (*pairs)[4] = pattern_ptr->pairs[angle_bin];
+
+    unsigned char* descriptor_ptr = descriptors_ptr->data_ptr + descriptor_size * keypoint_index;
+
+    for (int byte_index = 0; byte_index < descriptor_size; ++byte_index) {
+      unsigned char byte = 0;
+      for (int bit_index = 0; bit_index < 8; ++bit_index) {
+        const signed char* pair = pairs[8 * byte_index + bit_index];
+        const int a = center_ptr[pair[1] * width + pair[0]];
+        const int b = center_ptr[pair[3] * width + pair[2]];
+        byte |= (a < b) << bit_index;
+      }
+      descriptor_ptr[byte_index] = byte;
+    }
+  }
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+// Univariate polynomials as coefficient arrays, index i holds the coefficient
+// of x^i.
+
+double evaluate_polynomial(const double* coefficients_ptr, int degree, double x) {
+  double value = coefficients_ptr[degree];
+  for (int i = degree - 1; i >= 0; --i) {
+    value = value * x + coefficients_ptr[i];
+  }
+  return value;
+}
+
+void multiply_polynomials(double* product_ptr, const double* a_ptr, int a_degree, const double* b_ptr, int b_degree) {
+  for (int i = 0; i <= a_degree + b_degree; ++i) {
+    product_ptr[i] = 0.0;
+  }
+  for (int i = 0; i <= a_degree; ++i) {
+    for (int j = 0; j <= b_degree; ++j) {
+      product_ptr[i + j] += a_ptr[i] * b_ptr[j];
+    }
+  }
+}
+
+// Remainder of a / b, both given by their degree. Returns the degree of the
+// remainder or -1 when it vanishes.
+int polynomial_remainder(double* remainder_ptr, const double* a_ptr, int a_degree, const double* b_ptr, int b_degree) {
+  double work[32];
+  for (int i = 0; i <= a_degree; ++i) {
+    work[i] = a_ptr[i];
+  }
+
+  for (int i = a_degree; i >= b_degree; --i) {
+    const double factor = work[i] / b_ptr[b_degree];
+    for (int j = 0; j <= b_degree; ++j) {
+      work[i - b_degree + j] -= factor * b_ptr[j];
+    }
+  }
+
+  int degree = b_degree - 1;
+  double scale = 0.0;
+  for (int i = 0; i <= a_degree; ++i) {
+    scale = std::fmax(scale, std::fabs(a_ptr[i]));
+  }
+  while (degree >= 0 && std::fabs(work[degree]) <= 1e-14 * scale) {
+    --degree;
+  }
+  for (int i = 0; i <= degree; ++i) {
+    remainder_ptr[i] = work[i];
+  }
+  return degree;
+}
+
+constexpr int max_polynomial_degree = 16;
+
+// Sturm sequence p0 = p, p1 = p', p(i+1) = -rem(p(i-1), p(i)).
+struct SturmSequence {
+  int count;
+  int degrees[max_polynomial_degree + 1];
+  double coefficients[max_polynomial_degree + 1][max_polynomial_degree + 1];
+};
+
+void build_sturm_sequence(SturmSequence* sequence_ptr, const double* coefficients_ptr, int degree) {
+  for (int i = 0; i <= degree; ++i) {
+    sequence_ptr->coefficients[0][i] = coefficients_ptr[i];
+  }
+  sequence_ptr->degrees[0] = degree;
+
+  for (int i = 1; i <= degree; ++i) {
+    sequence_ptr->coefficients[1][i - 1] = i * coefficients_ptr[i];
+  }
+  sequence_ptr->degrees[1] = degree - 1;
+  sequence_ptr->count = 2;
+
+  while (sequence_ptr->degrees[sequence_ptr->count - 1] > 0) {
+    const int last = sequence_ptr->count - 1;
+    double* next_ptr = sequence_ptr->coefficients[last + 1];
+    const int next_degree = polynomial_remainder(next_ptr,
+                                                 sequence_ptr->coefficients[last - 1], sequence_ptr->degrees[last - 1],
+                                                 sequence_ptr->coefficients[last], sequence_ptr->degrees[last]);
+    if (next_degree < 0) {
+      break;
+    }
+    for (int i = 0; i <= next_degree; ++i) {
+      next_ptr[i] = -next_ptr[i];
+    }
+    sequence_ptr->degrees[last + 1] = next_degree;
+    ++sequence_ptr->count;
+  }
+}
+
+int count_sign_changes(const SturmSequence* sequence_ptr, double x) {
+  int changes = 0;
+  double previous = 0.0;
+  for (int i = 0; i < sequence_ptr->count; ++i) {
+    const double value = evaluate_polynomial(sequence_ptr->coefficients[i], sequence_ptr->degrees[i], x);
+    if (value == 0.0) {
+      continue;
+    }
+    if (previous != 0.0 && (value > 0.0) != (previous > 0.0)) {
+      ++changes;
+    }
+    previous = value;
+  }
+  return changes;
+}
+
+// Refines the single root of p in [a, b] by bisection safeguarded Newton steps.
+double refine_polynomial_root(const double* coefficients_ptr, int degree, double a, double b) {
+  double derivative[max_polynomial_degree];
+  for (int i = 1; i <= degree; ++i) {
+    derivative[i - 1] = i * coefficients_ptr[i];
+  }
+
+  double value_a = evaluate_polynomial(coefficients_ptr, degree, a);
+  double x = 0.5 * (a + b);
+
+  for (int iteration = 0; iteration < 100; ++iteration) {
+    const double value = evaluate_polynomial(coefficients_ptr, degree, x);
+    if (value == 0.0) {
+      return x;
+    }
+    if ((value > 0.0) == (value_a > 0.0)) {
+      a = x;
+      value_a = value;
+    } else {
+      b = x;
+    }
+
+    const double slope = evaluate_polynomial(derivative, degree - 1, x);
+    double next = slope != 0.0 ? x - value / slope : 0.5 * (a + b);
+    if (!(next > a && next < b)) {
+      next = 0.5 * (a + b);
+    }
+    if (std::fabs(next - x) <= 1e-14 * std::fmax(1.0, std::fabs(x))) {
+      return next;
+    }
+    x = next;
+  }
+  return x;
+}
+
+// All distinct real roots of a polynomial, isolated with a Sturm sequence.
+void find_real_roots(std::vector<double>* roots_ptr, const double* coefficients_ptr, int degree) {
+  roots_ptr->clear();
+
+  while (degree > 0 && coefficients_ptr[degree] == 0.0) {
+    --degree;
+  }
+  if (degree <= 0) {
+    return;
+  }
+
+  // Cauchy bound on the magnitude of all roots.
+  double bound = 0.0;
+  for (int i = 0; i < degree; ++i) {
+    bound = std::fmax(bound, std::fabs(coefficients_ptr[i] / coefficients_ptr[degree]));
+  }
+  bound += 1.0;
+
+  SturmSequence sequence;
+  build_sturm_sequence(&sequence, coefficients_ptr, degree);
+
+  struct Interval {
+    double a;
+    double b;
+    int changes_a;
+    int changes_b;
+  };
+
+  Interval stack[128];
+  int stack_size = 0;
+  stack[stack_size++] = { -bound, bound, count_sign_changes(&sequence, -bound), count_sign_changes(&sequence, bound) };
+
+  while (stack_size > 0) {
+    const Interval interval = stack[--stack_size];
+    const int root_count = interval.changes_a - interval.changes_b;
+    if (root_count <= 0) {
+      continue;
+    }
+    if (root_count == 1) {
+      roots_ptr->push_back(refine_polynomial_root(coefficients_ptr, degree, interval.a, interval.b));
+      continue;
+    }
+    if (interval.b - interval.a < 1e-12 * std::fmax(1.0, std::fabs(interval.a))) {
+      // Clustered roots, report the cluster once.
+      roots_ptr->push_back(0.5 * (interval.a + interval.b));
+      continue;
+    }
+    if (stack_size + 2 > 128) {
+      continue;
+    }
+    const double middle = 0.5 * (interval.a + interval.b);
+    const int changes_middle = count_sign_changes(&sequence, middle);
+    stack[stack_size++] = { interval.a, middle, interval.changes_a, changes_middle };
+    stack[stack_size++] = { middle, interval.b, changes_middle, interval.changes_b };
+  }
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "linalg.h"
+#include "sparse_cholesky.h"
+
+// Pose graph over keyframe poses, world to camera, with relative pose edges.
+// An edge from a to b measures T_b * T_a^-1, the motion from camera a to
+// camera b, and its residual is log(T_b * T_a^-1 * Z^-1).
+struct PoseGraphProblem {
+  std::vector<Pose> poses;
+  // At least one pose must be fixed to pin the gauge.
+  std::vector<unsigned char> fixed;
+  std::vector<int> edge_from;
+  std::vector<int> edge_to;
+  std::vector<Pose> edge_measurements;
+  std::vector<double> edge_weights;
+};
+
+struct PoseGraphParameters {
+  int max_iterations = 20;
+  double initial_lambda = 1e-6;
+};
+
+struct PoseGraphResult {
+  int iteration_count;
+  double initial_cost;
+  double final_cost;
+};
+
+int add_pose_graph_node(PoseGraphProblem* problem_ptr, const Pose& pose, bool fixed) {
+  problem_ptr->poses.push_back(pose);
+  problem_ptr->fixed.push_back(fixed);
+  return int(problem_ptr->poses.size()) - 1;
+}
+
+void add_pose_graph_edge(PoseGraphProblem* problem_ptr, int from, int to, const Pose& measurement, double weight = 1.0) {
+  problem_ptr->edge_from.push_back(from);
+  problem_ptr->edge_to.push_back(to);
+  problem_ptr->edge_measurements.push_back(measurement);
+  problem_ptr->edge_weights.push_back(weight);
+}
+
+// Adjoint of a pose on twists ordered (w, v): [R 0; [t]x R R].
+Mat6 get_adjoint(const Pose& pose) {
+  const Mat3 tr = skew(pose.translation) * pose.rotation;
+  Mat6 adjoint = {};
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      adjoint.m[row][column] = pose.rotation.m[row][column];
+      adjoint.m[row + 3][column + 3] = pose.rotation.m[row][column];
+      adjoint.m[row + 3][column] = tr.m[row][column];
+    }
+  }
+  return adjoint;
+}
+
+// First order inverse left Jacobian of SE(3), I - ad(r) / 2, which keeps the
+// Jacobians accurate for the large residuals of a fresh loop.
+Mat6 get_inverse_left_jacobian(const Vec6& residual) {
+  const Mat3 w = skew(get_head(residual));
+  const Mat3 v = skew(get_tail(residual));
+  Mat6 jacobian = identity6();
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      jacobian.m[row][column] -= 0.5 * w.m[row][column];
+      jacobian.m[row + 3][column + 3] -= 0.5 * w.m[row][column];
+      jacobian.m[row + 3][column] -= 0.5 * v.m[row][column];
+    }
+  }
+  return jacobian;
+}
+
+// c += weight * a^T * b.
+void add_weighted_product(Mat6* c_ptr, const Mat6& a, const Mat6& b, double weight) {
+  for (int row = 0; row < 6; ++row) {
+    for (int column = 0; column < 6; ++column) {
+      double value = 0.0;
+      for (int k = 0; k < 6; ++k) {
+        value += a.m[k][row] * b.m[k][column];
+      }
+      c_ptr->m[row][column] += weight * value;
+    }
+  }
+}
+
+Vec6 get_pose_graph_residual(const PoseGraphProblem* problem_ptr, const std::vector<Pose>& poses, int edge) {
+  const Pose& from = poses[problem_ptr->edge_from[edge]];
+  const Pose& to = poses[problem_ptr->edge_to[edge]];
+  return log_se3(to * inverse(from) * inverse(problem_ptr->edge_measurements[edge]));
+}
+
+double compute_pose_graph_cost(const PoseGraphProblem* problem_ptr, const std::vector<Pose>& poses) {
+  double cost = 0.0;
+  for (int edge = 0; edge < int(problem_ptr->edge_from.size()); ++edge) {
+    const Vec6 residual = get_pose_graph_residual(problem_ptr, poses, edge);
+    cost += problem_ptr->edge_weights[edge] * dot(residual, residual);
+  }
+  return cost;
+}
+
+// Levenberg-Marquardt with every pose updated on the left, T <- exp(delta) T.
+// The normal equations have one 6x6 block per free pose and per edge, so
+// they are solved with the block sparse Cholesky in minimum degree order.
+void run_pose_graph_optimization(PoseGraphResult* result_ptr,
+                                 PoseGraphProblem* problem_ptr,
+                                 const PoseGraphParameters& parameters = {}) {
+  const int pose_count = int(problem_ptr->poses.size());
+  const int edge_count = int(problem_ptr->edge_from.size());
+
+  std::vector<int> free_indices(pose_count, -1);
+  int free_count = 0;
+  for (int pose_index = 0; pose_index < pose_count; ++pose_index) {
+    if (!problem_ptr->fixed[pose_index]) {
+      free_indices[pose_index] = free_count++;
+    }
+  }
+
+  std::vector<int> pattern_rows;
+  std::vector<int> pattern_columns;
+  for (int edge = 0; edge < edge_count; ++edge) {
+    const int free_from = free_indices[problem_ptr->edge_from[edge]];
+    const int free_to = free_indices[problem_ptr->edge_to[edge]];
+    if (free_from >= 0 && free_to >= 0) {
+      pattern_rows.push_back(free_from);
+      pattern_columns.push_back(free_to);
+    }
+  }
+
+  // Free poses are renumbered in elimination order, from here on a free
+  // index is a block of the system.
+  std::vector<int> order(free_count);
+  compute_minimum_degree_ordering(order.data(), free_count, pattern_rows.data(), pattern_columns.data(),
+                                  int(pattern_rows.size()));
+  std::vector<int> positions(free_count);
+  for (int position = 0; position < free_count; ++position) {
+    positions[order[position]] = position;
+  }
+  for (int& free_index : free_indices) {
+    if (free_index >= 0) {
+      free_index = positions[free_index];
+    }
+  }
+  for (size_t index = 0; index < pattern_rows.size(); ++index) {
+    pattern_rows[index] = positions[pattern_rows[index]];
+    pattern_columns[index] = positions[pattern_columns[index]];
+  }
+
+  BlockSparseMatrix hessian;
+  analyze_block_sparse_pattern(&hessian, free_count, pattern_rows.data(), pattern_columns.data(),
+                               int(pattern_rows.size()));
+
+  std::vector<Mat6> diagonals(free_count);
+  std::vector<Mat6> edge_jacobians_from(edge_count);
+  std::vector<Mat6> edge_jacobians_to(edge_count);
+  std::vector<Vec6> residuals(edge_count);
+  std::vector<double> gradient(6 * free_count);
+  std::vector<double> delta(6 * free_count);
+  std::vector<Pose> candidate_poses;
+
+  double cost = compute_pose_graph_cost(problem_ptr, problem_ptr->poses);
+  *result_ptr = {};
+  result_ptr->initial_cost = cost;
+
+  double lambda = parameters.initial_lambda;
+  bool converged = free_count == 0;
+  while (!converged && result_ptr->iteration_count < parameters.max_iterations) {
+    ++result_ptr->iteration_count;
+    std::fill(diagonals.begin(), diagonals.end(), Mat6{});
+    std::fill(gradient.begin(), gradient.end(), 0.0);
+
+    for (int edge = 0; edge < edge_count; ++edge) {
+      const Pose& from = problem_ptr->poses[problem_ptr->edge_from[edge]];
+      const Pose& to = problem_ptr->poses[problem_ptr->edge_to[edge]];
+      const Vec6 residual = get_pose_graph_residual(problem_ptr, problem_ptr->poses, edge);
+      const Mat6 inverse_jacobian = get_inverse_left_jacobian(residual);
+      residuals[edge] = residual;
+      edge_jacobians_to[edge] = inverse_jacobian;
+      edge_jacobians_from[edge] = -1.0 * (inverse_jacobian * get_adjoint(to * inverse(from)));
+    }
+
+    // J^T W J and J^T W r. Diagonal blocks are kept apart so damping can be
+    // applied without linearizing again.
+    clear_block_sparse_values(&hessian);
+    for (int edge = 0; edge < edge_count; ++edge) {
+      const double weight = problem_ptr->edge_weights[edge];
+      const int free_from = free_indices[problem_ptr->edge_from[edge]];
+      const int free_to = free_indices[problem_ptr->edge_to[edge]];
+      const Mat6& jacobian_from = edge_jacobians_from[edge];
+      const Mat6& jacobian_to = edge_jacobians_to[edge];
+      const Vec6& residual = residuals[edge];
+      if (free_from >= 0) {
+        add_weighted_product(&diagonals[free_from], jacobian_from, jacobian_from, weight);
+        const Vec6 g = transpose(jacobian_from) * residual;
+        for (int k = 0; k < 6; ++k) {
+          gradient[6 * free_from + k] += weight * g.v[k];
+        }
+      }
+      if (free_to >= 0) {
+        add_weighted_product(&diagonals[free_to], jacobian_to, jacobian_to, weight);
+        const Vec6 g = transpose(jacobian_to) * residual;
+        for (int k = 0; k < 6; ++k) {
+          gradient[6 * free_to + k] += weight * g.v[k];
+        }
+      }
+      if (free_from >= 0 && free_to >= 0) {
+        // Lower triangle block (larger index, smaller index).
+        if (free_from > free_to) {
+          add_weighted_product(get_block_ptr(&hessian, free_from, free_to), jacobian_from, jacobian_to, weight);
+        } else {
+          add_weighted_product(get_block_ptr(&hessian, free_to, free_from), jacobian_to, jacobian_from, weight);
+        }
+      }
+    }
+    // The factorization overwrites the matrix, keep the off-diagonal blocks.
+    const std::vector<Mat6> off_diagonals = hessian.blocks;
+
+    bool accepted = false;
+    while (!accepted && lambda < 1e8) {
+      hessian.blocks = off_diagonals;
+      for (int free_index = 0; free_index < free_count; ++free_index) {
+        Mat6 damped = diagonals[free_index];
+        for (int k = 0; k < 6; ++k) {
+          damped.m[k][k] += lambda * damped.m[k][k] + 1e-12;
+        }
+        hessian.blocks[hessian.column_offsets[free_index]] = damped;
+      }
+      if (!factor_block_sparse(&hessian)) {
+        lambda *= 10.0;
+        continue;
+      }
+      for (int k = 0; k < 6 * free_count; ++k) {
+        delta[k] = -gradient[k];
+      }
+      solve_block_sparse(&hessian, delta.data());
+
+      // Once the steps are this small the cost is at rounding level and
+      // would only be rejected at ever larger damping.
+      double step_squared = 0.0;
+      for (const double value : delta) {
+        step_squared = std::max(step_squared, value * value);
+      }
+      if (step_squared < 1e-20) {
+        break;
+      }
+
+      candidate_poses = problem_ptr->poses;
+      for (int pose_index = 0; pose_index < pose_count; ++pose_index) {
+        const int free_index = free_indices[pose_index];
+        if (free_index < 0) {
+          continue;
+        }
+        Vec6 step;
+        std::copy(delta.begin() + 6 * free_index, delta.begin() + 6 * free_index + 6, step.v);
+        candidate_poses[pose_index] = exp_se3(step) * candidate_poses[pose_index];
+      }
+
+      const double candidate_cost = compute_pose_graph_cost(problem_ptr, candidate_poses);
+      if (candidate_cost < cost) {
+        accepted = true;
+        const double decrease = cost - candidate_cost;
+        cost = candidate_cost;
+        problem_ptr->poses.swap(candidate_poses);
+        lambda = std::max(lambda * 0.1, 1e-12);
+        converged = decrease < 1e-6 * cost || cost < 1e-20;
+      } else {
+        lambda *= 10.0;
+      }
+    }
+
+    converged |= !accepted;
+  }
+
+  result_ptr->final_cost = cost;
+}
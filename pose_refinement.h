@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cmath>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "absolute_pose.h"
+#include "linalg.h"
+
+// Motion-only refinement of an absolute pose: Gauss-Newton on the robust
+// reprojection error of the inliers with the 3D points held fixed.
+
+struct PoseRefinementParameters {
+  int max_iterations = 10;
+  // Residual norm where the Huber loss turns from quadratic to linear, in
+  // normalized image coordinates.
+  float huber_threshold = 0.002f;
+  // Inlier test applied after refinement, like the RANSAC threshold.
+  float inlier_threshold = 0.004f;
+};
+
+// Huber weighted normal equations J^T W J and J^T W r of the masked
+// observations in one pass, 8 observations per step. The pose update is
+// ordered (w, v) and applied on the left, R <- exp(w) R, t <- exp(w) t + v.
+// Returns the robust cost at the given pose.
+double accumulate_pose_normal_equations(Mat6* hessian_ptr,
+                                         Vec6* gradient_ptr,
+                                         const Mat3& rotation,
+                                         const Vec3& translation,
+                                         const float* point_x_ptr,
+                                         const float* point_y_ptr,
+                                         const float* point_z_ptr,
+                                         const float* x_ptr,
+                                         const float* y_ptr,
+                                         const unsigned char* mask_ptr,
+                                         int count,
+                                         float huber_threshold) {
+  float r[9];
+  for (int k = 0; k < 9; ++k) {
+    r[k] = float(rotation.m[k / 3][k % 3]);
+  }
+  const float t[3] = { float(translation.x), float(translation.y), float(translation.z) };
+
+  // Upper triangle of the 6x6 Hessian row by row, then the gradient.
+  float sums[27] = {};
+  double cost = 0.0;
+  int index = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  const __m256 r00 = _mm256_set1_ps(r[0]), r01 = _mm256_set1_ps(r[1]), r02 = _mm256_set1_ps(r[2]);
+  const __m256 r10 = _mm256_set1_ps(r[3]), r11 = _mm256_set1_ps(r[4]), r12 = _mm256_set1_ps(r[5]);
+  const __m256 r20 = _mm256_set1_ps(r[6]), r21 = _mm256_set1_ps(r[7]), r22 = _mm256_set1_ps(r[8]);
+  const __m256 t0 = _mm256_set1_ps(t[0]), t1 = _mm256_set1_ps(t[1]), t2 = _mm256_set1_ps(t[2]);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 threshold = _mm256_set1_ps(huber_threshold);
+  const __m256 threshold_squared = _mm256_set1_ps(huber_threshold * huber_threshold);
+
+  __m256 vector_sums[27];
+  for (__m256& sum : vector_sums) {
+    sum = _mm256_setzero_ps();
+  }
+  __m256 vector_cost = _mm256_setzero_ps();
+
+  for (; index + 8 <= count; index += 8) {
+    const __m256 px = _mm256_loadu_ps(point_x_ptr + index);
+    const __m256 py = _mm256_loadu_ps(point_y_ptr + index);
+    const __m256 pz = _mm256_loadu_ps(point_z_ptr + index);
+    const __m256i mask = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask_ptr + index)));
+
+    const __m256 cx = _mm256_fmadd_ps(r00, px, _mm256_fmadd_ps(r01, py, _mm256_fmadd_ps(r02, pz, t0)));
+    const __m256 cy = _mm256_fmadd_ps(r10, px, _mm256_fmadd_ps(r11, py, _mm256_fmadd_ps(r12, pz, t1)));
+    const __m256 cz = _mm256_fmadd_ps(r20, px, _mm256_fmadd_ps(r21, py, _mm256_fmadd_ps(r22, pz, t2)));
+
+    const __m256 valid = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(mask, _mm256_setzero_si256())),
+                                       _mm256_cmp_ps(cz, zero, _CMP_GT_OQ));
+    const __m256 inverse_z = _mm256_blendv_ps(zero, _mm256_div_ps(one, cz), valid);
+    const __m256 u = _mm256_mul_ps(cx, inverse_z);
+    const __m256 v = _mm256_mul_ps(cy, inverse_z);
+    const __m256 ru = _mm256_sub_ps(u, _mm256_loadu_ps(x_ptr + index));
+    const __m256 rv = _mm256_sub_ps(v, _mm256_loadu_ps(y_ptr + index));
+
+    // Huber weight and cost, zero for masked out or invalid observations.
+    const __m256 squared_norm = _mm256_fmadd_ps(ru, ru, _mm256_mul_ps(rv, rv));
+    const __m256 residual_norm = _mm256_sqrt_ps(squared_norm);
+    const __m256 quadratic = _mm256_cmp_ps(squared_norm, threshold_squared, _CMP_LE_OQ);
+    __m256 weight = _mm256_blendv_ps(_mm256_div_ps(threshold, residual_norm), one, quadratic);
+    weight = _mm256_and_ps(weight, valid);
+    __m256 observation_cost = _mm256_blendv_ps(_mm256_mul_ps(threshold, _mm256_fnmadd_ps(half, threshold, residual_norm)),
+                                               _mm256_mul_ps(half, squared_norm), quadratic);
+    vector_cost = _mm256_add_ps(vector_cost, _mm256_and_ps(observation_cost, valid));
+
+    const __m256 uv = _mm256_mul_ps(u, v);
+    const __m256 a[6] = {
+      _mm256_sub_ps(zero, uv), _mm256_fmadd_ps(u, u, one), _mm256_sub_ps(zero, v),
+      inverse_z, zero, _mm256_sub_ps(zero, _mm256_mul_ps(u, inverse_z)),
+    };
+    const __m256 b[6] = {
+      _mm256_sub_ps(zero, _mm256_fmadd_ps(v, v, one)), uv, u,
+      zero, inverse_z, _mm256_sub_ps(zero, _mm256_mul_ps(v, inverse_z)),
+    };
+
+    int sum_index = 0;
+    for (int row = 0; row < 6; ++row) {
+      const __m256 weighted_a = _mm256_mul_ps(weight, a[row]);
+      const __m256 weighted_b = _mm256_mul_ps(weight, b[row]);
+      for (int column = row; column < 6; ++column) {
+        vector_sums[sum_index] = _mm256_fmadd_ps(weighted_a, a[column], _mm256_fmadd_ps(weighted_b, b[column], vector_sums[sum_index]));
+        ++sum_index;
+      }
+    }
+    for (int row = 0; row < 6; ++row) {
+      vector_sums[21 + row] = _mm256_fmadd_ps(_mm256_mul_ps(weight, a[row]), ru,
+                                              _mm256_fmadd_ps(_mm256_mul_ps(weight, b[row]), rv, vector_sums[21 + row]));
+    }
+  }
+
+  for (int k = 0; k < 27; ++k) {
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, vector_sums[k]);
+    for (const float lane : lanes) {
+      sums[k] += lane;
+    }
+  }
+  alignas(32) float cost_lanes[8];
+  _mm256_store_ps(cost_lanes, vector_cost);
+  for (const float lane : cost_lanes) {
+    cost += lane;
+  }
+#endif
+
+  for (; index < count; ++index) {
+    if (!mask_ptr[index]) {
+      continue;
+    }
+    const float px = point_x_ptr[index];
+    const float py = point_y_ptr[index];
+    const float pz = point_z_ptr[index];
+    const float cx = r[0] * px + r[1] * py + r[2] * pz + t[0];
+    const float cy = r[3] * px + r[4] * py + r[5] * pz + t[1];
+    const float cz = r[6] * px + r[7] * py + r[8] * pz + t[2];
+    if (cz <= 0.0f) {
+      continue;
+    }
+
+    const float inverse_z = 1.0f / cz;
+    const float u = cx * inverse_z;
+    const float v = cy * inverse_z;
+    const float ru = u - x_ptr[index];
+    const float rv = v - y_ptr[index];
+
+    const float squared_norm = ru * ru + rv * rv;
+    float weight = 1.0f;
+    if (squared_norm <= huber_threshold * huber_threshold) {
+      cost += 0.5f * squared_norm;
+    } else {
+      const float residual_norm = std::sqrt(squared_norm);
+      weight = huber_threshold / residual_norm;
+      cost += huber_threshold * (residual_norm - 0.5f * huber_threshold);
+    }
+
+    const float a[6] = { -u * v, 1.0f + u * u, -v, inverse_z, 0.0f, -u * inverse_z };
+    const float b[6] = { -(1.0f + v * v), u * v, u, 0.0f, inverse_z, -v * inverse_z };
+    int sum_index = 0;
+    for (int row = 0; row < 6; ++row) {
+      for (int column = row; column < 6; ++column) {
+        sums[sum_index++] += weight * (a[row] * a[column] + b[row] * b[column]);
+      }
+    }
+    for (int row = 0; row < 6; ++row) {
+      sums[21 + row] += weight * (a[row] * ru + b[row] * rv);
+    }
+  }
+
+  int sum_index = 0;
+  for (int row = 0; row < 6; ++row) {
+    for (int column = row; column < 6; ++column) {
+      hessian_ptr->m[row][column] = sums[sum_index];
+      hessian_ptr->m[column][row] = sums[sum_index];
+      ++sum_index;
+    }
+    gradient_ptr->v[row] = sums[21 + row];
+  }
+  return cost;
+}
+
+// Refines the pose on its inliers, then re-tests every correspondence with
+// the refined pose, which updates the inlier mask and count. A step that
+// increases the robust cost is undone and ends the iteration.
+void refine_absolute_pose(AbsolutePose* pose_ptr,
+                          const float* point_x_ptr,
+                          const float* point_y_ptr,
+                          const float* point_z_ptr,
+                          const float* x_ptr,
+                          const float* y_ptr,
+                          int count,
+                          const PoseRefinementParameters& parameters = {}) {
+  Mat3 previous_rotation = pose_ptr->rotation;
+  Vec3 previous_translation = pose_ptr->translation;
+  double previous_cost = INFINITY;
+  bool step_unchecked = false;
+
+  for (int iteration = 0; iteration < parameters.max_iterations; ++iteration) {
+    Mat6 hessian;
+    Vec6 gradient;
+    const double cost = accumulate_pose_normal_equations(&hessian, &gradient, pose_ptr->rotation, pose_ptr->translation,
+                                                         point_x_ptr, point_y_ptr, point_z_ptr, x_ptr, y_ptr,
+                                                         pose_ptr->inlier_mask.data(), count, parameters.huber_threshold);
+    step_unchecked = false;
+    if (cost > previous_cost) {
+      pose_ptr->rotation = previous_rotation;
+      pose_ptr->translation = previous_translation;
+      break;
+    }
+
+    Vec6 delta;
+    if (!solve_cholesky(&delta, hessian, -gradient)) {
+      break;
+    }
+
+    previous_rotation = pose_ptr->rotation;
+    previous_translation = pose_ptr->translation;
+    previous_cost = cost;
+    const Mat3 rotation_update = exp_so3(get_head(delta));
+    pose_ptr->rotation = rotation_update * pose_ptr->rotation;
+    pose_ptr->translation = rotation_update * pose_ptr->translation + get_tail(delta);
+    step_unchecked = true;
+
+    if (dot(delta, delta) < 1e-18) {
+      break;
+    }
+  }
+
+  // The loop ended right after a step, which still has to lower the cost.
+  if (step_unchecked) {
+    Mat6 hessian;
+    Vec6 gradient;
+    const double cost = accumulate_pose_normal_equations(&hessian, &gradient, pose_ptr->rotation, pose_ptr->translation,
+                                                         point_x_ptr, point_y_ptr, point_z_ptr, x_ptr, y_ptr,
+                                                         pose_ptr->inlier_mask.data(), count, parameters.huber_threshold);
+    if (cost > previous_cost) {
+      pose_ptr->rotation = previous_rotation;
+      pose_ptr->translation = previous_translation;
+    }
+  }
+
+  const float threshold_squared = parameters.inlier_threshold * parameters.inlier_threshold;
+  int inlier_count = 0;
+  for (int index = 0; index < count; ++index) {
+    const Vec3 camera_point = pose_ptr->rotation * Vec3{ point_x_ptr[index], point_y_ptr[index], point_z_ptr[index] } +
+                              pose_ptr->translation;
+    bool inlier = false;
+    if (camera_point.z > 0.0) {
+      const double dx = camera_point.x / camera_point.z - x_ptr[index];
+      const double dy = camera_point.y / camera_point.z - y_ptr[index];
+      inlier = dx * dx + dy * dy < threshold_squared;
+    }
+    pose_ptr->inlier_mask[index] = inlier;
+    inlier_count += inlier;
+  }
+  pose_ptr->inlier_count = inlier_count;
+}
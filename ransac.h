@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Sampling helpers shared by the RANSAC estimators. Every sample is a pure
+// function of (seed, iteration), so runs are reproducible and iterations can
+// be evaluated in any order.
+
+uint64_t mix_bits(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+constexpr int prosac_max_samples = 200000;
+
+// PROSAC growth schedule. Iteration t draws from the n best correspondences
+// where n is the smallest size with schedule[n] > t.
+void build_prosac_schedule(std::vector<int>* schedule_ptr, int count, int sample_size) {
+  schedule_ptr->assign(count + 1, 0);
+
+  double samples = prosac_max_samples;
+  for (int i = 0; i < sample_size; ++i) {
+    samples *= double(sample_size - i) / double(count - i);
+  }
+
+  int growth = 1;
+  (*schedule_ptr)[sample_size] = growth;
+  for (int n = sample_size; n < count; ++n) {
+    const double next_samples = samples * (n + 1) / (n + 1 - sample_size);
+    growth += std::max(1, int(std::ceil(next_samples - samples)));
+    samples = next_samples;
+    (*schedule_ptr)[n + 1] = std::min(growth, prosac_max_samples);
+  }
+}
+
+// Minimal sample of iteration t. Once the schedule is exhausted samples are
+// uniform over all correspondences.
+void draw_prosac_sample(int* sample_ptr,
+                        int sample_size,
+                        const std::vector<int>* schedule_ptr,
+                        int count,
+                        int iteration,
+                        uint64_t seed) {
+  uint64_t state = mix_bits(seed ^ mix_bits(uint64_t(iteration)));
+  auto next_index = [&state](int range) {
+    state = mix_bits(state);
+    return int(((state >> 32) * uint64_t(range)) >> 32);
+  };
+
+  const int n = int(std::upper_bound(schedule_ptr->begin() + sample_size, schedule_ptr->end(), iteration) -
+                    schedule_ptr->begin());
+  int drawn = 0;
+  int range = count;
+  if (n <= count) {
+    // The newest correspondence joins every sample drawn at this size.
+    sample_ptr[drawn++] = n - 1;
+    range = n - 1;
+  }
+
+  while (drawn < sample_size) {
+    const int index = next_index(range);
+    bool duplicate = false;
+    for (int i = 0; i < drawn; ++i) {
+      duplicate |= sample_ptr[i] == index;
+    }
+    if (!duplicate) {
+      sample_ptr[drawn++] = index;
+    }
+  }
+}
+
+// Iterations needed to draw one all-inlier sample with the given confidence.
+int get_required_iterations(int inlier_count, int count, int sample_size, double confidence, int max_iterations) {
+  const double inlier_ratio = double(inlier_count) / count;
+  const double all_inliers = std::pow(inlier_ratio, sample_size);
+  if (all_inliers >= 1.0) {
+    return 0;
+  }
+  if (all_inliers <= 0.0) {
+    return max_iterations;
+  }
+  const double iterations = std::log(1.0 - confidence) / std::log(1.0 - all_inliers);
+  return int(std::min(double(max_iterations), std::ceil(iterations)));
+}
@@ -0,0 +1,929 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "linalg.h"
+#include "polynomial.h"
+#include "ransac.h"
+#include "thread_pool.h"
+
+// Relative pose between two views from normalized image coordinates
+// (x, y) = (X / Z, Y / Z). The pose maps points from the first camera into the
+// second, X2 = R * X1 + t, so the essential matrix is E = [t]x * R and every
+// correspondence satisfies x2^T * E * x1 = 0.
+
+// Polynomials in the null space coefficients (x, y, z) of degree one to three.
+// Cubic monomials are ordered as in Nister's paper, so the first ten columns
+// are the ones removed by Gauss-Jordan elimination.
+constexpr int linear_term_count = 4;
+constexpr int quadratic_term_count = 10;
+constexpr int cubic_term_count = 20;
+
+constexpr signed char linear_monomials[linear_term_count][3] = {
+  { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { 0, 0, 0 },
+};
+
+constexpr signed char quadratic_monomials[quadratic_term_count][3] = {
+  { 2, 0, 0 }, { 0, 2, 0 }, { 0, 0, 2 }, { 1, 1, 0 }, { 1, 0, 1 },
+  { 0, 1, 1 }, { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { 0, 0, 0 },
+};
+
+constexpr signed char cubic_monomials[cubic_term_count][3] = {
+  { 3, 0, 0 }, { 0, 3, 0 }, { 2, 1, 0 }, { 1, 2, 0 }, { 2, 0, 1 },
+  { 2, 0, 0 }, { 0, 2, 1 }, { 0, 2, 0 }, { 1, 1, 1 }, { 1, 1, 0 },
+  { 1, 0, 2 }, { 1, 0, 1 }, { 1, 0, 0 }, { 0, 1, 2 }, { 0, 1, 1 },
+  { 0, 1, 0 }, { 0, 0, 3 }, { 0, 0, 2 }, { 0, 0, 1 }, { 0, 0, 0 },
+};
+
+// Where the product of two terms lands, precomputed from the exponents.
+struct MonomialProductTable {
+  signed char linear_linear[linear_term_count][linear_term_count];
+  signed char quadratic_linear[quadratic_term_count][linear_term_count];
+};
+
+constexpr int find_monomial(const signed char (*monomials)[3], int count, int x, int y, int z) {
+  for (int i = 0; i < count; ++i) {
+    if (monomials[i][0] == x && monomials[i][1] == y && monomials[i][2] == z) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+constexpr MonomialProductTable make_monomial_product_table() {
+  MonomialProductTable table = {};
+  for (int j = 0; j < linear_term_count; ++j) {
+    for (int i = 0; i < linear_term_count; ++i) {
+      table.linear_linear[i][j] = find_monomial(quadratic_monomials, quadratic_term_count,
+                                                linear_monomials[i][0] + linear_monomials[j][0],
+                                                linear_monomials[i][1] + linear_monomials[j][1],
+                                                linear_monomials[i][2] + linear_monomials[j][2]);
+    }
+    for (int i = 0; i < quadratic_term_count; ++i) {
+      table.quadratic_linear[i][j] = find_monomial(cubic_monomials, cubic_term_count,
+                                                   quadratic_monomials[i][0] + linear_monomials[j][0],
+                                                   quadratic_monomials[i][1] + linear_monomials[j][1],
+                                                   quadratic_monomials[i][2] + linear_monomials[j][2]);
+    }
+  }
+  return table;
+}
+
+constexpr MonomialProductTable monomial_products = make_monomial_product_table();
+
+struct LinearPolynomial {
+  double c[linear_term_count];
+};
+
+struct QuadraticPolynomial {
+  double c[quadratic_term_count];
+};
+
+struct CubicPolynomial {
+  double c[cubic_term_count];
+};
+
+QuadraticPolynomial operator*(const LinearPolynomial& a, const LinearPolynomial& b) {
+  QuadraticPolynomial product = {};
+  for (int i = 0; i < linear_term_count; ++i) {
+    for (int j = 0; j < linear_term_count; ++j) {
+      product.c[monomial_products.linear_linear[i][j]] += a.c[i] * b.c[j];
+    }
+  }
+  return product;
+}
+
+CubicPolynomial operator*(const QuadraticPolynomial& a, const LinearPolynomial& b) {
+  CubicPolynomial product = {};
+  for (int i = 0; i < quadratic_term_count; ++i) {
+    for (int j = 0; j < linear_term_count; ++j) {
+      product.c[monomial_products.quadratic_linear[i][j]] += a.c[i] * b.c[j];
+    }
+  }
+  return product;
+}
+
+QuadraticPolynomial operator+(const QuadraticPolynomial& a, const QuadraticPolynomial& b) {
+  QuadraticPolynomial sum;
+  for (int i = 0; i < quadratic_term_count; ++i) {
+    sum.c[i] = a.c[i] + b.c[i];
+  }
+  return sum;
+}
+
+QuadraticPolynomial operator-(const QuadraticPolynomial& a, const QuadraticPolynomial& b) {
+  QuadraticPolynomial difference;
+  for (int i = 0; i < quadratic_term_count; ++i) {
+    difference.c[i] = a.c[i] - b.c[i];
+  }
+  return difference;
+}
+
+CubicPolynomial operator+(const CubicPolynomial& a, const CubicPolynomial& b) {
+  CubicPolynomial sum;
+  for (int i = 0; i < cubic_term_count; ++i) {
+    sum.c[i] = a.c[i] + b.c[i];
+  }
+  return sum;
+}
+
+CubicPolynomial operator-(const CubicPolynomial& a, const CubicPolynomial& b) {
+  CubicPolynomial difference;
+  for (int i = 0; i < cubic_term_count; ++i) {
+    difference.c[i] = a.c[i] - b.c[i];
+  }
+  return difference;
+}
+
+// Orthonormal basis of the null space of the 5x9 epipolar constraint matrix,
+// taken from the last four columns of a Householder QR of its transpose.
+void compute_epipolar_null_space(double basis[4][9], const double rows[5][9]) {
+  double m[9][5];
+  for (int i = 0; i < 5; ++i) {
+    for (int k = 0; k < 9; ++k) {
+      m[k][i] = rows[i][k];
+    }
+  }
+
+  double reflectors[5][9] = {};
+  for (int j = 0; j < 5; ++j) {
+    double length = 0.0;
+    for (int k = j; k < 9; ++k) {
+      length += m[k][j] * m[k][j];
+    }
+    length = std::sqrt(length);
+
+    double* v = reflectors[j];
+    for (int k = j; k < 9; ++k) {
+      v[k] = m[k][j];
+    }
+    v[j] += m[j][j] >= 0.0 ? length : -length;
+
+    double v_norm = 0.0;
+    for (int k = j; k < 9; ++k) {
+      v_norm += v[k] * v[k];
+    }
+    if (v_norm == 0.0) {
+      continue;
+    }
+    for (int k = j; k < 9; ++k) {
+      v[k] /= std::sqrt(v_norm);
+    }
+
+    for (int column = j; column < 5; ++column) {
+      double projection = 0.0;
+      for (int k = j; k < 9; ++k) {
+        projection += v[k] * m[k][column];
+      }
+      for (int k = j; k < 9; ++k) {
+        m[k][column] -= 2.0 * projection * v[k];
+      }
+    }
+  }
+
+  // Q = H0 * H1 * ... * H4, so column i of Q is H0 * (H1 * ... (H4 * e_i)).
+  for (int i = 0; i < 4; ++i) {
+    double* q = basis[i];
+    for (int k = 0; k < 9; ++k) {
+      q[k] = k == 5 + i ? 1.0 : 0.0;
+    }
+    for (int j = 4; j >= 0; --j) {
+      const double* v = reflectors[j];
+      double projection = 0.0;
+      for (int k = j; k < 9; ++k) {
+        projection += v[k] * q[k];
+      }
+      for (int k = j; k < 9; ++k) {
+        q[k] -= 2.0 * projection * v[k];
+      }
+    }
+  }
+}
+
+constexpr int max_five_point_solutions = 10;
+
+// Nister's five point solver. Writes up to ten essential matrices and returns
+// how many were found.
+int solve_five_point(Mat3* essentials_ptr,
+                     const double* x1_ptr,
+                     const double* y1_ptr,
+                     const double* x2_ptr,
+                     const double* y2_ptr) {
+  double rows[5][9];
+  for (int i = 0; i < 5; ++i) {
+    const double x1 = x1_ptr[i];
+    const double y1 = y1_ptr[i];
+    const double x2 = x2_ptr[i];
+    const double y2 = y2_ptr[i];
+    const double row[9] = { x2 * x1, x2 * y1, x2, y2 * x1, y2 * y1, y2, x1, y1, 1.0 };
+    std::copy(row, row + 9, rows[i]);
+  }
+
+  double basis[4][9];
+  compute_epipolar_null_space(basis, rows);
+
+  // E = x * X + y * Y + z * Z + W, element by element.
+  LinearPolynomial e[3][3];
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      for (int i = 0; i < linear_term_count; ++i) {
+        e[row][column].c[i] = basis[i][3 * row + column];
+      }
+    }
+  }
+
+  // det(E) = 0 and 2 * E * E^T * E - trace(E * E^T) * E = 0.
+  CubicPolynomial constraints[10];
+  constraints[0] = (e[1][1] * e[2][2] - e[1][2] * e[2][1]) * e[0][0] -
+                   (e[1][0] * e[2][2] - e[1][2] * e[2][0]) * e[0][1] +
+                   (e[1][0] * e[2][1] - e[1][1] * e[2][0]) * e[0][2];
+
+  QuadraticPolynomial eet[3][3];
+  for (int row = 0; row < 3; ++row) {
+    for (int column = row; column < 3; ++column) {
+      eet[row][column] = e[row][0] * e[column][0] + e[row][1] * e[column][1] + e[row][2] * e[column][2];
+      eet[column][row] = eet[row][column];
+    }
+  }
+  QuadraticPolynomial half_trace = eet[0][0] + eet[1][1] + eet[2][2];
+  for (int i = 0; i < quadratic_term_count; ++i) {
+    half_trace.c[i] *= 0.5;
+  }
+  for (int i = 0; i < 3; ++i) {
+    eet[i][i] = eet[i][i] - half_trace;
+  }
+  for (int row = 0; row < 3; ++row) {
+    for (int column = 0; column < 3; ++column) {
+      constraints[1 + 3 * row + column] =
+        eet[row][0] * e[0][column] + eet[row][1] * e[1][column] + eet[row][2] * e[2][column];
+    }
+  }
+
+  // Gauss-Jordan elimination of the first ten monomials.
+  double a[10][cubic_term_count];
+  for (int row = 0; row < 10; ++row) {
+    std::copy(constraints[row].c, constraints[row].c + cubic_term_count, a[row]);
+  }
+  for (int column = 0; column < 10; ++column) {
+    int pivot = column;
+    for (int row = column + 1; row < 10; ++row) {
+      if (std::fabs(a[row][column]) > std::fabs(a[pivot][column])) {
+        pivot = row;
+      }
+    }
+    if (std::fabs(a[pivot][column]) < 1e-12) {
+      return 0;
+    }
+    if (pivot != column) {
+      std::swap(a[pivot], a[column]);
+    }
+
+    const double inverse_pivot = 1.0 / a[column][column];
+    for (int k = column; k < cubic_term_count; ++k) {
+      a[column][k] *= inverse_pivot;
+    }
+    for (int row = 0; row < 10; ++row) {
+      if (row == column || a[row][column] == 0.0) {
+        continue;
+      }
+      const double factor = a[row][column];
+      for (int k = column; k < cubic_term_count; ++k) {
+        a[row][k] -= factor * a[column][k];
+      }
+    }
+  }
+
+  // Rows 4 to 9 lead with x^2 z, x^2, y^2 z, y^2, xyz and xy. Subtracting z
+  // times the second row of each pair leaves polynomials in x, y and z that are
+  // linear in x and y, so B(z) * (x, y, 1)^T = 0 for the 3x3 matrix
+  //   [ cubic(z) cubic(z) quartic(z) ]
+  // with one row per pair.
+  double b[3][3][5] = {};
+  for (int pair = 0; pair < 3; ++pair) {
+    const double* p = a[4 + 2 * pair] + 10;
+    const double* q = a[5 + 2 * pair] + 10;
+    // Remaining columns are x z^2, x z, x, y z^2, y z, y, z^3, z^2, z, 1.
+    for (int variable = 0; variable < 2; ++variable) {
+      const double* pv = p + 3 * variable;
+      const double* qv = q + 3 * variable;
+      b[pair][variable][0] = pv[2];
+      b[pair][variable][1] = pv[1] - qv[2];
+      b[pair][variable][2] = pv[0] - qv[1];
+      b[pair][variable][3] = -qv[0];
+    }
+    b[pair][2][0] = p[9];
+    b[pair][2][1] = p[8] - q[9];
+    b[pair][2][2] = p[7] - q[8];
+    b[pair][2][3] = p[6] - q[7];
+    b[pair][2][4] = -q[6];
+  }
+
+  // det(B(z)) has degree ten.
+  double minor_a[8], minor_b[8], minor_c[7], minor_d[7];
+  double term[11];
+  double determinant_z[11] = {};
+
+  multiply_polynomials(minor_a, b[1][1], 3, b[2][2], 4);
+  multiply_polynomials(minor_b, b[1][2], 4, b[2][1], 3);
+  for (int i = 0; i < 8; ++i) {
+    minor_a[i] -= minor_b[i];
+  }
+  multiply_polynomials(term, b[0][0], 3, minor_a, 7);
+  for (int i = 0; i < 11; ++i) {
+    determinant_z[i] += term[i];
+  }
+
+  multiply_polynomials(minor_a, b[1][0], 3, b[2][2], 4);
+  multiply_polynomials(minor_b, b[1][2], 4, b[2][0], 3);
+  for (int i = 0; i < 8; ++i) {
+    minor_a[i] -= minor_b[i];
+  }
+  multiply_polynomials(term, b[0][1], 3, minor_a, 7);
+  for (int i = 0; i < 11; ++i) {
+    determinant_z[i] -= term[i];
+  }
+
+  multiply_polynomials(minor_c, b[1][0], 3, b[2][1], 3);
+  multiply_polynomials(minor_d, b[1][1], 3, b[2][0], 3);
+  for (int i = 0; i < 7; ++i) {
+    minor_c[i] -= minor_d[i];
+  }
+  multiply_polynomials(term, b[0][2], 4, minor_c, 6);
+  for (int i = 0; i < 11; ++i) {
+    determinant_z[i] += term[i];
+  }
+
+  std::vector<double> roots;
+  roots.reserve(10);
+  find_real_roots(&roots, determinant_z, 10);
+
+  int solution_count = 0;
+  for (const double z : roots) {
+    Vec3 b_rows[3];
+    for (int row = 0; row < 3; ++row) {
+      b_rows[row] = { evaluate_polynomial(b[row][0], 3, z),
+                      evaluate_polynomial(b[row][1], 3, z),
+                      evaluate_polynomial(b[row][2], 4, z) };
+    }
+
+    // (x, y, 1) is orthogonal to every row of B(z), take the best conditioned
+    // cross product.
+    const Vec3 candidates[3] = { cross(b_rows[0], b_rows[1]), cross(b_rows[0], b_rows[2]), cross(b_rows[1], b_rows[2]) };
+    Vec3 solution = candidates[0];
+    for (int i = 1; i < 3; ++i) {
+      if (std::fabs(candidates[i].z) > std::fabs(solution.z)) {
+        solution = candidates[i];
+      }
+    }
+    if (std::fabs(solution.z) < 1e-12) {
+      continue;
+    }
+    const double x = solution.x / solution.z;
+    const double y = solution.y / solution.z;
+
+    Mat3& essential = essentials_ptr[solution_count++];
+    double squared_norm = 0.0;
+    for (int k = 0; k < 9; ++k) {
+      const double value = x * basis[0][k] + y * basis[1][k] + z * basis[2][k] + basis[3][k];
+      essential.m[k / 3][k % 3] = value;
+      squared_norm += value * value;
+    }
+    const double inverse_norm = 1.0 / std::sqrt(squared_norm);
+    for (int k = 0; k < 9; ++k) {
+      essential.m[k / 3][k % 3] *= inverse_norm;
+    }
+
+    if (solution_count == max_five_point_solutions) {
+      break;
+    }
+  }
+  return solution_count;
+}
+
+// Depths of a correspondence along both rays from the least squares solution
+// of d2 * x2 = d1 * R * x1 + t.
+bool triangulate_depths(double* depth1_ptr, double* depth2_ptr, const Mat3& rotation, const Vec3& translation, const Vec3& x1, const Vec3& x2) {
+  const Vec3 a = rotation * x1;
+  const double aa = dot(a, a);
+  const double ab = dot(a, x2);
+  const double bb = dot(x2, x2);
+  const double determinant = aa * bb - ab * ab;
+  if (determinant <= 1e-12 * aa * bb) {
+    return false;
+  }
+
+  const double at = dot(a, translation);
+  const double bt = dot(x2, translation);
+  *depth1_ptr = (-bb * at + ab * bt) / determinant;
+  *depth2_ptr = (aa * bt - ab * at) / determinant;
+  return true;
+}
+
+// The four (R, t) factorizations of E with t of unit length.
+void decompose_essential(Mat3 rotations[4], Vec3 translations[4], const Mat3& essential) {
+  Mat3 u;
+  Vec3 s;
+  Mat3 v;
+  svd_3x3(essential, &u, &s, &v);
+
+  const Mat3 w = {{ { 0.0, -1.0, 0.0 }, { 1.0, 0.0, 0.0 }, { 0.0, 0.0, 1.0 } }};
+  const Mat3 vt = transpose(v);
+  const Mat3 r1 = u * w * vt;
+  const Mat3 r2 = u * transpose(w) * vt;
+  const Vec3 t = get_column(u, 2);
+
+  rotations[0] = r1;
+  translations[0] = t;
+  rotations[1] = r1;
+  translations[1] = -t;
+  rotations[2] = r2;
+  translations[2] = t;
+  rotations[3] = r2;
+  translations[3] = -t;
+}
+
+struct RelativePoseParameters {
+  // Sampson distance in normalized image coordinates, about one pixel divided
+  // by the focal length.
+  float threshold = 0.002f;
+  double confidence = 0.99;
+  int max_iterations = 1000;
+  uint64_t seed = 0;
+  // Optional pose prior, e.g. from the motion model. Its essential matrix
+  // seeds the search before the first sample. Ignored when the prior has no
+  // translation, since that leaves the epipolar geometry undefined.
+  bool use_prior = false;
+  Mat3 prior_rotation = identity3();
+  Vec3 prior_translation = {};
+};
+
+struct RelativePose {
+  Mat3 essential;
+  Mat3 rotation;
+  Vec3 translation;
+  int inlier_count;
+  int iteration_count;
+  std::vector<unsigned char> inlier_mask;
+};
+
+// Truncated (MSAC) Sampson cost of E over all correspondences, in units of the
+// squared threshold so each point costs at most one. Bails out with a cost
+// above max_cost once the hypothesis can no longer win.
+float score_essential(int* inlier_count_ptr,
+                      const Mat3& essential,
+                      const float* x1_ptr,
+                      const float* y1_ptr,
+                      const float* x2_ptr,
+                      const float* y2_ptr,
+                      int count,
+                      float threshold,
+                      float max_cost) {
+  float e[9];
+  for (int k = 0; k < 9; ++k) {
+    e[k] = float(essential.m[k / 3][k % 3]);
+  }
+  const float inverse_threshold_squared = 1.0f / (threshold * threshold);
+
+  float cost = 0.0f;
+  int inlier_count = 0;
+  int index = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  const __m256 e00 = _mm256_set1_ps(e[0]), e01 = _mm256_set1_ps(e[1]), e02 = _mm256_set1_ps(e[2]);
+  const __m256 e10 = _mm256_set1_ps(e[3]), e11 = _mm256_set1_ps(e[4]), e12 = _mm256_set1_ps(e[5]);
+  const __m256 e20 = _mm256_set1_ps(e[6]), e21 = _mm256_set1_ps(e[7]), e22 = _mm256_set1_ps(e[8]);
+  const __m256 scale = _mm256_set1_ps(inverse_threshold_squared);
+  const __m256 one = _mm256_set1_ps(1.0f);
+
+  constexpr int block_size = 256;
+  while (index + 8 <= count) {
+    __m256 block_cost = _mm256_setzero_ps();
+    const int block_end = std::min(count, index + block_size) - 7;
+    for (; index < block_end; index += 8) {
+      const __m256 x1 = _mm256_loadu_ps(x1_ptr + index);
+      const __m256 y1 = _mm256_loadu_ps(y1_ptr + index);
+      const __m256 x2 = _mm256_loadu_ps(x2_ptr + index);
+      const __m256 y2 = _mm256_loadu_ps(y2_ptr + index);
+
+      // E * x1 and the first two rows of E^T * x2.
+      const __m256 a = _mm256_fmadd_ps(e00, x1, _mm256_fmadd_ps(e01, y1, e02));
+      const __m256 b = _mm256_fmadd_ps(e10, x1, _mm256_fmadd_ps(e11, y1, e12));
+      const __m256 c = _mm256_fmadd_ps(e20, x1, _mm256_fmadd_ps(e21, y1, e22));
+      const __m256 d = _mm256_fmadd_ps(e00, x2, _mm256_fmadd_ps(e10, y2, e20));
+      const __m256 f = _mm256_fmadd_ps(e01, x2, _mm256_fmadd_ps(e11, y2, e21));
+
+      const __m256 residual = _mm256_fmadd_ps(x2, a, _mm256_fmadd_ps(y2, b, c));
+      __m256 gradient = _mm256_mul_ps(a, a);
+      gradient = _mm256_fmadd_ps(b, b, gradient);
+      gradient = _mm256_fmadd_ps(d, d, gradient);
+      gradient = _mm256_fmadd_ps(f, f, gradient);
+
+      const __m256 error = _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(residual, residual), scale), gradient);
+      const __m256 inliers = _mm256_cmp_ps(error, one, _CMP_LT_OQ);
+      inlier_count += __builtin_popcount(_mm256_movemask_ps(inliers));
+      block_cost = _mm256_add_ps(block_cost, _mm256_min_ps(error, one));
+    }
+
+    const __m128 half = _mm_add_ps(_mm256_castps256_ps128(block_cost), _mm256_extractf128_ps(block_cost, 1));
+    const __m128 quarter = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    cost += _mm_cvtss_f32(_mm_add_ss(quarter, _mm_movehdup_ps(quarter)));
+    if (cost > max_cost) {
+      *inlier_count_ptr = inlier_count;
+      return cost;
+    }
+  }
+#endif
+
+  for (; index < count; ++index) {
+    const float x1 = x1_ptr[index];
+    const float y1 = y1_ptr[index];
+    const float x2 = x2_ptr[index];
+    const float y2 = y2_ptr[index];
+    const float a = e[0] * x1 + e[1] * y1 + e[2];
+    const float b = e[3] * x1 + e[4] * y1 + e[5];
+    const float c = e[6] * x1 + e[7] * y1 + e[8];
+    const float d = e[0] * x2 + e[3] * y2 + e[6];
+    const float f = e[1] * x2 + e[4] * y2 + e[7];
+    const float residual = x2 * a + y2 * b + c;
+    const float error = residual * residual * inverse_threshold_squared / (a * a + b * b + d * d + f * f);
+    inlier_count += error < 1.0f;
+    cost += std::min(error, 1.0f);
+    if ((index & 255) == 255 && cost > max_cost) {
+      break;
+    }
+  }
+
+  *inlier_count_ptr = inlier_count;
+  return cost;
+}
+
+// Picks the factorization of E that puts the most inliers in front of both
+// cameras.
+void select_pose_by_cheirality(RelativePose* pose_ptr,
+                               const float* x1_ptr,
+                               const float* y1_ptr,
+                               const float* x2_ptr,
+                               const float* y2_ptr,
+                               int count) {
+  Mat3 rotations[4];
+  Vec3 translations[4];
+  decompose_essential(rotations, translations, pose_ptr->essential);
+
+  int best_in_front = -1;
+  for (int candidate = 0; candidate < 4; ++candidate) {
+    int in_front = 0;
+    for (int index = 0; index < count; ++index) {
+      if (!pose_ptr->inlier_mask[index]) {
+        continue;
+      }
+      const Vec3 x1 = { x1_ptr[index], y1_ptr[index], 1.0 };
+      const Vec3 x2 = { x2_ptr[index], y2_ptr[index], 1.0 };
+      double depth1, depth2;
+      if (triangulate_depths(&depth1, &depth2, rotations[candidate], translations[candidate], x1, x2)) {
+        in_front += depth1 > 0.0 && depth2 > 0.0;
+      }
+    }
+    if (in_front > best_in_front) {
+      best_in_front = in_front;
+      pose_ptr->rotation = rotations[candidate];
+      pose_ptr->translation = translations[candidate];
+    }
+  }
+}
+
+// Marks correspondences with Sampson distance below the threshold and returns
+// how many there are.
+int find_essential_inliers(unsigned char* inlier_mask_ptr,
+                           const Mat3& essential,
+                           const float* x1_ptr,
+                           const float* y1_ptr,
+                           const float* x2_ptr,
+                           const float* y2_ptr,
+                           int count,
+                           float threshold) {
+  float e[9];
+  for (int k = 0; k < 9; ++k) {
+    e[k] = float(essential.m[k / 3][k % 3]);
+  }
+  const float threshold_squared = threshold * threshold;
+
+  int inlier_count = 0;
+  for (int index = 0; index < count; ++index) {
+    const float x1 = x1_ptr[index];
+    const float y1 = y1_ptr[index];
+    const float x2 = x2_ptr[index];
+    const float y2 = y2_ptr[index];
+    const float a = e[0] * x1 + e[1] * y1 + e[2];
+    const float b = e[3] * x1 + e[4] * y1 + e[5];
+    const float c = e[6] * x1 + e[7] * y1 + e[8];
+    const float d = e[0] * x2 + e[3] * y2 + e[6];
+    const float f = e[1] * x2 + e[4] * y2 + e[7];
+    const float residual = x2 * a + y2 * b + c;
+    const bool inlier = residual * residual < threshold_squared * (a * a + b * b + d * d + f * f);
+    inlier_mask_ptr[index] = inlier;
+    inlier_count += inlier;
+  }
+  return inlier_count;
+}
+
+int solve_five_point_sample(Mat3* essentials_ptr,
+                            const int sample[5],
+                            const float* x1_ptr,
+                            const float* y1_ptr,
+                            const float* x2_ptr,
+                            const float* y2_ptr) {
+  double x1[5], y1[5], x2[5], y2[5];
+  for (int i = 0; i < 5; ++i) {
+    x1[i] = x1_ptr[sample[i]];
+    y1[i] = y1_ptr[sample[i]];
+    x2[i] = x2_ptr[sample[i]];
+    y2[i] = y2_ptr[sample[i]];
+  }
+  return solve_five_point(essentials_ptr, x1, y1, x2, y2);
+}
+
+// Best hypothesis found so far.
+struct EssentialHypothesis {
+  Mat3 essential;
+  float cost;
+  int inlier_count;
+};
+
+// Scores every solution of one minimal sample and keeps the best.
+bool update_best_hypothesis(EssentialHypothesis* best_ptr,
+                            const Mat3* essentials_ptr,
+                            int solution_count,
+                            const float* x1_ptr,
+                            const float* y1_ptr,
+                            const float* x2_ptr,
+                            const float* y2_ptr,
+                            int count,
+                            float threshold) {
+  bool improved = false;
+  for (int solution = 0; solution < solution_count; ++solution) {
+    int inlier_count;
+    const float cost = score_essential(&inlier_count, essentials_ptr[solution], x1_ptr, y1_ptr, x2_ptr, y2_ptr,
+                                       count, threshold, best_ptr->cost);
+    if (cost < best_ptr->cost) {
+      *best_ptr = { essentials_ptr[solution], cost, inlier_count };
+      improved = true;
+    }
+  }
+  return improved;
+}
+
+constexpr int local_optimization_samples = 10;
+
+// Local optimization (LO-RANSAC): a new best model is refined by resampling
+// minimal sets from its own inliers, which are far more likely to be clean.
+void optimize_hypothesis_locally(EssentialHypothesis* best_ptr,
+                                 const float* x1_ptr,
+                                 const float* y1_ptr,
+                                 const float* x2_ptr,
+                                 const float* y2_ptr,
+                                 int count,
+                                 float threshold,
+                                 uint64_t seed) {
+  std::vector<unsigned char> inlier_mask(count);
+  std::vector<int> inliers;
+  for (int round = 0; round < local_optimization_samples; ++round) {
+    if (round == 0 || inliers.empty()) {
+      find_essential_inliers(inlier_mask.data(), best_ptr->essential, x1_ptr, y1_ptr, x2_ptr, y2_ptr, count, threshold);
+      inliers.clear();
+      for (int index = 0; index < count; ++index) {
+        if (inlier_mask[index]) {
+          inliers.push_back(index);
+        }
+      }
+    }
+    const int inlier_count = int(inliers.size());
+    if (inlier_count <= 5) {
+      return;
+    }
+
+    uint64_t state = mix_bits(seed ^ mix_bits(uint64_t(round)));
+    int sample[5];
+    int sample_size = 0;
+    while (sample_size < 5) {
+      state = mix_bits(state);
+      const int index = inliers[((state >> 32) * uint64_t(inlier_count)) >> 32];
+      bool duplicate = false;
+      for (int i = 0; i < sample_size; ++i) {
+        duplicate |= sample[i] == index;
+      }
+      if (!duplicate) {
+        sample[sample_size++] = index;
+      }
+    }
+
+    Mat3 essentials[max_five_point_solutions];
+    const int solution_count = solve_five_point_sample(essentials, sample, x1_ptr, y1_ptr, x2_ptr, y2_ptr);
+    if (update_best_hypothesis(best_ptr, essentials, solution_count, x1_ptr, y1_ptr, x2_ptr, y2_ptr, count, threshold)) {
+      inliers.clear();
+    }
+  }
+}
+
+// Solutions of one RANSAC iteration that beat the committed best when they
+// were scored. Iterations run ahead of the commit point by at most the ring
+// size.
+struct IterationResult {
+  std::atomic<bool> ready;
+  int solution_count;
+  Mat3 essentials[max_five_point_solutions];
+  float costs[max_five_point_solutions];
+  int inlier_counts[max_five_point_solutions];
+};
+
+constexpr int iteration_ring_size = 64;
+
+// Shared state of one parallel RANSAC run. Workers claim iterations from
+// next_iteration, while results are committed strictly in iteration order so
+// the outcome matches a single threaded run for any number of workers.
+struct RelativePoseSearch {
+  const float* x1_ptr;
+  const float* y1_ptr;
+  const float* x2_ptr;
+  const float* y2_ptr;
+  int count;
+  RelativePoseParameters parameters;
+  std::vector<int> schedule;
+
+  std::atomic<int> next_iteration;
+  std::atomic<int> committed_iteration;
+  // Required iteration count of the committed best, workers stop past it.
+  std::atomic<int> iteration_limit;
+  // Cost of the committed best, used to cut scoring of losing hypotheses.
+  std::atomic<float> committed_cost;
+
+  std::mutex commit_mutex;
+  EssentialHypothesis best;
+  std::vector<IterationResult> ring;
+};
+
+// Commits every finished iteration that is next in line. Only one thread
+// commits at a time, the others return immediately.
+void commit_iteration_results(RelativePoseSearch* search_ptr) {
+  for (;;) {
+    if (!search_ptr->commit_mutex.try_lock()) {
+      return;
+    }
+
+    int iteration = search_ptr->committed_iteration.load();
+    while (iteration < search_ptr->iteration_limit.load()) {
+      IterationResult* result_ptr = &search_ptr->ring[iteration % iteration_ring_size];
+      if (!result_ptr->ready.load(std::memory_order_acquire)) {
+        break;
+      }
+
+      bool improved = false;
+      for (int solution = 0; solution < result_ptr->solution_count; ++solution) {
+        if (result_ptr->costs[solution] < search_ptr->best.cost) {
+          search_ptr->best = { result_ptr->essentials[solution], result_ptr->costs[solution], result_ptr->inlier_counts[solution] };
+          improved = true;
+        }
+      }
+      result_ptr->ready.store(false, std::memory_order_relaxed);
+
+      if (improved) {
+        const RelativePoseParameters& parameters = search_ptr->parameters;
+        optimize_hypothesis_locally(&search_ptr->best, search_ptr->x1_ptr, search_ptr->y1_ptr, search_ptr->x2_ptr,
+                                    search_ptr->y2_ptr, search_ptr->count, parameters.threshold,
+                                    mix_bits(parameters.seed + iteration));
+        search_ptr->committed_cost.store(search_ptr->best.cost);
+        // The limit only ever shrinks. A lower cost can come with fewer
+        // inliers, and raising the limit again would need iterations that
+        // workers already gave up on.
+        const int required_iterations = get_required_iterations(search_ptr->best.inlier_count, search_ptr->count, 5,
+                                                                parameters.confidence, parameters.max_iterations);
+        search_ptr->iteration_limit.store(std::min(search_ptr->iteration_limit.load(), required_iterations));
+      }
+
+      ++iteration;
+      search_ptr->committed_iteration.store(iteration);
+    }
+    search_ptr->commit_mutex.unlock();
+
+    // A result may have landed while the lock was held by this thread.
+    if (iteration >= search_ptr->iteration_limit.load() ||
+        !search_ptr->ring[iteration % iteration_ring_size].ready.load(std::memory_order_acquire)) {
+      return;
+    }
+  }
+}
+
+void run_relative_pose_worker(RelativePoseSearch* search_ptr) {
+  for (;;) {
+    const int iteration = search_ptr->next_iteration.fetch_add(1);
+
+    // Wait for the ring slot to be committed, helping with the commits.
+    while (iteration >= search_ptr->committed_iteration.load() + iteration_ring_size &&
+           iteration < search_ptr->iteration_limit.load()) {
+      commit_iteration_results(search_ptr);
+      std::this_thread::yield();
+    }
+    if (iteration >= search_ptr->iteration_limit.load()) {
+      return;
+    }
+
+    int sample[5];
+    draw_prosac_sample(sample, 5, &search_ptr->schedule, search_ptr->count, iteration, search_ptr->parameters.seed);
+
+    Mat3 essentials[max_five_point_solutions];
+    const int solution_count = solve_five_point_sample(essentials, sample, search_ptr->x1_ptr, search_ptr->y1_ptr,
+                                                       search_ptr->x2_ptr, search_ptr->y2_ptr);
+
+    // Hypotheses that cannot beat the committed best are dropped here. The
+    // committed best only improves, so they could not win at commit either.
+    IterationResult* result_ptr = &search_ptr->ring[iteration % iteration_ring_size];
+    const float max_cost = search_ptr->committed_cost.load();
+    result_ptr->solution_count = 0;
+    for (int solution = 0; solution < solution_count; ++solution) {
+      int inlier_count;
+      const float cost = score_essential(&inlier_count, essentials[solution], search_ptr->x1_ptr, search_ptr->y1_ptr,
+                                         search_ptr->x2_ptr, search_ptr->y2_ptr, search_ptr->count,
+                                         search_ptr->parameters.threshold, max_cost);
+      if (cost < max_cost) {
+        const int index = result_ptr->solution_count++;
+        result_ptr->essentials[index] = essentials[solution];
+        result_ptr->costs[index] = cost;
+        result_ptr->inlier_counts[index] = inlier_count;
+      }
+    }
+    result_ptr->ready.store(true, std::memory_order_release);
+
+    commit_iteration_results(search_ptr);
+  }
+}
+
+// Five point RANSAC. Correspondences must be sorted best first (e.g. by
+// descriptor distance) so PROSAC tries the most reliable ones early.
+// Hypotheses are generated and scored on every thread of the pool, or inline
+// without one, and the result only depends on the seed. Returns false when
+// fewer than five points are given or no hypothesis was found.
+bool estimate_relative_pose(RelativePose* pose_ptr,
+                            const float* x1_ptr,
+                            const float* y1_ptr,
+                            const float* x2_ptr,
+                            const float* y2_ptr,
+                            int count,
+                            const RelativePoseParameters& parameters = {},
+                            ThreadPool* thread_pool_ptr = nullptr) {
+  pose_ptr->inlier_count = 0;
+  pose_ptr->iteration_count = 0;
+  pose_ptr->inlier_mask.assign(count, 0);
+  if (count < 5) {
+    return false;
+  }
+
+  RelativePoseSearch search;
+  search.x1_ptr = x1_ptr;
+  search.y1_ptr = y1_ptr;
+  search.x2_ptr = x2_ptr;
+  search.y2_ptr = y2_ptr;
+  search.count = count;
+  search.parameters = parameters;
+  build_prosac_schedule(&search.schedule, count, 5);
+  search.next_iteration = 0;
+  search.committed_iteration = 0;
+  search.iteration_limit = parameters.max_iterations;
+  search.committed_cost = count + 1.0f;
+  search.best = {};
+  search.best.cost = count + 1.0f;
+  search.ring = std::vector<IterationResult>(iteration_ring_size);
+
+  if (parameters.use_prior && norm(parameters.prior_translation) > 0.0) {
+    const Mat3 essential = skew(normalized(parameters.prior_translation)) * parameters.prior_rotation;
+    if (update_best_hypothesis(&search.best, &essential, 1, x1_ptr, y1_ptr, x2_ptr, y2_ptr, count, parameters.threshold)) {
+      optimize_hypothesis_locally(&search.best, x1_ptr, y1_ptr, x2_ptr, y2_ptr, count, parameters.threshold,
+                                  mix_bits(parameters.seed));
+      search.committed_cost = search.best.cost;
+      search.iteration_limit = get_required_iterations(search.best.inlier_count, count, 5, parameters.confidence,
+                                                       parameters.max_iterations);
+    }
+  }
+
+  run_on_all_threads(thread_pool_ptr, [&search](int) { run_relative_pose_worker(&search); });
+  commit_iteration_results(&search);
+
+  pose_ptr->iteration_count = search.committed_iteration.load();
+  if (search.best.inlier_count == 0) {
+    return false;
+  }
+
+  pose_ptr->essential = search.best.essential;
+  pose_ptr->inlier_count = find_essential_inliers(pose_ptr->inlier_mask.data(), search.best.essential,
+                                                  x1_ptr, y1_ptr, x2_ptr, y2_ptr, count, parameters.threshold);
+  select_pose_by_cheirality(pose_ptr, x1_ptr, y1_ptr, x2_ptr, y2_ptr, count);
+  return true;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "absolute_pose.h"
+#include "frame.h"
+#include "keyframe_database.h"
+#include "mapping.h"
+#include "matching.h"
+#include "pose_refinement.h"
+#include "thread_pool.h"
+#include "vocabulary.h"
+
+// Recovers the camera pose after tracking was lost, e.g. when FAST finds too
+// few points on a blurred frame or a blank wall. The frame is looked up by
+// appearance among the keyframes of the latest snapshot and every candidate
+// is verified by PnP against the map points it observes, one candidate per
+// worker of the thread pool. Runs on the tracker thread and only reads the
+// snapshot, so it never waits on the mapper.
+
+struct RelocalizationParameters {
+  // Keyframes at most this many, and at least min_score similar.
+  int max_candidates = 8;
+  float min_score = 0.02f;
+  // Below this many PnP inliers a candidate is rejected. The frame needs at
+  // least as many keypoints to be worth a query.
+  int min_inliers = 30;
+  AbsolutePoseParameters pose;
+};
+
+struct RelocalizationCandidate {
+  // Index of the keyframe in the snapshot.
+  int keyframe_index;
+  float score;
+  bool located;
+  AbsolutePose pose;
+};
+
+struct Relocalizer {
+  const Vocabulary* vocabulary_ptr;
+  // Built from the keyframes of the snapshot with database_version, ids are
+  // keyframe indices in that snapshot.
+  KeyframeDatabase keyframe_database;
+  uint64_t database_version;
+  std::vector<int> words;
+  BowVector bow_vector;
+  std::vector<KeyframeQueryResult> query_results;
+  std::vector<RelocalizationCandidate> candidates;
+};
+
+struct RelocalizationResult {
+  // Frame index of the keyframe the pose was found through.
+  int keyframe_frame_index;
+  int candidate_count;
+  AbsolutePose pose;
+};
+
+void init_relocalizer(Relocalizer* relocalizer_ptr, const Vocabulary* vocabulary_ptr) {
+  relocalizer_ptr->vocabulary_ptr = vocabulary_ptr;
+  relocalizer_ptr->database_version = 0;
+}
+
+// The database follows the snapshot lazily. While tracking is lost the
+// mapper gets no keyframes, so it is built once per loss.
+void update_relocalization_database(Relocalizer* relocalizer_ptr, const MapSnapshot* snapshot_ptr) {
+  if (relocalizer_ptr->database_version == snapshot_ptr->version) {
+    return;
+  }
+  KeyframeDatabase* database_ptr = &relocalizer_ptr->keyframe_database;
+  init_keyframe_database(database_ptr, relocalizer_ptr->vocabulary_ptr);
+  for (int keyframe_index = 0; keyframe_index < int(snapshot_ptr->keyframe_bow_vectors.size()); ++keyframe_index) {
+    add_keyframe_to_database(database_ptr, keyframe_index, &snapshot_ptr->keyframe_bow_vectors[keyframe_index]);
+  }
+  relocalizer_ptr->database_version = snapshot_ptr->version;
+}
+
+// Matches the frame against the map points the candidate keyframe observes
+// and locates it with PnP RANSAC and refinement. Scratch buffers belong to
+// the calling worker.
+void verify_relocalization_candidate(RelocalizationCandidate* candidate_ptr,
+                                     const MapSnapshot* snapshot_ptr,
+                                     const Frame* frame_ptr,
+                                     const RelocalizationParameters& parameters,
+                                     Descriptors* point_descriptors_ptr,
+                                     std::vector<Match>* matches_ptr) {
+  candidate_ptr->located = false;
+  const MapPoints* map_points_ptr = &snapshot_ptr->map_points;
+  const int* slots_ptr = snapshot_ptr->keyframe_point_slots.data() +
+                         snapshot_ptr->keyframe_point_offsets[candidate_ptr->keyframe_index];
+  const int slot_count = snapshot_ptr->keyframe_point_offsets[candidate_ptr->keyframe_index + 1] -
+                         snapshot_ptr->keyframe_point_offsets[candidate_ptr->keyframe_index];
+  if (slot_count < parameters.min_inliers) {
+    return;
+  }
+
+  reserve_descriptors(point_descriptors_ptr, slot_count);
+  for (int index = 0; index < slot_count; ++index) {
+    std::memcpy(point_descriptors_ptr->data_ptr + descriptor_size * index,
+                get_descriptor_ptr(slots_ptr[index], &map_points_ptr->descriptors), descriptor_size);
+  }
+  point_descriptors_ptr->count = slot_count;
+
+  match_descriptors_brute_force(matches_ptr, &frame_ptr->descriptors, point_descriptors_ptr);
+  const int count = int(matches_ptr->size());
+  if (count < parameters.min_inliers) {
+    return;
+  }
+  // PROSAC expects the most distinctive matches first.
+  std::sort(matches_ptr->begin(), matches_ptr->end(),
+            [](const Match& a, const Match& b) { return a.distance < b.distance; });
+
+  std::vector<float> point_x(count), point_y(count), point_z(count), image_x(count), image_y(count);
+  for (int match_index = 0; match_index < count; ++match_index) {
+    const Match& match = (*matches_ptr)[match_index];
+    const int slot = slots_ptr[match.train_index];
+    point_x[match_index] = map_points_ptr->x[slot];
+    point_y[match_index] = map_points_ptr->y[slot];
+    point_z[match_index] = map_points_ptr->z[slot];
+    image_x[match_index] = frame_ptr->bearing_x[match.query_index] / frame_ptr->bearing_z[match.query_index];
+    image_y[match_index] = frame_ptr->bearing_y[match.query_index] / frame_ptr->bearing_z[match.query_index];
+  }
+
+  AbsolutePose* pose_ptr = &candidate_ptr->pose;
+  if (!estimate_absolute_pose(pose_ptr, point_x.data(), point_y.data(), point_z.data(), image_x.data(), image_y.data(),
+                              count, parameters.pose) ||
+      pose_ptr->inlier_count < parameters.min_inliers) {
+    return;
+  }
+  PoseRefinementParameters refinement_parameters = {};
+  refinement_parameters.huber_threshold = 0.5f * parameters.pose.threshold;
+  refinement_parameters.inlier_threshold = parameters.pose.threshold;
+  refine_absolute_pose(pose_ptr, point_x.data(), point_y.data(), point_z.data(), image_x.data(), image_y.data(), count,
+                       refinement_parameters);
+  candidate_ptr->located = pose_ptr->inlier_count >= parameters.min_inliers;
+}
+
+// Locates a frame with extracted features and bearings in the snapshot's
+// map. Every candidate is verified and the one with the most inliers wins,
+// so the result does not depend on the number of threads. On success the
+// tracker resets its motion model to the returned pose and resumes, and
+// keyframes it submits from there are tagged with the snapshot version.
+bool relocalize_frame(RelocalizationResult* result_ptr,
+                      Relocalizer* relocalizer_ptr,
+                      const MapSnapshot* snapshot_ptr,
+                      const Frame* frame_ptr,
+                      const RelocalizationParameters& parameters = {},
+                      ThreadPool* thread_pool_ptr = nullptr) {
+  result_ptr->keyframe_frame_index = -1;
+  result_ptr->candidate_count = 0;
+  if (relocalizer_ptr->vocabulary_ptr == nullptr || snapshot_ptr == nullptr ||
+      frame_ptr->descriptors.count < parameters.min_inliers) {
+    return false;
+  }
+
+  update_relocalization_database(relocalizer_ptr, snapshot_ptr);
+  relocalizer_ptr->words.resize(frame_ptr->descriptors.count);
+  compute_bow_vector(&relocalizer_ptr->bow_vector, relocalizer_ptr->words.data(), relocalizer_ptr->vocabulary_ptr,
+                     &frame_ptr->descriptors);
+  query_keyframe_database(&relocalizer_ptr->query_results, &relocalizer_ptr->keyframe_database,
+                          &relocalizer_ptr->bow_vector, parameters.max_candidates, parameters.min_score);
+
+  std::vector<RelocalizationCandidate>& candidates = relocalizer_ptr->candidates;
+  const int candidate_count = int(relocalizer_ptr->query_results.size());
+  candidates.resize(candidate_count);
+  for (int index = 0; index < candidate_count; ++index) {
+    candidates[index].keyframe_index = relocalizer_ptr->query_results[index].keyframe_id;
+    candidates[index].score = relocalizer_ptr->query_results[index].score;
+  }
+  result_ptr->candidate_count = candidate_count;
+  if (candidate_count == 0) {
+    return false;
+  }
+
+  std::atomic<int> next_candidate(0);
+  run_on_all_threads(thread_pool_ptr, [&](int) {
+    Descriptors point_descriptors = {};
+    std::vector<Match> matches;
+    for (int index = next_candidate.fetch_add(1); index < candidate_count; index = next_candidate.fetch_add(1)) {
+      verify_relocalization_candidate(&candidates[index], snapshot_ptr, frame_ptr, parameters, &point_descriptors,
+                                      &matches);
+    }
+    free_descriptors(&point_descriptors);
+  });
+
+  // Ties go to the better appearance score, which comes first.
+  const RelocalizationCandidate* best_ptr = nullptr;
+  for (const RelocalizationCandidate& candidate : candidates) {
+    if (candidate.located && (best_ptr == nullptr || candidate.pose.inlier_count > best_ptr->pose.inlier_count)) {
+      best_ptr = &candidate;
+    }
+  }
+  if (best_ptr == nullptr) {
+    return false;
+  }
+  result_ptr->keyframe_frame_index = snapshot_ptr->keyframe_frame_indices[best_ptr->keyframe_index];
+  result_ptr->pose = best_ptr->pose;
+  return true;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Largest offset between associated streams, as in the TUM associate.py tool.
+constexpr double max_timestamp_offset = 0.02;
+
+constexpr int groundtruth_pose_size = 7;
+
+// A TUM RGB-D sequence: the image and depth streams plus an index that
+// associates every image with a depth image. Ground truth is read by the
+// trajectory evaluation, see trajectory.h.
+struct Sequence {
+  std::string dataset_path;
+  std::vector<double> image_timestamps;
+  std::vector<std::string> image_paths;
+  std::vector<double> depth_timestamps;
+  std::vector<std::string> depth_paths;
+  // Associated depth entry of every image, -1 if none.
+  std::vector<int> depth_indices;
+};
+
+// Reads a whole file into memory with a terminating zero. Returns false if it
+// does not exist.
+bool read_file_contents(std::vector<char>* contents_ptr, const std::string& path) {
+  FILE* fp = fopen(path.data(), "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  const long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  contents_ptr->resize(size + 1);
+  const size_t read = fread(contents_ptr->data(), 1, size, fp);
+  (*contents_ptr)[read] = '\0';
+
+  fclose(fp);
+  return true;
+}
+
+// Parses the lines of a TUM list, skipping # comments. Every line starts with
+// a timestamp, the rest is handed to parse_line, which returns false for
+// malformed lines.
+template <typename LineParser>
+void parse_timestamped_lines(std::vector<double>* timestamps_ptr, const char* text_ptr, LineParser parse_line) {
+  while (*text_ptr != '\0') {
+    const char* line_end_ptr = text_ptr;
+    while (*line_end_ptr != '\0' && *line_end_ptr != '\n') {
+      ++line_end_ptr;
+    }
+
+    if (*text_ptr != '#') {
+      char* end_ptr = nullptr;
+      const double timestamp = std::strtod(text_ptr, &end_ptr);
+      if (end_ptr != text_ptr && end_ptr <= line_end_ptr && parse_line(end_ptr, line_end_ptr)) {
+        timestamps_ptr->push_back(timestamp);
+      }
+    }
+
+    text_ptr = *line_end_ptr == '\0' ? line_end_ptr : line_end_ptr + 1;
+  }
+}
+
+bool read_file_list(std::vector<double>* timestamps_ptr, std::vector<std::string>* paths_ptr, const std::string& list_path) {
+  std::vector<char> contents;
+  if (!read_file_contents(&contents, list_path)) {
+    return false;
+  }
+
+  timestamps_ptr->clear();
+  paths_ptr->clear();
+  parse_timestamped_lines(timestamps_ptr, contents.data(), [paths_ptr](const char* begin_ptr, const char* end_ptr) {
+    while (begin_ptr < end_ptr && (*begin_ptr == ' ' || *begin_ptr == '\t')) {
+      ++begin_ptr;
+    }
+    while (end_ptr > begin_ptr && (end_ptr[-1] == ' ' || end_ptr[-1] == '\r' || end_ptr[-1] == '\t')) {
+      --end_ptr;
+    }
+    if (begin_ptr == end_ptr) {
+      return false;
+    }
+    paths_ptr->emplace_back(begin_ptr, end_ptr);
+    return true;
+  });
+  return true;
+}
+
+bool read_groundtruth(std::vector<double>* timestamps_ptr, std::vector<double>* poses_ptr, const std::string& groundtruth_path) {
+  std::vector<char> contents;
+  if (!read_file_contents(&contents, groundtruth_path)) {
+    return false;
+  }
+
+  timestamps_ptr->clear();
+  poses_ptr->clear();
+  parse_timestamped_lines(timestamps_ptr, contents.data(), [poses_ptr](const char* begin_ptr, const char*) {
+    double pose[groundtruth_pose_size];
+    for (double& value : pose) {
+      char* end_ptr = nullptr;
+      value = std::strtod(begin_ptr, &end_ptr);
+      if (end_ptr == begin_ptr) {
+        return false;
+      }
+      begin_ptr = end_ptr;
+    }
+    poses_ptr->insert(poses_ptr->end(), pose, pose + groundtruth_pose_size);
+    return true;
+  });
+  return true;
+}
+
+// Merge-join of two sorted timestamp streams. For every reference timestamp
+// writes the index of the closest other timestamp, or -1 when it is further
+// than max_offset away. Both cursors only move forward, so this is linear.
+void associate_timestamps(int* indices_ptr,
+                          const double* reference_ptr,
+                          int reference_count,
+                          const double* other_ptr,
+                          int other_count,
+                          double max_offset) {
+  int other_index = 0;
+  for (int reference_index = 0; reference_index < reference_count; ++reference_index) {
+    const double timestamp = reference_ptr[reference_index];
+    while (other_index + 1 < other_count &&
+           std::abs(other_ptr[other_index + 1] - timestamp) <= std::abs(other_ptr[other_index] - timestamp)) {
+      ++other_index;
+    }
+
+    const bool associated = other_count > 0 && std::abs(other_ptr[other_index] - timestamp) <= max_offset;
+    indices_ptr[reference_index] = associated ? other_index : -1;
+  }
+}
+
+// Loads the stream lists of a sequence and associates them once, so lookups
+// while processing are plain array reads. Depth is optional, the image list
+// is not.
+bool load_sequence(Sequence* sequence_ptr, const std::string& dataset_path, double max_offset = max_timestamp_offset) {
+  sequence_ptr->dataset_path = dataset_path;
+
+  const std::string image_list_path = dataset_path + "rgb.txt";
+  if (!read_file_list(&sequence_ptr->image_timestamps, &sequence_ptr->image_paths, image_list_path)) {
+    fprintf(stderr, "ERROR! Unable to load rgb file: %s\n", image_list_path.data());
+    return false;
+  }
+
+  if (!read_file_list(&sequence_ptr->depth_timestamps, &sequence_ptr->depth_paths, dataset_path + "depth.txt")) {
+    sequence_ptr->depth_timestamps.clear();
+    sequence_ptr->depth_paths.clear();
+  }
+
+  const int image_count = int(sequence_ptr->image_timestamps.size());
+  sequence_ptr->depth_indices.resize(image_count);
+  associate_timestamps(sequence_ptr->depth_indices.data(), sequence_ptr->image_timestamps.data(), image_count,
+                       sequence_ptr->depth_timestamps.data(), int(sequence_ptr->depth_timestamps.size()), max_offset);
+  return true;
+}
+
+bool has_depth(const Sequence* sequence_ptr) {
+  return !sequence_ptr->depth_paths.empty();
+}
+
+std::string get_image_path(const Sequence* sequence_ptr, int image_index) {
+  return sequence_ptr->dataset_path + sequence_ptr->image_paths[image_index];
+}
+
+// Empty when the image has no associated depth.
+std::string get_depth_path(const Sequence* sequence_ptr, int image_index) {
+  const int depth_index = sequence_ptr->depth_indices[image_index];
+  return depth_index < 0 ? std::string() : sequence_ptr->dataset_path + sequence_ptr->depth_paths[depth_index];
+}
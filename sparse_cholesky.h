@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "linalg.h"
+
+// Sparse Cholesky factorization of symmetric positive definite matrices made
+// of 6x6 blocks, like the normal equations of a pose graph. Only the lower
+// triangle is stored, column by column, and the pattern of the factor,
+// including fill-in, is computed once from the pattern of the matrix so the
+// numeric factorization can run in place without allocating.
+
+struct BlockSparseMatrix {
+  int block_count;
+  // Stored blocks of column j are column_offsets[j] to column_offsets[j + 1],
+  // sorted by row with the diagonal block first.
+  std::vector<int> column_offsets;
+  std::vector<int> row_indices;
+  std::vector<Mat6> blocks;
+};
+
+// Minimum degree elimination order of the block graph with the given edges,
+// order[k] is the block eliminated k-th. Pose graphs are long chains with a
+// few loop edges. Eliminated in time order every loop leaves fill along its
+// whole span, while minimum degree first contracts the chains between loop
+// endpoints and leaves a small dense system over the endpoints.
+void compute_minimum_degree_ordering(int* order_ptr, int block_count, const int* rows_ptr, const int* columns_ptr, int count) {
+  std::vector<std::vector<int>> adjacency(block_count);
+  for (int index = 0; index < count; ++index) {
+    if (rows_ptr[index] != columns_ptr[index]) {
+      adjacency[rows_ptr[index]].push_back(columns_ptr[index]);
+      adjacency[columns_ptr[index]].push_back(rows_ptr[index]);
+    }
+  }
+
+  using Entry = std::pair<int, int>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+  for (int block = 0; block < block_count; ++block) {
+    std::vector<int>& neighbours = adjacency[block];
+    std::sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+    queue.push({ int(neighbours.size()), block });
+  }
+
+  // Eliminating a block turns its neighbours into a clique. Queue entries
+  // whose degree went stale are skipped when popped.
+  std::vector<unsigned char> eliminated(block_count, 0);
+  std::vector<int> merged;
+  int position = 0;
+  while (!queue.empty()) {
+    const Entry entry = queue.top();
+    queue.pop();
+    const int block = entry.second;
+    if (eliminated[block] || entry.first != int(adjacency[block].size())) {
+      continue;
+    }
+    eliminated[block] = 1;
+    order_ptr[position++] = block;
+
+    const std::vector<int>& neighbours = adjacency[block];
+    for (const int neighbour : neighbours) {
+      std::vector<int>& other = adjacency[neighbour];
+      merged.clear();
+      std::set_union(other.begin(), other.end(), neighbours.begin(), neighbours.end(), std::back_inserter(merged));
+      merged.erase(std::remove_if(merged.begin(), merged.end(),
+                                  [block, neighbour](int value) { return value == block || value == neighbour; }),
+                   merged.end());
+      other.swap(merged);
+      queue.push({ int(other.size()), neighbour });
+    }
+    std::vector<int>().swap(adjacency[block]);
+  }
+}
+
+// Builds the pattern of the Cholesky factor of a block_count x block_count
+// block matrix whose off-diagonal non-zero blocks are (rows[k], columns[k]),
+// either triangle. Column j of the factor holds column j of the matrix plus
+// the rows of every column whose first off-diagonal row is j, which is the
+// elimination tree recurrence. Blocks are zeroed.
+void analyze_block_sparse_pattern(BlockSparseMatrix* matrix_ptr,
+                                  int block_count,
+                                  const int* rows_ptr,
+                                  const int* columns_ptr,
+                                  int count) {
+  std::vector<std::vector<int>> column_rows(block_count);
+  for (int index = 0; index < count; ++index) {
+    const int row = std::max(rows_ptr[index], columns_ptr[index]);
+    const int column = std::min(rows_ptr[index], columns_ptr[index]);
+    if (row != column) {
+      column_rows[column].push_back(row);
+    }
+  }
+
+  matrix_ptr->block_count = block_count;
+  matrix_ptr->column_offsets.assign(1, 0);
+  matrix_ptr->row_indices.clear();
+  for (int column = 0; column < block_count; ++column) {
+    std::vector<int>& rows = column_rows[column];
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+    matrix_ptr->row_indices.push_back(column);
+    matrix_ptr->row_indices.insert(matrix_ptr->row_indices.end(), rows.begin(), rows.end());
+    matrix_ptr->column_offsets.push_back(int(matrix_ptr->row_indices.size()));
+
+    // Eliminating this column couples all of its rows, which lands in the
+    // column of its parent in the elimination tree.
+    if (rows.size() > 1) {
+      std::vector<int>& parent_rows = column_rows[rows[0]];
+      parent_rows.insert(parent_rows.end(), rows.begin() + 1, rows.end());
+    }
+    std::vector<int>().swap(rows);
+  }
+  matrix_ptr->blocks.assign(matrix_ptr->row_indices.size(), Mat6{});
+}
+
+void clear_block_sparse_values(BlockSparseMatrix* matrix_ptr) {
+  std::fill(matrix_ptr->blocks.begin(), matrix_ptr->blocks.end(), Mat6{});
+}
+
+// Block (row, column) of the lower triangle, which has to be in the pattern.
+Mat6* get_block_ptr(BlockSparseMatrix* matrix_ptr, int row, int column) {
+  const int* begin_ptr = matrix_ptr->row_indices.data() + matrix_ptr->column_offsets[column];
+  const int* end_ptr = matrix_ptr->row_indices.data() + matrix_ptr->column_offsets[column + 1];
+  return matrix_ptr->blocks.data() + (std::lower_bound(begin_ptr, end_ptr, row) - matrix_ptr->row_indices.data());
+}
+
+// Dense Cholesky of one diagonal block in place, the lower triangle becomes
+// L and the strict upper triangle is cleared.
+bool factor_diagonal_block(Mat6* a_ptr) {
+  double (&a)[6][6] = a_ptr->m;
+  for (int j = 0; j < 6; ++j) {
+    double diagonal = a[j][j];
+    for (int k = 0; k < j; ++k) {
+      diagonal -= a[j][k] * a[j][k];
+    }
+    if (!(diagonal > 0.0)) {
+      return false;
+    }
+    a[j][j] = std::sqrt(diagonal);
+    for (int i = j + 1; i < 6; ++i) {
+      double value = a[i][j];
+      for (int k = 0; k < j; ++k) {
+        value -= a[i][k] * a[j][k];
+      }
+      a[i][j] = value / a[j][j];
+      a[j][i] = 0.0;
+    }
+  }
+  return true;
+}
+
+// a <- a * l^-T for lower triangular l.
+void solve_lower_transposed_right(Mat6* a_ptr, const Mat6& l) {
+  for (int row = 0; row < 6; ++row) {
+    double* a_row = a_ptr->m[row];
+    for (int column = 0; column < 6; ++column) {
+      double value = a_row[column];
+      for (int k = 0; k < column; ++k) {
+        value -= a_row[k] * l.m[column][k];
+      }
+      a_row[column] = value / l.m[column][column];
+    }
+  }
+}
+
+// c -= a * b^T.
+void subtract_outer_block(Mat6* c_ptr, const Mat6& a, const Mat6& b) {
+  for (int row = 0; row < 6; ++row) {
+    for (int column = 0; column < 6; ++column) {
+      double value = 0.0;
+      for (int k = 0; k < 6; ++k) {
+        value += a.m[row][k] * b.m[column][k];
+      }
+      c_ptr->m[row][column] -= value;
+    }
+  }
+}
+
+// Right-looking factorization A = L L^T in place. Returns false if the
+// matrix is not positive definite.
+bool factor_block_sparse(BlockSparseMatrix* matrix_ptr) {
+  const int* offsets_ptr = matrix_ptr->column_offsets.data();
+  const int* rows_ptr = matrix_ptr->row_indices.data();
+  Mat6* blocks_ptr = matrix_ptr->blocks.data();
+
+  for (int column = 0; column < matrix_ptr->block_count; ++column) {
+    const int begin = offsets_ptr[column];
+    const int end = offsets_ptr[column + 1];
+    if (!factor_diagonal_block(&blocks_ptr[begin])) {
+      return false;
+    }
+    for (int index = begin + 1; index < end; ++index) {
+      solve_lower_transposed_right(&blocks_ptr[index], blocks_ptr[begin]);
+    }
+
+    // Schur complement update of the trailing columns this one touches. The
+    // rows of column k are a superset of the rows of this column below k,
+    // so one forward walk finds every target block.
+    for (int k_index = begin + 1; k_index < end; ++k_index) {
+      const int k = rows_ptr[k_index];
+      int target = offsets_ptr[k];
+      for (int i_index = k_index; i_index < end; ++i_index) {
+        while (rows_ptr[target] != rows_ptr[i_index]) {
+          ++target;
+        }
+        subtract_outer_block(&blocks_ptr[target], blocks_ptr[i_index], blocks_ptr[k_index]);
+      }
+    }
+  }
+  return true;
+}
+
+// Solves L L^T x = b in place with a factored matrix, x holds 6 values per
+// block.
+void solve_block_sparse(const BlockSparseMatrix* matrix_ptr, double* x_ptr) {
+  const int* offsets_ptr = matrix_ptr->column_offsets.data();
+  const int* rows_ptr = matrix_ptr->row_indices.data();
+  const Mat6* blocks_ptr = matrix_ptr->blocks.data();
+
+  for (int column = 0; column < matrix_ptr->block_count; ++column) {
+    const Mat6& l = blocks_ptr[offsets_ptr[column]];
+    double* x = x_ptr + 6 * column;
+    for (int i = 0; i < 6; ++i) {
+      double value = x[i];
+      for (int k = 0; k < i; ++k) {
+        value -= l.m[i][k] * x[k];
+      }
+      x[i] = value / l.m[i][i];
+    }
+    for (int index = offsets_ptr[column] + 1; index < offsets_ptr[column + 1]; ++index) {
+      double* y = x_ptr + 6 * rows_ptr[index];
+      const Mat6& block = blocks_ptr[index];
+      for (int i = 0; i < 6; ++i) {
+        for (int k = 0; k < 6; ++k) {
+          y[i] -= block.m[i][k] * x[k];
+        }
+      }
+    }
+  }
+
+  for (int column = matrix_ptr->block_count - 1; column >= 0; --column) {
+    double* x = x_ptr + 6 * column;
+    for (int index = offsets_ptr[column] + 1; index < offsets_ptr[column + 1]; ++index) {
+      const double* y = x_ptr + 6 * rows_ptr[index];
+      const Mat6& block = blocks_ptr[index];
+      for (int k = 0; k < 6; ++k) {
+        for (int i = 0; i < 6; ++i) {
+          x[k] -= block.m[i][k] * y[i];
+        }
+      }
+    }
+    const Mat6& l = blocks_ptr[offsets_ptr[column]];
+    for (int i = 5; i >= 0; --i) {
+      double value = x[i];
+      for (int k = i + 1; k < 6; ++k) {
+        value -= l.m[k][i] * x[k];
+      }
+      x[i] = value / l.m[i][i];
+    }
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// The capacity is rounded up to a power of two. Head and tail live on their
+// own cache lines so the two threads do not false share.
+template <typename T>
+struct SpscQueue {
+  std::vector<T> slots;
+  uint32_t mask;
+  // Next slot to read, written by the consumer only.
+  alignas(64) std::atomic<uint32_t> head;
+  // Next slot to write, written by the producer only.
+  alignas(64) std::atomic<uint32_t> tail;
+};
+
+template <typename T>
+void init_spsc_queue(SpscQueue<T>* queue_ptr, uint32_t capacity) {
+  uint32_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  queue_ptr->slots.resize(size);
+  queue_ptr->mask = size - 1;
+  queue_ptr->head.store(0, std::memory_order_relaxed);
+  queue_ptr->tail.store(0, std::memory_order_relaxed);
+}
+
+// Producer side. Returns false when the queue is full.
+template <typename T>
+bool try_push(SpscQueue<T>* queue_ptr, const T& value) {
+  const uint32_t tail = queue_ptr->tail.load(std::memory_order_relaxed);
+  if (tail - queue_ptr->head.load(std::memory_order_acquire) > queue_ptr->mask) {
+    return false;
+  }
+  queue_ptr->slots[tail & queue_ptr->mask] = value;
+  queue_ptr->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// Consumer side. Returns false when the queue is empty.
+template <typename T>
+bool try_pop(SpscQueue<T>* queue_ptr, T* value_ptr) {
+  const uint32_t head = queue_ptr->head.load(std::memory_order_relaxed);
+  if (head == queue_ptr->tail.load(std::memory_order_acquire)) {
+    return false;
+  }
+  *value_ptr = std::move(queue_ptr->slots[head & queue_ptr->mask]);
+  queue_ptr->head.store(head + 1, std::memory_order_release);
+  return true;
+}
@@ -0,0 +1,148 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "camera.h"
+#include "linalg.h"
+#include "map_points.h"
+
+// The AVX2 path of project_map_points repeats the distortion model of
+// camera.h, so every slot is checked against project_point in double
+// precision: dead slots, points behind the camera and points off the image
+// have to come out as u = v = -1, all others at the distorted pixel. The
+// slot count is not a multiple of 8, so the scalar tail is checked as well.
+//
+//   test_map_points
+
+struct ExpectedProjection {
+  bool visible;
+  // Pixel position or signed distance to the image border and depth limit
+  // is within rounding, so float and double may disagree on visibility.
+  bool ambiguous;
+  double u;
+  double v;
+};
+
+ExpectedProjection project_expected(const Camera* camera_ptr, const Mat3& rotation, const Vec3& translation,
+                                    const Vec3& point, bool alive) {
+  ExpectedProjection expected = {};
+  if (!alive) {
+    return expected;
+  }
+  const Vec3 camera_point = rotation * point + translation;
+  const double x = camera_point.x / camera_point.z;
+  const double y = camera_point.y / camera_point.z;
+  const double r2 = x * x + y * y;
+  const double radial = 1.0 + r2 * (camera_ptr->k1 + r2 * (camera_ptr->k2 + r2 * camera_ptr->k3));
+  const double distorted_x = x * radial + 2.0 * camera_ptr->p1 * x * y + camera_ptr->p2 * (r2 + 2.0 * x * x);
+  const double distorted_y = y * radial + camera_ptr->p1 * (r2 + 2.0 * y * y) + 2.0 * camera_ptr->p2 * x * y;
+  expected.u = camera_ptr->fx * distorted_x + camera_ptr->cx;
+  expected.v = camera_ptr->fy * distorted_y + camera_ptr->cy;
+
+  const double min_depth = 0.01;
+  const double margin = 1e-2;
+  expected.visible = camera_point.z > min_depth && expected.u >= 0.0 && expected.u < camera_ptr->width &&
+                     expected.v >= 0.0 && expected.v < camera_ptr->height;
+  expected.ambiguous = std::fabs(camera_point.z - min_depth) < 1e-5 ||
+                       (camera_point.z > min_depth &&
+                        (std::fabs(expected.u) < margin || std::fabs(expected.u - camera_ptr->width) < margin ||
+                         std::fabs(expected.v) < margin || std::fabs(expected.v - camera_ptr->height) < margin));
+  return expected;
+}
+
+int main() {
+  // Distortion of the TUM freiburg1 camera, so the polynomial is exercised.
+  Camera camera = {};
+  camera.width = 640;
+  camera.height = 480;
+  camera.fx = 517.3f;
+  camera.fy = 516.5f;
+  camera.cx = 318.6f;
+  camera.cy = 255.3f;
+  camera.k1 = 0.2624f;
+  camera.k2 = -0.9531f;
+  camera.p1 = -0.0054f;
+  camera.p2 = 0.0026f;
+  camera.k3 = 1.1633f;
+
+  const unsigned char descriptor[descriptor_size] = {};
+  int failure_count = 0;
+  int visible_count = 0;
+  int invisible_count = 0;
+  for (int seed = 0; seed < 20; ++seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+
+    const Mat3 rotation = exp_so3({ 0.2 * uniform(rng), 0.2 * uniform(rng), 0.2 * uniform(rng) });
+    const Vec3 translation = { 0.5 * uniform(rng), 0.5 * uniform(rng), 0.5 * uniform(rng) };
+    const Mat3 inverse_rotation = transpose(rotation);
+
+    // Points placed in camera coordinates: mostly in view, some behind the
+    // camera, some just past the depth limit and some off the image.
+    MapPoints map_points = {};
+    std::vector<MapPointHandle> handles;
+    const int count = 1003;
+    for (int index = 0; index < count; ++index) {
+      Vec3 camera_point;
+      switch (index % 5) {
+      case 0:
+        camera_point = { uniform(rng), uniform(rng), -0.01 - 3.0 * (uniform(rng) + 1.0) };
+        break;
+      case 1:
+        camera_point = { 0.001 * uniform(rng), 0.001 * uniform(rng), 0.01 + 0.005 * uniform(rng) };
+        break;
+      case 2: {
+        const double z = 1.0 + 2.0 * (uniform(rng) + 1.0);
+        camera_point = { z * (0.8 + 0.4 * uniform(rng)), z * 0.8 * uniform(rng), z };
+        break;
+      }
+      default: {
+        const double z = 0.5 + 2.0 * (uniform(rng) + 1.0);
+        camera_point = { z * 0.55 * uniform(rng), z * 0.45 * uniform(rng), z };
+        break;
+      }
+      }
+      handles.push_back(add_map_point(&map_points, inverse_rotation * (camera_point - translation), descriptor));
+    }
+    // Dead slots, every seventh point.
+    for (int index = 0; index < count; index += 7) {
+      remove_map_point(&map_points, handles[index]);
+    }
+
+    std::vector<float> u(count), v(count);
+    project_map_points(u.data(), v.data(), &map_points, rotation, translation, &camera);
+
+    for (int index = 0; index < count; ++index) {
+      const Vec3 point = { map_points.x[index], map_points.y[index], map_points.z[index] };
+      const ExpectedProjection expected =
+          project_expected(&camera, rotation, translation, point, map_points.alive[index] != 0);
+      const bool visible = !(u[index] == -1.0f && v[index] == -1.0f);
+      if (expected.ambiguous && visible != expected.visible) {
+        continue;
+      }
+      bool correct;
+      if (expected.visible) {
+        correct = visible && std::fabs(u[index] - expected.u) < 1e-2 && std::fabs(v[index] - expected.v) < 1e-2;
+        ++visible_count;
+      } else {
+        correct = u[index] == -1.0f && v[index] == -1.0f;
+        ++invisible_count;
+      }
+      if (!correct) {
+        fprintf(stderr, "FAILED: seed %d, slot %d: (%f, %f) instead of (%f, %f)%s\n", seed, index, u[index], v[index],
+                expected.visible ? expected.u : -1.0, expected.visible ? expected.v : -1.0,
+                map_points.alive[index] ? "" : ", dead");
+        ++failure_count;
+      }
+    }
+    free_map_points(&map_points);
+  }
+
+  if (failure_count > 0) {
+    return EXIT_FAILURE;
+  }
+  printf("Map point projection matches the camera model: %d visible, %d invisible\n", visible_count, invisible_count);
+  return EXIT_SUCCESS;
+}
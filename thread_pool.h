@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that all run the same task, fork-join style.
+// The calling thread takes part as worker 0, so a pool of one thread runs
+// everything inline.
+struct ThreadPool {
+  int thread_count;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable start_condition;
+  std::condition_variable done_condition;
+  std::function<void(int)> task;
+  int generation;
+  int running_count;
+  bool stopping;
+};
+
+void run_thread_pool_worker(ThreadPool* pool_ptr, int worker_index) {
+  int seen_generation = 0;
+  for (;;) {
+    std::unique_lock<std::mutex> lock(pool_ptr->mutex);
+    pool_ptr->start_condition.wait(lock, [&]() { return pool_ptr->stopping || pool_ptr->generation != seen_generation; });
+    if (pool_ptr->stopping) {
+      return;
+    }
+    seen_generation = pool_ptr->generation;
+    lock.unlock();
+
+    pool_ptr->task(worker_index);
+
+    lock.lock();
+    if (--pool_ptr->running_count == 0) {
+      pool_ptr->done_condition.notify_one();
+    }
+  }
+}
+
+// A thread_count of zero uses every hardware thread.
+void init_thread_pool(ThreadPool* pool_ptr, int thread_count = 0) {
+  if (thread_count <= 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  pool_ptr->thread_count = thread_count;
+  pool_ptr->generation = 0;
+  pool_ptr->running_count = 0;
+  pool_ptr->stopping = false;
+  for (int worker_index = 1; worker_index < thread_count; ++worker_index) {
+    pool_ptr->threads.emplace_back(run_thread_pool_worker, pool_ptr, worker_index);
+  }
+}
+
+// Runs task(worker_index) once on every worker and returns when all are done.
+void run_on_all_threads(ThreadPool* pool_ptr, const std::function<void(int)>& task) {
+  if (pool_ptr == nullptr || pool_ptr->thread_count <= 1) {
+    task(0);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(pool_ptr->mutex);
+    pool_ptr->task = task;
+    pool_ptr->running_count = pool_ptr->thread_count - 1;
+    ++pool_ptr->generation;
+  }
+  pool_ptr->start_condition.notify_all();
+
+  task(0);
+
+  std::unique_lock<std::mutex> lock(pool_ptr->mutex);
+  pool_ptr->done_condition.wait(lock, [&]() { return pool_ptr->running_count == 0; });
+}
+
+void free_thread_pool(ThreadPool* pool_ptr) {
+  {
+    std::lock_guard<std::mutex> lock(pool_ptr->mutex);
+    pool_ptr->stopping = true;
+  }
+  pool_ptr->start_condition.notify_all();
+  for (std::thread& thread : pool_ptr->threads) {
+    thread.join();
+  }
+  pool_ptr->threads.clear();
+}
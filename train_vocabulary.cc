@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "buffer_pool.h"
+#include "frame.h"
+#include "image.h"
+#include "orb.h"
+#include "sequence.h"
+#include "vocabulary.h"
+
+// Offline vocabulary trainer. Extracts the tracker's ORB features from every
+// frame_step-th image of a TUM sequence and writes the binary vocabulary that
+// the tracker maps at startup.
+//
+//   train_vocabulary <dataset path> <output file> [frame step] [branching] [depth]
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <dataset path> <output file> [frame step] [branching] [depth]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string dataset_path = argv[1];
+  if (dataset_path.back() != '/') {
+    dataset_path += '/';
+  }
+  const char* output_path = argv[2];
+  const int frame_step = argc > 3 ? std::max(1, std::atoi(argv[3])) : 10;
+  VocabularyTrainingParameters parameters = {};
+  if (argc > 4) {
+    parameters.branching = std::max(2, std::atoi(argv[4]));
+  }
+  if (argc > 5) {
+    parameters.depth = std::max(1, std::atoi(argv[5]));
+  }
+
+  Sequence sequence = {};
+  if (!load_sequence(&sequence, dataset_path)) {
+    return EXIT_FAILURE;
+  }
+
+  static OrbPattern orb_pattern;
+  init_orb_pattern(&orb_pattern);
+  BufferPool buffer_pool = {};
+
+  Descriptors descriptors = {};
+  std::vector<int> image_indices;
+  int image_count = 0;
+  const int sequence_length = int(sequence.image_paths.size());
+  for (int image_index = 0; image_index < sequence_length; image_index += frame_step) {
+    const std::string image_path = get_image_path(&sequence, image_index);
+    Image rgb_image = {};
+    rgb_image.data_ptr = stbi_load(image_path.data(), &rgb_image.width, &rgb_image.height, &rgb_image.channels, 3);
+    if (rgb_image.data_ptr == nullptr) {
+      fprintf(stderr, "ERROR! Unable to load image: %s\n", image_path.data());
+      continue;
+    }
+
+    Image grey_image = {};
+    convert_image_to_greyscale(&grey_image, &rgb_image);
+    stbi_image_free(const_cast<unsigned char*>(rgb_image.data_ptr));
+
+    Frame frame = {};
+    init_frame(&frame, &grey_image, 1);
+    extract_frame_features(&frame, &orb_pattern, &buffer_pool);
+
+    const int count = frame.descriptors.count;
+    reserve_descriptors(&descriptors, std::max(descriptors.count + count, 2 * descriptors.capacity));
+    std::memcpy(descriptors.data_ptr + descriptor_size * descriptors.count, frame.descriptors.data_ptr,
+                descriptor_size * count);
+    descriptors.count += count;
+    image_indices.insert(image_indices.end(), count, image_count);
+    ++image_count;
+
+    release_frame(&frame, &buffer_pool);
+  }
+
+  printf("Training on %d descriptors from %d images, branching %d, depth %d\n", descriptors.count, image_count,
+         parameters.branching, parameters.depth);
+
+  Vocabulary vocabulary = {};
+  train_vocabulary(&vocabulary, &descriptors, image_indices.data(), image_count, parameters);
+  printf("Vocabulary: %d words, %d nodes\n", vocabulary.word_count, vocabulary.node_count);
+
+  const bool saved = save_vocabulary(&vocabulary, output_path);
+  free_vocabulary(&vocabulary);
+  free_descriptors(&descriptors);
+  free_buffer_pool(&buffer_pool);
+  return saved ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "linalg.h"
+#include "sequence.h"
+
+// Camera trajectories in the TUM format, "timestamp tx ty tz qx qy qz qw" per
+// line, and their evaluation against ground truth: absolute trajectory error
+// after a rigid or similarity alignment, and relative pose error over a fixed
+// time step, as in the TUM benchmark tools.
+
+struct Trajectory {
+  // Sorted by timestamp.
+  std::vector<double> timestamps;
+  // Camera to world like the TUM files, unlike the world to camera poses
+  // used everywhere else.
+  std::vector<Pose> poses;
+};
+
+// Takes a world to camera pose.
+void add_trajectory_pose(Trajectory* trajectory_ptr, double timestamp, const Mat3& rotation, const Vec3& translation) {
+  trajectory_ptr->timestamps.push_back(timestamp);
+  trajectory_ptr->poses.push_back(inverse(Pose{ rotation, translation }));
+}
+
+bool write_trajectory(const Trajectory* trajectory_ptr, const std::string& path) {
+  FILE* fp = fopen(path.data(), "w");
+  if (fp == nullptr) {
+    fprintf(stderr, "ERROR! Unable to write trajectory: %s\n", path.data());
+    return false;
+  }
+
+  fprintf(fp, "# timestamp tx ty tz qx qy qz qw\n");
+  for (size_t index = 0; index < trajectory_ptr->poses.size(); ++index) {
+    const Pose& pose = trajectory_ptr->poses[index];
+    const Quaternion q = quaternion_from_rotation(pose.rotation);
+    fprintf(fp, "%.6f %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", trajectory_ptr->timestamps[index], pose.translation.x,
+            pose.translation.y, pose.translation.z, q.x, q.y, q.z, q.w);
+  }
+
+  fclose(fp);
+  return true;
+}
+
+// Ground truth files share the format, so the ground truth reader does the
+// parsing.
+bool read_trajectory(Trajectory* trajectory_ptr, const std::string& path) {
+  std::vector<double> values;
+  if (!read_groundtruth(&trajectory_ptr->timestamps, &values, path)) {
+    fprintf(stderr, "ERROR! Unable to load trajectory: %s\n", path.data());
+    return false;
+  }
+
+  const int count = int(trajectory_ptr->timestamps.size());
+  trajectory_ptr->poses.resize(count);
+  for (int index = 0; index < count; ++index) {
+    const double* value_ptr = values.data() + groundtruth_pose_size * index;
+    const Quaternion q = normalized(Quaternion{ value_ptr[3], value_ptr[4], value_ptr[5], value_ptr[6] });
+    trajectory_ptr->poses[index] = { rotation_from_quaternion(q), { value_ptr[0], value_ptr[1], value_ptr[2] } };
+  }
+  return true;
+}
+
+// reference ~ scale * rotation * estimate + translation.
+struct TrajectoryAlignment {
+  Mat3 rotation;
+  Vec3 translation;
+  double scale;
+};
+
+// Umeyama's closed form least squares alignment of two point sets, rigid or
+// with scale. svd_3x3 returns proper rotations with the sign of the
+// determinant in the last singular value, which is exactly the reflection
+// correction of the method. Returns false for fewer than three points or a
+// degenerate estimate.
+bool align_points(TrajectoryAlignment* alignment_ptr,
+                  const Vec3* estimate_ptr,
+                  const Vec3* reference_ptr,
+                  int count,
+                  bool with_scale) {
+  if (count < 3) {
+    return false;
+  }
+
+  Vec3 estimate_mean = {};
+  Vec3 reference_mean = {};
+  for (int index = 0; index < count; ++index) {
+    estimate_mean = estimate_mean + estimate_ptr[index];
+    reference_mean = reference_mean + reference_ptr[index];
+  }
+  estimate_mean = (1.0 / count) * estimate_mean;
+  reference_mean = (1.0 / count) * reference_mean;
+
+  // Covariance sum (reference - mean) * (estimate - mean)^T.
+  Mat3 covariance = {};
+  double estimate_variance = 0.0;
+  for (int index = 0; index < count; ++index) {
+    const Vec3 e = estimate_ptr[index] - estimate_mean;
+    const Vec3 r = reference_ptr[index] - reference_mean;
+    const double ev[3] = { e.x, e.y, e.z };
+    const double rv[3] = { r.x, r.y, r.z };
+    for (int row = 0; row < 3; ++row) {
+      for (int column = 0; column < 3; ++column) {
+        covariance.m[row][column] += rv[row] * ev[column];
+      }
+    }
+    estimate_variance += dot(e, e);
+  }
+  if (!(estimate_variance > 0.0)) {
+    return false;
+  }
+
+  Mat3 u;
+  Vec3 s;
+  Mat3 v;
+  svd_3x3(covariance, &u, &s, &v);
+  alignment_ptr->rotation = u * transpose(v);
+  alignment_ptr->scale = with_scale ? (s.x + s.y + s.z) / estimate_variance : 1.0;
+  alignment_ptr->translation = reference_mean - alignment_ptr->scale * (alignment_ptr->rotation * estimate_mean);
+  return true;
+}
+
+struct TrajectoryEvaluationParameters {
+  double max_offset = max_timestamp_offset;
+  // Similarity instead of rigid alignment, needed for monocular runs whose
+  // scale is arbitrary.
+  bool align_scale = false;
+  // Time step of the relative pose error in seconds.
+  double rpe_delta = 1.0;
+};
+
+struct TrajectoryErrors {
+  // Estimated poses with a ground truth pose within max_offset.
+  int pose_count;
+  TrajectoryAlignment alignment;
+  // Absolute trajectory error of the aligned positions in metres.
+  double ate_rmse;
+  double ate_mean;
+  double ate_median;
+  double ate_max;
+  int rpe_count;
+  double rpe_translation_rmse;
+  double rpe_rotation_rmse_degrees;
+};
+
+// Associates the estimate with the reference in one merge over the sorted
+// timestamps, aligns the positions and computes ATE and RPE. RPE pairs every
+// pose with the first one at least rpe_delta later, again with a forward
+// only cursor, so the whole evaluation is linear apart from the median.
+// Returns false when fewer than three poses can be associated.
+bool evaluate_trajectory(TrajectoryErrors* errors_ptr,
+                         const Trajectory* estimate_ptr,
+                         const Trajectory* reference_ptr,
+                         const TrajectoryEvaluationParameters& parameters = {}) {
+  *errors_ptr = {};
+  const int estimate_count = int(estimate_ptr->timestamps.size());
+  std::vector<int> reference_indices(estimate_count);
+  associate_timestamps(reference_indices.data(), estimate_ptr->timestamps.data(), estimate_count,
+                       reference_ptr->timestamps.data(), int(reference_ptr->timestamps.size()), parameters.max_offset);
+
+  std::vector<double> timestamps;
+  std::vector<Pose> estimate_poses;
+  std::vector<Pose> reference_poses;
+  std::vector<Vec3> estimate_positions;
+  std::vector<Vec3> reference_positions;
+  for (int index = 0; index < estimate_count; ++index) {
+    if (reference_indices[index] < 0) {
+      continue;
+    }
+    timestamps.push_back(estimate_ptr->timestamps[index]);
+    estimate_poses.push_back(estimate_ptr->poses[index]);
+    reference_poses.push_back(reference_ptr->poses[reference_indices[index]]);
+    estimate_positions.push_back(estimate_poses.back().translation);
+    reference_positions.push_back(reference_poses.back().translation);
+  }
+  const int count = int(timestamps.size());
+  errors_ptr->pose_count = count;
+
+  TrajectoryAlignment* alignment_ptr = &errors_ptr->alignment;
+  if (!align_points(alignment_ptr, estimate_positions.data(), reference_positions.data(), count,
+                    parameters.align_scale)) {
+    return false;
+  }
+
+  std::vector<double> position_errors(count);
+  double squared_sum = 0.0;
+  double sum = 0.0;
+  for (int index = 0; index < count; ++index) {
+    const Vec3 aligned =
+        alignment_ptr->scale * (alignment_ptr->rotation * estimate_positions[index]) + alignment_ptr->translation;
+    const double error = norm(aligned - reference_positions[index]);
+    position_errors[index] = error;
+    squared_sum += error * error;
+    sum += error;
+    errors_ptr->ate_max = std::max(errors_ptr->ate_max, error);
+  }
+  errors_ptr->ate_rmse = std::sqrt(squared_sum / count);
+  errors_ptr->ate_mean = sum / count;
+  std::nth_element(position_errors.begin(), position_errors.begin() + count / 2, position_errors.end());
+  errors_ptr->ate_median = position_errors[count / 2];
+
+  // Relative motions are independent of the rigid part of the alignment,
+  // only the scale applies.
+  double translation_squared_sum = 0.0;
+  double rotation_squared_sum = 0.0;
+  int later = 0;
+  for (int index = 0; index < count; ++index) {
+    later = std::max(later, index + 1);
+    while (later < count && timestamps[later] - timestamps[index] < parameters.rpe_delta) {
+      ++later;
+    }
+    if (later == count) {
+      break;
+    }
+
+    Pose estimate_motion = inverse(estimate_poses[index]) * estimate_poses[later];
+    estimate_motion.translation = alignment_ptr->scale * estimate_motion.translation;
+    const Pose reference_motion = inverse(reference_poses[index]) * reference_poses[later];
+    const Pose error = inverse(reference_motion) * estimate_motion;
+    translation_squared_sum += dot(error.translation, error.translation);
+    const double angle = norm(log_so3(error.rotation));
+    rotation_squared_sum += angle * angle;
+    ++errors_ptr->rpe_count;
+  }
+  if (errors_ptr->rpe_count > 0) {
+    errors_ptr->rpe_translation_rmse = std::sqrt(translation_squared_sum / errors_ptr->rpe_count);
+    errors_ptr->rpe_rotation_rmse_degrees = std::sqrt(rotation_squared_sum / errors_ptr->rpe_count) * 180.0 / pi;
+  }
+  return true;
+}
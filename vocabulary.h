@@ -0,0 +1,491 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "matching.h"
+#include "orb.h"
+
+// Bag of binary words: a hierarchical k-medians tree over ORB descriptors
+// whose leaves are the words. A descriptor is quantized by walking down the
+// tree to the closest child at every level, so the cost is branching * depth
+// Hamming distances instead of one per word.
+//
+// The vocabulary lives in one flat buffer laid out exactly like the file, so
+// loading is a single mmap and nothing is parsed:
+//   VocabularyHeader                      64 bytes
+//   node descriptors                      node_count * descriptor_size
+//   first child of every node             node_count * int32, -1 for words
+//   child count of every node             node_count * int32
+//   word of every node                    node_count * int32, -1 for inner nodes
+//   idf weight of every word              word_count * float
+// Nodes are stored breadth first so the children of a node are contiguous.
+// Node 0 is the root and has no descriptor.
+
+constexpr char vocabulary_magic[8] = { 'V', 'O', 'F', 'S', 'V', 'O', 'C', 'B' };
+constexpr uint32_t vocabulary_version = 1;
+
+struct VocabularyHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t descriptor_size;
+  uint32_t branching;
+  uint32_t depth;
+  uint32_t node_count;
+  uint32_t word_count;
+  uint32_t reserved[8];
+};
+
+static_assert(sizeof(VocabularyHeader) == 64, "node descriptors have to stay 32 byte aligned");
+
+struct Vocabulary {
+  int branching;
+  int depth;
+  int node_count;
+  int word_count;
+  const unsigned char* node_descriptors_ptr;
+  const int32_t* first_children_ptr;
+  const int32_t* child_counts_ptr;
+  const int32_t* node_words_ptr;
+  const float* word_weights_ptr;
+  // Backing buffer, either mapped from a file or allocated by the trainer.
+  unsigned char* buffer_ptr;
+  size_t buffer_size;
+  bool mapped;
+};
+
+size_t get_vocabulary_buffer_size(int node_count, int word_count) {
+  return sizeof(VocabularyHeader) + size_t(node_count) * descriptor_size + 3 * sizeof(int32_t) * size_t(node_count) +
+         sizeof(float) * size_t(word_count);
+}
+
+// Points the arrays into the buffer, which holds a header already.
+void bind_vocabulary_buffer(Vocabulary* vocabulary_ptr) {
+  const VocabularyHeader* header_ptr = reinterpret_cast<const VocabularyHeader*>(vocabulary_ptr->buffer_ptr);
+  vocabulary_ptr->branching = int(header_ptr->branching);
+  vocabulary_ptr->depth = int(header_ptr->depth);
+  vocabulary_ptr->node_count = int(header_ptr->node_count);
+  vocabulary_ptr->word_count = int(header_ptr->word_count);
+
+  const unsigned char* data_ptr = vocabulary_ptr->buffer_ptr + sizeof(VocabularyHeader);
+  const size_t node_count = header_ptr->node_count;
+  vocabulary_ptr->node_descriptors_ptr = data_ptr;
+  data_ptr += node_count * descriptor_size;
+  vocabulary_ptr->first_children_ptr = reinterpret_cast<const int32_t*>(data_ptr);
+  data_ptr += node_count * sizeof(int32_t);
+  vocabulary_ptr->child_counts_ptr = reinterpret_cast<const int32_t*>(data_ptr);
+  data_ptr += node_count * sizeof(int32_t);
+  vocabulary_ptr->node_words_ptr = reinterpret_cast<const int32_t*>(data_ptr);
+  data_ptr += node_count * sizeof(int32_t);
+  vocabulary_ptr->word_weights_ptr = reinterpret_cast<const float*>(data_ptr);
+}
+
+// Maps a vocabulary file read-only. The pages are shared with every other
+// process using the same file and are only faulted in as the tree is walked.
+bool load_vocabulary(Vocabulary* vocabulary_ptr, const char* path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR! Unable to open vocabulary: %s\n", path);
+    return false;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || size_t(file_stat.st_size) < sizeof(VocabularyHeader)) {
+    fprintf(stderr, "ERROR! Vocabulary too small: %s\n", path);
+    close(fd);
+    return false;
+  }
+
+  const size_t size = size_t(file_stat.st_size);
+  void* mapping_ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping_ptr == MAP_FAILED) {
+    fprintf(stderr, "ERROR! Unable to map vocabulary: %s\n", path);
+    return false;
+  }
+
+  const VocabularyHeader* header_ptr = static_cast<const VocabularyHeader*>(mapping_ptr);
+  if (std::memcmp(header_ptr->magic, vocabulary_magic, sizeof(vocabulary_magic)) != 0 ||
+      header_ptr->version != vocabulary_version || header_ptr->descriptor_size != uint32_t(descriptor_size) ||
+      header_ptr->node_count == 0 || size != get_vocabulary_buffer_size(header_ptr->node_count, header_ptr->word_count)) {
+    fprintf(stderr, "ERROR! Invalid vocabulary: %s\n", path);
+    munmap(mapping_ptr, size);
+    return false;
+  }
+
+  vocabulary_ptr->buffer_ptr = static_cast<unsigned char*>(mapping_ptr);
+  vocabulary_ptr->buffer_size = size;
+  vocabulary_ptr->mapped = true;
+  bind_vocabulary_buffer(vocabulary_ptr);
+  return true;
+}
+
+bool save_vocabulary(const Vocabulary* vocabulary_ptr, const char* path) {
+  FILE* fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    fprintf(stderr, "ERROR! Unable to write vocabulary: %s\n", path);
+    return false;
+  }
+  const size_t written = fwrite(vocabulary_ptr->buffer_ptr, 1, vocabulary_ptr->buffer_size, fp);
+  const bool closed = fclose(fp) == 0;
+  if (written != vocabulary_ptr->buffer_size || !closed) {
+    fprintf(stderr, "ERROR! Unable to write vocabulary: %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+void free_vocabulary(Vocabulary* vocabulary_ptr) {
+  if (vocabulary_ptr->mapped) {
+    munmap(vocabulary_ptr->buffer_ptr, vocabulary_ptr->buffer_size);
+  } else {
+    std::free(vocabulary_ptr->buffer_ptr);
+  }
+  *vocabulary_ptr = {};
+}
+
+// Leaf reached from the root by always taking the closest child.
+int get_word(const Vocabulary* vocabulary_ptr, const unsigned char* descriptor_ptr) {
+  int node = 0;
+  while (vocabulary_ptr->first_children_ptr[node] >= 0) {
+    const int first_child = vocabulary_ptr->first_children_ptr[node];
+    const int child_end = first_child + vocabulary_ptr->child_counts_ptr[node];
+    int best_distance = no_match_distance;
+    for (int child = first_child; child < child_end; ++child) {
+      const int distance = hamming_distance(descriptor_ptr, vocabulary_ptr->node_descriptors_ptr + descriptor_size * child);
+      if (distance < best_distance) {
+        best_distance = distance;
+        node = child;
+      }
+    }
+  }
+  return vocabulary_ptr->node_words_ptr[node];
+}
+
+// Sparse tf-idf histogram of an image, sorted by word and L1 normalized.
+struct BowVector {
+  std::vector<int> words;
+  std::vector<float> weights;
+};
+
+// Quantizes every descriptor into words_ptr, one word per descriptor, and
+// builds the bag of words of the image from them.
+void compute_bow_vector(BowVector* bow_vector_ptr,
+                        int* words_ptr,
+                        const Vocabulary* vocabulary_ptr,
+                        const Descriptors* descriptors_ptr) {
+  const int count = descriptors_ptr->count;
+  for (int index = 0; index < count; ++index) {
+    words_ptr[index] = get_word(vocabulary_ptr, get_descriptor_ptr(index, descriptors_ptr));
+  }
+
+  std::vector<int> sorted_words(words_ptr, words_ptr + count);
+  std::sort(sorted_words.begin(), sorted_words.end());
+
+  bow_vector_ptr->words.clear();
+  bow_vector_ptr->weights.clear();
+  double total = 0.0;
+  for (int begin = 0; begin < count;) {
+    int end = begin + 1;
+    while (end < count && sorted_words[end] == sorted_words[begin]) {
+      ++end;
+    }
+    const float weight = float(end - begin) * vocabulary_ptr->word_weights_ptr[sorted_words[begin]];
+    if (weight > 0.0f) {
+      bow_vector_ptr->words.push_back(sorted_words[begin]);
+      bow_vector_ptr->weights.push_back(weight);
+      total += weight;
+    }
+    begin = end;
+  }
+
+  if (total > 0.0) {
+    const float inverse_total = float(1.0 / total);
+    for (float& weight : bow_vector_ptr->weights) {
+      weight *= inverse_total;
+    }
+  }
+}
+
+// Contribution of one word shared by two L1 normalized vectors to their
+// similarity 1 - |a - b|_1 / 2, which only depends on the common words.
+float get_bow_word_score(float a, float b) {
+  return 0.5f * (a + b - std::fabs(a - b));
+}
+
+// Similarity in [0, 1], 1 for identical histograms.
+float score_bow_vectors(const BowVector* a_ptr, const BowVector* b_ptr) {
+  float score = 0.0f;
+  size_t a_index = 0;
+  size_t b_index = 0;
+  while (a_index < a_ptr->words.size() && b_index < b_ptr->words.size()) {
+    const int a_word = a_ptr->words[a_index];
+    const int b_word = b_ptr->words[b_index];
+    if (a_word == b_word) {
+      score += get_bow_word_score(a_ptr->weights[a_index++], b_ptr->weights[b_index++]);
+    } else if (a_word < b_word) {
+      ++a_index;
+    } else {
+      ++b_index;
+    }
+  }
+  return score;
+}
+
+struct VocabularyTrainingParameters {
+  int branching = 10;
+  // Levels below the root, branching^depth words at most.
+  int depth = 6;
+  int max_iterations = 10;
+  uint32_t seed = 1;
+};
+
+// Bitwise majority of the descriptors in a cluster, the Hamming median.
+void compute_descriptor_median(unsigned char* median_ptr,
+                               const Descriptors* descriptors_ptr,
+                               const int* indices_ptr,
+                               const int* labels_ptr,
+                               int count,
+                               int label) {
+  int bit_counts[8 * descriptor_size] = {};
+  int member_count = 0;
+  for (int index = 0; index < count; ++index) {
+    if (labels_ptr[index] != label) {
+      continue;
+    }
+    const unsigned char* descriptor_ptr = get_descriptor_ptr(indices_ptr[index], descriptors_ptr);
+    for (int bit = 0; bit < 8 * descriptor_size; ++bit) {
+      bit_counts[bit] += (descriptor_ptr[bit / 8] >> (bit % 8)) & 1;
+    }
+    ++member_count;
+  }
+
+  std::memset(median_ptr, 0, descriptor_size);
+  for (int bit = 0; bit < 8 * descriptor_size; ++bit) {
+    if (2 * bit_counts[bit] > member_count) {
+      median_ptr[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+}
+
+// k-medians of the given descriptors with k-means++ seeding. Writes up to k
+// centers and the center of every descriptor, returns the number of
+// non-empty clusters, which are numbered first.
+int cluster_descriptors(std::vector<unsigned char>* centers_ptr,
+                        int* labels_ptr,
+                        const Descriptors* descriptors_ptr,
+                        const int* indices_ptr,
+                        int count,
+                        int k,
+                        int max_iterations,
+                        std::mt19937* rng_ptr) {
+  centers_ptr->clear();
+  if (count <= k) {
+    for (int index = 0; index < count; ++index) {
+      const unsigned char* descriptor_ptr = get_descriptor_ptr(indices_ptr[index], descriptors_ptr);
+      centers_ptr->insert(centers_ptr->end(), descriptor_ptr, descriptor_ptr + descriptor_size);
+      labels_ptr[index] = index;
+    }
+    return count;
+  }
+
+  // Seeds are drawn with probability proportional to the squared distance
+  // to the closest seed so far.
+  std::vector<double> closest_squared(count, INFINITY);
+  int seed_index = std::uniform_int_distribution<int>(0, count - 1)(*rng_ptr);
+  for (int center = 0; center < k; ++center) {
+    const unsigned char* seed_ptr = get_descriptor_ptr(indices_ptr[seed_index], descriptors_ptr);
+    centers_ptr->insert(centers_ptr->end(), seed_ptr, seed_ptr + descriptor_size);
+    double total = 0.0;
+    for (int index = 0; index < count; ++index) {
+      const double distance = hamming_distance(get_descriptor_ptr(indices_ptr[index], descriptors_ptr), seed_ptr);
+      closest_squared[index] = std::min(closest_squared[index], distance * distance);
+      total += closest_squared[index];
+    }
+    if (total == 0.0) {
+      break;
+    }
+    double target = std::uniform_real_distribution<double>(0.0, total)(*rng_ptr);
+    seed_index = count - 1;
+    for (int index = 0; index < count; ++index) {
+      target -= closest_squared[index];
+      if (target <= 0.0 && closest_squared[index] > 0.0) {
+        seed_index = index;
+        break;
+      }
+    }
+  }
+
+  int center_count = int(centers_ptr->size()) / descriptor_size;
+  std::fill(labels_ptr, labels_ptr + count, -1);
+  for (int iteration = 0; iteration < max_iterations; ++iteration) {
+    bool changed = false;
+    for (int index = 0; index < count; ++index) {
+      const unsigned char* descriptor_ptr = get_descriptor_ptr(indices_ptr[index], descriptors_ptr);
+      int best_distance = no_match_distance;
+      int best_center = 0;
+      for (int center = 0; center < center_count; ++center) {
+        const int distance = hamming_distance(descriptor_ptr, centers_ptr->data() + descriptor_size * center);
+        if (distance < best_distance) {
+          best_distance = distance;
+          best_center = center;
+        }
+      }
+      changed |= labels_ptr[index] != best_center;
+      labels_ptr[index] = best_center;
+    }
+    if (!changed) {
+      break;
+    }
+    for (int center = 0; center < center_count; ++center) {
+      compute_descriptor_median(centers_ptr->data() + descriptor_size * center, descriptors_ptr, indices_ptr,
+                                labels_ptr, count, center);
+    }
+  }
+
+  // Drop empty clusters and renumber the rest.
+  std::vector<int> member_counts(center_count, 0);
+  for (int index = 0; index < count; ++index) {
+    ++member_counts[labels_ptr[index]];
+  }
+  std::vector<int> new_labels(center_count, -1);
+  int kept_count = 0;
+  for (int center = 0; center < center_count; ++center) {
+    if (member_counts[center] == 0) {
+      continue;
+    }
+    std::memmove(centers_ptr->data() + descriptor_size * kept_count, centers_ptr->data() + descriptor_size * center,
+                 descriptor_size);
+    new_labels[center] = kept_count++;
+  }
+  centers_ptr->resize(descriptor_size * kept_count);
+  for (int index = 0; index < count; ++index) {
+    labels_ptr[index] = new_labels[labels_ptr[index]];
+  }
+  return kept_count;
+}
+
+// Offline training. descriptors holds the features of image_count training
+// images, stored image after image, and image_indices the image of every
+// descriptor. The tree is built
+// breadth first by recursive k-medians, then every word is weighted by its
+// inverse document frequency log(image_count / images containing the word).
+void train_vocabulary(Vocabulary* vocabulary_ptr,
+                      const Descriptors* descriptors_ptr,
+                      const int* image_indices_ptr,
+                      int image_count,
+                      const VocabularyTrainingParameters& parameters = {}) {
+  struct PendingNode {
+    int node;
+    int level;
+    std::vector<int> indices;
+  };
+
+  std::vector<unsigned char> node_descriptors(descriptor_size, 0);
+  std::vector<int32_t> first_children = { -1 };
+  std::vector<int32_t> child_counts = { 0 };
+  std::vector<int32_t> node_words = { -1 };
+  int word_count = 0;
+
+  std::vector<PendingNode> pending(1);
+  pending[0].node = 0;
+  pending[0].level = 0;
+  pending[0].indices.resize(descriptors_ptr->count);
+  for (int index = 0; index < descriptors_ptr->count; ++index) {
+    pending[0].indices[index] = index;
+  }
+
+  std::mt19937 rng(parameters.seed);
+  std::vector<unsigned char> centers;
+  std::vector<int> labels;
+  // Front to back over a growing list is a breadth first traversal.
+  for (size_t pending_index = 0; pending_index < pending.size(); ++pending_index) {
+    const int node = pending[pending_index].node;
+    const int level = pending[pending_index].level;
+    std::vector<int> indices = std::move(pending[pending_index].indices);
+    const int count = int(indices.size());
+
+    // Nodes with a single descriptor or at the bottom are words.
+    if (level == parameters.depth || count <= 1) {
+      node_words[node] = word_count++;
+      continue;
+    }
+
+    labels.resize(count);
+    const int cluster_count = cluster_descriptors(&centers, labels.data(), descriptors_ptr, indices.data(), count,
+                                                  parameters.branching, parameters.max_iterations, &rng);
+    const int first_child = int(first_children.size());
+    first_children[node] = first_child;
+    child_counts[node] = cluster_count;
+    node_descriptors.insert(node_descriptors.end(), centers.begin(), centers.end());
+    first_children.resize(first_child + cluster_count, -1);
+    child_counts.resize(first_child + cluster_count, 0);
+    node_words.resize(first_child + cluster_count, -1);
+
+    std::vector<std::vector<int>> child_indices(cluster_count);
+    for (int index = 0; index < count; ++index) {
+      child_indices[labels[index]].push_back(indices[index]);
+    }
+    for (int cluster = 0; cluster < cluster_count; ++cluster) {
+      pending.push_back({ first_child + cluster, level + 1, std::move(child_indices[cluster]) });
+    }
+  }
+
+  const int node_count = int(first_children.size());
+  const size_t buffer_size = get_vocabulary_buffer_size(node_count, word_count);
+  // aligned_alloc wants a multiple of the alignment.
+  unsigned char* buffer_ptr = (unsigned char*)std::aligned_alloc(32, (buffer_size + 31) / 32 * 32);
+  std::memset(buffer_ptr, 0, buffer_size);
+
+  VocabularyHeader header = {};
+  std::memcpy(header.magic, vocabulary_magic, sizeof(vocabulary_magic));
+  header.version = vocabulary_version;
+  header.descriptor_size = descriptor_size;
+  header.branching = parameters.branching;
+  header.depth = parameters.depth;
+  header.node_count = node_count;
+  header.word_count = word_count;
+  std::memcpy(buffer_ptr, &header, sizeof(header));
+
+  unsigned char* data_ptr = buffer_ptr + sizeof(VocabularyHeader);
+  std::memcpy(data_ptr, node_descriptors.data(), node_descriptors.size());
+  data_ptr += node_descriptors.size();
+  std::memcpy(data_ptr, first_children.data(), sizeof(int32_t) * node_count);
+  data_ptr += sizeof(int32_t) * node_count;
+  std::memcpy(data_ptr, child_counts.data(), sizeof(int32_t) * node_count);
+  data_ptr += sizeof(int32_t) * node_count;
+  std::memcpy(data_ptr, node_words.data(), sizeof(int32_t) * node_count);
+  data_ptr += sizeof(int32_t) * node_count;
+  float* word_weights_ptr = reinterpret_cast<float*>(data_ptr);
+
+  *vocabulary_ptr = {};
+  vocabulary_ptr->buffer_ptr = buffer_ptr;
+  vocabulary_ptr->buffer_size = buffer_size;
+  vocabulary_ptr->mapped = false;
+  bind_vocabulary_buffer(vocabulary_ptr);
+
+  // Document frequencies, a word counts once per image.
+  std::vector<int> document_counts(word_count, 0);
+  std::vector<int> last_images(word_count, -1);
+  for (int index = 0; index < descriptors_ptr->count; ++index) {
+    const int word = get_word(vocabulary_ptr, get_descriptor_ptr(index, descriptors_ptr));
+    if (last_images[word] != image_indices_ptr[index]) {
+      last_images[word] = image_indices_ptr[index];
+      ++document_counts[word];
+    }
+  }
+  for (int word = 0; word < word_count; ++word) {
+    word_weights_ptr[word] = document_counts[word] > 0 ? float(std::log(double(image_count) / document_counts[word])) : 0.0f;
+  }
+}